@@ -0,0 +1,366 @@
+#include "../headers/Engine.h"
+#include "../headers/lib.h"
+#include "llvm/Support/CommandLine.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/JSON.h"
+#include "llvm/Support/ToolOutputFile.h"
+
+#include <chrono>
+#include <cstdio>
+
+/*
+    Measures each stage of the compiler on its own, over a generated corpus
+    and any source files given on the command line:
+
+      - lex:     tokens/sec of Lexer::gettok over the whole source
+      - parse:   expression nodes/sec of the parser (definitions, externs and
+                 top-level expressions)
+      - codegen: functions/sec of FunctionAST::codegen, which runs the function
+                 pipeline, plus the module pipeline at -O2/-O3
+      - jit:     modules/sec of KaleidoscopeJIT::addModule followed by the
+                 first lookup of the module's function (which compiles it)
+
+    Then it JITs a few kernels through an Engine and measures ns/call of the
+    compiled code. Everything is written as one JSON object, so runs of
+    different versions can be compared.
+
+    Usage: kaleidoscope_bench [-O<n>] [-defs N] [-o file.json] [file.kal ...]
+*/
+
+static cl::list<std::string> InputFilenames(cl::Positional,
+    cl::desc("<source files to measure besides the generated corpus>"));
+
+static cl::opt<char> OptLevel("O",
+    cl::desc("Optimization level. [-O0, -O1, -O2, or -O3] (default = '-O1')"),
+    cl::Prefix, cl::init('1'));
+
+static cl::opt<unsigned> NumSyntheticDefs("defs",
+    cl::desc("Number of definitions in the generated corpus"),
+    cl::init(2000));
+
+static cl::opt<bool> UseJITLink("jitlink",
+    cl::desc("Link with JITLink instead of RuntimeDyld"),
+    cl::init(false));
+
+static cl::opt<std::string> OutputFilename("o",
+    cl::desc("Write the results here (default: stdout)"),
+    cl::value_desc("file"), cl::init("-"));
+
+using Clock = std::chrono::steady_clock;
+
+static double secondsSince(Clock::time_point Start) {
+    return std::chrono::duration<double>(Clock::now() - Start).count();
+}
+
+// def fN(x y) if x < y then (x + y) * (x - y) + N else for i = 1, i < y in fN-1(x * i, y)
+static std::string generateSource(unsigned NumDefs) {
+    std::string Src;
+    for (unsigned I = 0; I != NumDefs; ++I) {
+        std::string N = std::to_string(I);
+        std::string Callee = I ? "f" + std::to_string(I - 1) : "f0";
+        Src += "def f" + N + "(x y) if x < y then (x + y) * (x - y) + " + N +
+               " else for i = 1, i < y in " + Callee + "(x * i, y);\n";
+    }
+    return Src;
+}
+
+static std::unique_ptr<MemoryBuffer> getBuffer(StringRef Src, StringRef Name) {
+    return MemoryBuffer::getMemBuffer(Src, Name, /*RequiresNullTerminator*/ false);
+}
+
+static void measureLexer(StringRef Src, json::OStream &J) {
+    Lexer Lex(getBuffer(Src, "bench"));
+    uint64_t Tokens = 0;
+    auto Start = Clock::now();
+    while (Lex.gettok() != TOK_EOF)
+        ++Tokens;
+    double Seconds = secondsSince(Start);
+
+    J.attributeObject("lex", [&] {
+        J.attribute("tokens", (int64_t)Tokens);
+        J.attribute("tokens_per_sec", Tokens / Seconds);
+    });
+}
+
+// A corpus parsed up front, so that codegen is measured on its own. The
+// expression nodes all stay in the parser's arena until it's destroyed.
+struct ParsedCorpus {
+    std::unique_ptr<Lexer> Lex;
+    std::unique_ptr<Parser> P;
+    std::vector<std::unique_ptr<FunctionAST>> Definitions;
+    std::vector<std::unique_ptr<PrototypeAST>> Externs;
+    unsigned Errors = 0;
+};
+
+static ParsedCorpus measureParser(StringRef Src, json::OStream &J) {
+    ParsedCorpus C;
+    C.Lex = std::make_unique<Lexer>(getBuffer(Src, "bench"));
+    C.P = std::make_unique<Parser>(*C.Lex);
+    Parser &P = *C.P;
+
+    unsigned TopLevelExprs = 0;
+    auto Start = Clock::now();
+    P.getNextToken();
+    while (P.getCurTok() != TOK_EOF) {
+        switch (P.getCurTok()) {
+            case ';':
+                P.getNextToken();
+                break;
+            case TOK_DEF:
+                if (auto FnAST = P.ParseDefinition()) {
+                    // Later definitions may use the operator it defines
+                    const PrototypeAST &Proto = FnAST->getProto();
+                    if (Proto.isBinaryOp())
+                        P.setBinopPrecedence(Proto.getOperatorName(), Proto.getBinaryPrecedence());
+                    C.Definitions.push_back(std::move(FnAST));
+                } else {
+                    ++C.Errors;
+                    P.getNextToken();
+                }
+                break;
+            case TOK_EXTERN:
+                if (auto ProtoAST = P.ParseExtern()) {
+                    C.Externs.push_back(std::move(ProtoAST));
+                } else {
+                    ++C.Errors;
+                    P.getNextToken();
+                }
+                break;
+            default:
+                // Parsed, but never compiled: running it isn't what's measured
+                if (P.ParseTopLevelExpr()) {
+                    ++TopLevelExprs;
+                } else {
+                    ++C.Errors;
+                    P.getNextToken();
+                }
+                break;
+        }
+    }
+    double Seconds = secondsSince(Start);
+    size_t Nodes = P.getASTContext().getNumNodes();
+
+    J.attributeObject("parse", [&] {
+        J.attribute("definitions", (int64_t)C.Definitions.size());
+        J.attribute("externs", (int64_t)C.Externs.size());
+        J.attribute("top_level_exprs", (int64_t)TopLevelExprs);
+        J.attribute("errors", (int64_t)C.Errors);
+        J.attribute("nodes", (int64_t)Nodes);
+        J.attribute("nodes_per_sec", Nodes / Seconds);
+    });
+    return C;
+}
+
+// A module of one definition, and the name to look up to compile it
+struct PendingModule {
+    ThreadSafeModule TSM;
+    std::string Name;
+};
+
+static std::vector<PendingModule> measureCodegen(ParsedCorpus &C, KaleidoscopeJIT &JIT,
+                                                 OptimizationPipeline &Pipeline, json::OStream &J) {
+    PrototypeRegistry Protos;
+    CodegenSession S(JIT, Pipeline, Protos);
+    S.Echo = false;
+    S.reset();
+
+    // Externs first, so definitions can call them
+    for (auto &ProtoAST : C.Externs)
+        if (ProtoAST->codegen(S))
+            Protos.add(std::move(ProtoAST));
+
+    std::vector<PendingModule> Modules;
+    unsigned Failed = 0;
+    auto Start = Clock::now();
+    for (auto &FnAST : C.Definitions) {
+        std::string Name = FnAST->getName();
+        if (!FnAST->codegen(S)) {
+            ++Failed;
+            continue;
+        }
+        Pipeline.run(*S.TheModule);
+        Modules.push_back({S.takeModule(), std::move(Name)});
+    }
+    double Seconds = secondsSince(Start);
+
+    J.attributeObject("codegen", [&] {
+        J.attribute("functions", (int64_t)Modules.size());
+        J.attribute("errors", (int64_t)Failed);
+        J.attribute("functions_per_sec", Modules.size() / Seconds);
+    });
+    return Modules;
+}
+
+static void measureJIT(std::vector<PendingModule> Modules, KaleidoscopeJIT &JIT, json::OStream &J) {
+    unsigned Failed = 0;
+    auto Start = Clock::now();
+    for (auto &M : Modules) {
+        Error Err = JIT.addModule(std::move(M.TSM));
+        if (!Err) {
+            auto Sym = JIT.lookup(M.Name);
+            Err = Sym ? Error::success() : Sym.takeError();
+        }
+        if (Err) {
+            consumeError(std::move(Err));
+            ++Failed;
+        }
+    }
+    double Seconds = secondsSince(Start);
+
+    J.attributeObject("jit", [&] {
+        J.attribute("modules", (int64_t)Modules.size());
+        J.attribute("errors", (int64_t)Failed);
+        J.attribute("modules_per_sec", Modules.size() / Seconds);
+    });
+}
+
+static Error measureCorpus(StringRef Name, StringRef Src, const EngineOptions &Opts, json::OStream &J) {
+    // Each corpus gets a JIT of its own, so its definitions never clash with another's
+    auto JIT = KaleidoscopeJIT::Create(Opts.getJITOptions());
+    if (!JIT)
+        return JIT.takeError();
+    for (auto [Name, Fn] : {std::make_pair("putchard", putchard), std::make_pair("printd", printd)})
+        if (auto Err = (*JIT)->defineAbsolute(Name, ExecutorSymbolDef(ExecutorAddr::fromPtr(Fn),
+                                                                      JITSymbolFlags::Exported | JITSymbolFlags::Callable)))
+            return Err;
+
+    auto TM = (*JIT)->getTargetMachineBuilder().createTargetMachine();
+    if (!TM)
+        return TM.takeError();
+    PipelineOptions PipelineOpts;
+    PipelineOpts.OptLevel = Opts.OptLevel;
+    PipelineOpts.TM = TM->get();
+    OptimizationPipeline Pipeline(PipelineOpts);
+
+    J.object([&] {
+        J.attribute("name", Name);
+        J.attribute("bytes", (int64_t)Src.size());
+        measureLexer(Src, J);
+        ParsedCorpus C = measureParser(Src, J);
+        measureJIT(measureCodegen(C, **JIT, Pipeline, J), **JIT, J);
+    });
+    return Error::success();
+}
+
+/*
+    The kernels whose compiled code is timed. Each is called Calls times with
+    Arg, or over an array of Arg elements for the typed ones.
+*/
+static const char* KernelSource = R"(
+def fib(n) if n < 2 then n else fib(n - 1) + fib(n - 2);
+
+def mandel(cr ci)
+    var zr = 0, zi = 0, t = 0, n = 0 in
+        (for i = 0, i < 255 in
+            if zr * zr + zi * zi > 4 then 0
+            else (t = zr * zr - zi * zi + cr) + (zi = 2 * zr * zi + ci) + (zr = t) + (n = n + 1)) + n;
+
+# A for loop tests its condition after the body, with the variable before
+# the step, so this adds a[0] to a[n - 1] (n > 0)
+def sum(a:double* n:i64)
+    var s in (for i:i64 = 0, i < n - 1 in s = s + a[i]) + s;
+)";
+
+template <typename CallFn>
+static void measureKernel(json::OStream &J, StringRef Name, uint64_t Calls, CallFn Call) {
+    double Sink = 0;
+    Call(Sink); // warm up (and make sure it's compiled)
+    auto Start = Clock::now();
+    for (uint64_t I = 0; I != Calls; ++I)
+        Call(Sink);
+    double Seconds = secondsSince(Start);
+
+    J.object([&] {
+        J.attribute("name", Name);
+        J.attribute("calls", (int64_t)Calls);
+        J.attribute("ns_per_call", Seconds * 1e9 / Calls);
+        J.attribute("result", Sink); // so the calls can't be optimized out
+    });
+}
+
+static Error measureKernels(const EngineOptions &Opts, json::OStream &J) {
+    auto E = Engine::create(Opts);
+    if (!E)
+        return E.takeError();
+    if (auto Err = (*E)->compile(KernelSource))
+        return Err;
+
+    auto Fib = (*E)->lookup("fib");
+    if (!Fib)
+        return Fib.takeError();
+    auto Mandel = (*E)->lookup("mandel");
+    if (!Mandel)
+        return Mandel.takeError();
+    auto Sum = (*E)->lookup("sum");
+    if (!Sum)
+        return Sum.takeError();
+
+    auto *FibFn = Fib->toPtr<double (*)(double)>();
+    auto *MandelFn = Mandel->toPtr<double (*)(double, double)>();
+    auto *SumFn = Sum->toPtr<double (*)(const double*, int64_t)>();
+    std::vector<double> Data(4096, 0.5);
+
+    J.attributeArray("kernels", [&] {
+        measureKernel(J, "fib(25)", 20, [&](double &Sink) { Sink += FibFn(25); });
+        // A point inside the set, so every call runs all the iterations
+        measureKernel(J, "mandel(-0.1, 0.1)", 100000, [&](double &Sink) { Sink += MandelFn(-0.1, 0.1); });
+        measureKernel(J, "sum(4096 doubles)", 100000,
+                      [&](double &Sink) { Sink += SumFn(Data.data(), (int64_t)Data.size()); });
+    });
+    return Error::success();
+}
+
+int main(int argc, char **argv) {
+    cl::ParseCommandLineOptions(argc, argv, "Kaleidoscope compiler benchmarks\n");
+    if (OptLevel < '0' || OptLevel > '3') {
+        fprintf(stderr, "Error: invalid optimization level -O%c\n", (char)OptLevel);
+        return 1;
+    }
+    InitializeNativeTargetOnce();
+
+    EngineOptions Opts;
+    Opts.OptLevel = OptLevel - '0';
+    Opts.JITLink = UseJITLink;
+
+    std::vector<std::pair<std::string, std::unique_ptr<MemoryBuffer>>> Corpora;
+    Corpora.emplace_back("synthetic", MemoryBuffer::getMemBufferCopy(generateSource(NumSyntheticDefs), "synthetic"));
+    for (auto &Filename : InputFilenames) {
+        auto File = MemoryBuffer::getFile(Filename, /*IsText*/ false, /*RequiresNullTerminator*/ false);
+        if (!File) {
+            fprintf(stderr, "Error: could not read %s: %s\n", Filename.c_str(), File.getError().message().c_str());
+            return 1;
+        }
+        Corpora.emplace_back(Filename, std::move(*File));
+    }
+
+    std::error_code EC;
+    ToolOutputFile Out(OutputFilename, EC, sys::fs::OF_Text);
+    if (EC) {
+        fprintf(stderr, "Error: could not open %s: %s\n", OutputFilename.c_str(), EC.message().c_str());
+        return 1;
+    }
+
+    int ExitCode = 0;
+    auto Report = [&](Error Err) {
+        if (Err) {
+            logAllUnhandledErrors(std::move(Err), errs(), "Error: ");
+            ExitCode = 1;
+        }
+    };
+
+    {
+        json::OStream J(Out.os(), /*IndentSize*/ 2);
+        J.object([&] {
+            J.attribute("opt_level", (int64_t)Opts.OptLevel);
+            J.attribute("linker", Opts.JITLink ? "jitlink" : "rtdyld");
+            J.attributeArray("corpora", [&] {
+                for (auto &[Name, Buffer] : Corpora)
+                    Report(measureCorpus(Name, Buffer->getBuffer(), Opts, J));
+            });
+            Report(measureKernels(Opts, J));
+        });
+    }
+    Out.os() << "\n";
+    Out.keep();
+    return ExitCode;
+}
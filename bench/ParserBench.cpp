@@ -0,0 +1,89 @@
+#include "../headers/Parser.h"
+
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <new>
+
+/*
+    Measures the front end on its own: lexing and parsing a generated source of
+    many definitions, each freed (clearAST) right after it's parsed, the way
+    the driver does once a definition has been compiled.
+
+    Every heap allocation made while parsing is counted (by replacing the
+    global operator new), and reported per AST node created. Expression nodes
+    come from the parser's arena, so what's left is the arena's own slabs and
+    the per-definition prototype and FunctionAST.
+
+    Usage: parser_bench [number of definitions]
+*/
+
+static std::atomic<uint64_t> NumAllocations{0};
+
+void* operator new(size_t Size) {
+    ++NumAllocations;
+    if (void* P = malloc(Size ? Size : 1))
+        return P;
+    throw std::bad_alloc();
+}
+
+void* operator new[](size_t Size) {
+    return operator new(Size);
+}
+
+void operator delete(void* P) noexcept { free(P); }
+void operator delete[](void* P) noexcept { free(P); }
+void operator delete(void* P, size_t) noexcept { free(P); }
+void operator delete[](void* P, size_t) noexcept { free(P); }
+
+// def fN(x y) if x < y then (x + y) * (x - y) + N else for i = 1, i < y in fN-1(x * i, y)
+static std::string generateSource(unsigned NumDefs) {
+    std::string Src;
+    for (unsigned I = 0; I != NumDefs; ++I) {
+        std::string N = std::to_string(I);
+        std::string Callee = I ? "f" + std::to_string(I - 1) : "f0";
+        Src += "def f" + N + "(x y) if x < y then (x + y) * (x - y) + " + N +
+               " else for i = 1, i < y in " + Callee + "(x * i, y);\n";
+    }
+    return Src;
+}
+
+int main(int argc, char **argv) {
+    unsigned NumDefs = argc > 1 ? (unsigned)atoi(argv[1]) : 100000;
+    if (NumDefs == 0)
+        NumDefs = 1;
+
+    std::string Src = generateSource(NumDefs);
+    Lexer Lex(MemoryBuffer::getMemBuffer(Src, "bench", /*RequiresNullTerminator*/ false));
+    Parser P(Lex);
+
+    uint64_t AllocationsBefore = NumAllocations;
+    auto Start = std::chrono::steady_clock::now();
+
+    unsigned Parsed = 0;
+    P.getNextToken();
+    while (P.getCurTok() != TOK_EOF) {
+        if (P.getCurTok() != TOK_DEF) {
+            P.getNextToken();
+            continue;
+        }
+        if (!P.ParseDefinition()) {
+            fprintf(stderr, "parse error in definition %u\n", Parsed);
+            return 1;
+        }
+        ++Parsed;
+        P.clearAST();
+    }
+
+    std::chrono::duration<double, std::nano> Elapsed = std::chrono::steady_clock::now() - Start;
+    uint64_t Allocations = NumAllocations - AllocationsBefore;
+    size_t Nodes = P.getASTContext().getNumNodes();
+
+    printf("definitions:        %u\n", Parsed);
+    printf("expression nodes:   %zu\n", Nodes);
+    printf("heap allocations:   %llu\n", (unsigned long long)Allocations);
+    printf("allocations / node: %.3f\n", (double)Allocations / Nodes);
+    printf("time / node:        %.1f ns\n", Elapsed.count() / Nodes);
+    return 0;
+}
@@ -0,0 +1,97 @@
+#include "../headers/Pipeline.h"
+#include "llvm/IR/IRBuilder.h"
+#include "llvm/IR/Module.h"
+#include "llvm/Transforms/InstCombine/InstCombine.h"
+#include "llvm/Transforms/Scalar/GVN.h"
+#include "llvm/Transforms/Scalar/Reassociate.h"
+#include "llvm/Transforms/Scalar/SimplifyCFG.h"
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+
+/*
+    Measures the per-definition cost of setting up the optimizer, the way the
+    REPL does it for every `def`:
+
+      - rebuild: a fresh set of analysis managers, instrumentation, pass builder
+                 and function pass manager for each definition (what
+                 InitializeModuleAndManagers used to do)
+      - reuse:   one OptimizationPipeline shared by all definitions
+
+    Each definition gets its own context and module in both cases, and the IR
+    is the same as `def fN(x y) (x+y)*(x+y) + N` would produce.
+
+    Usage: pipeline_bench [number of definitions]
+*/
+
+static Function* emitDefinition(Module &M, unsigned N) {
+    LLVMContext &Ctx = M.getContext();
+    IRBuilder<> Builder(Ctx);
+
+    Type* DoubleTy = Type::getDoubleTy(Ctx);
+    FunctionType* FT = FunctionType::get(DoubleTy, {DoubleTy, DoubleTy}, false);
+    Function* F = Function::Create(FT, Function::ExternalLinkage, "f" + std::to_string(N), &M);
+
+    Builder.SetInsertPoint(BasicBlock::Create(Ctx, "entry", F));
+    Value* X = F->getArg(0);
+    Value* Y = F->getArg(1);
+    Value* L = Builder.CreateFAdd(X, Y, "addtmp");
+    Value* R = Builder.CreateFAdd(X, Y, "addtmp");
+    Value* Sq = Builder.CreateFMul(L, R, "multmp");
+    Builder.CreateRet(Builder.CreateFAdd(Sq, ConstantFP::get(Ctx, APFloat((double)N)), "addtmp"));
+    return F;
+}
+
+static void runWithFreshManagers(Function &F) {
+    LLVMContext &Ctx = F.getContext();
+
+    FunctionPassManager FPM;
+    LoopAnalysisManager LAM;
+    FunctionAnalysisManager FAM;
+    CGSCCAnalysisManager CGAM;
+    ModuleAnalysisManager MAM;
+    PassInstrumentationCallbacks PIC;
+    StandardInstrumentations SI(Ctx, /*DebugLogging*/ false);
+    SI.registerCallbacks(PIC, &MAM);
+
+    FPM.addPass(InstCombinePass());
+    FPM.addPass(ReassociatePass());
+    FPM.addPass(GVNPass());
+    FPM.addPass(SimplifyCFGPass());
+
+    PassBuilder PB;
+    PB.registerModuleAnalyses(MAM);
+    PB.registerFunctionAnalyses(FAM);
+    PB.crossRegisterProxies(LAM, FAM, CGAM, MAM);
+
+    FPM.run(F, FAM);
+}
+
+template <typename RunFn>
+static double nsPerDefinition(unsigned NumDefs, RunFn Run) {
+    auto Start = std::chrono::steady_clock::now();
+    for (unsigned I = 0; I != NumDefs; ++I) {
+        LLVMContext Ctx;
+        Module M("KaleidoscopeJIT", Ctx);
+        Run(*emitDefinition(M, I));
+    }
+    std::chrono::duration<double, std::nano> Elapsed = std::chrono::steady_clock::now() - Start;
+    return Elapsed.count() / NumDefs;
+}
+
+int main(int argc, char **argv) {
+    unsigned NumDefs = argc > 1 ? (unsigned)atoi(argv[1]) : 10000;
+    if (NumDefs == 0)
+        NumDefs = 1;
+
+    OptimizationPipeline Pipeline;
+    double Rebuild = nsPerDefinition(NumDefs, runWithFreshManagers);
+    double Reuse = nsPerDefinition(NumDefs, [&](Function &F) { Pipeline.run(F); });
+
+    printf("definitions:        %u\n", NumDefs);
+    printf("rebuild per def:    %.0f ns\n", Rebuild);
+    printf("reuse pipeline:     %.0f ns\n", Reuse);
+    printf("saved per def:      %.0f ns (%.1fx)\n", Rebuild - Reuse, Rebuild / Reuse);
+    return 0;
+}
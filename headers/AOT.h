@@ -0,0 +1,51 @@
+#ifndef __AOT_H__
+#define __AOT_H__
+
+#include "Engine.h"
+
+/*
+    =============================================
+    ========= AHEAD-OF-TIME COMPILATION =========
+    =============================================
+*/
+
+/*
+    AOTCompiler - Compiles the definitions and externs of one or more files
+    into a single module, through the same parser and codegen as the JIT, and
+    writes it out as an object file or static library plus a C header
+    declaring the functions defined in it.
+
+    Top-level expressions are skipped (with a warning), since there's nothing
+    to run them; a function may only be defined once.
+*/
+class AOTCompiler {
+    EngineOptions Opts;
+    std::unique_ptr<TargetMachine> TM;
+    std::unique_ptr<OptimizationPipeline> Pipeline;
+    PrototypeRegistry Protos;
+    DenseSet<SymbolID> BatchFunctions;
+    std::unique_ptr<ExecutionProfile> Profile; // with ProfileUse
+    std::unique_ptr<CodegenSession> Session;
+
+    explicit AOTCompiler(const EngineOptions &Opts);
+    Error init();
+
+public:
+    // Compile for the target the JIT would use with Opts (the host).
+    static Expected<std::unique_ptr<AOTCompiler>> create(const EngineOptions &Opts = EngineOptions());
+
+    // Compile Filename ("-" for stdin) into the module.
+    Error addFile(StringRef Filename);
+
+    /*
+        Optimize the module and write it to Filename: a static library holding
+        a single object if the name ends in ".a", otherwise an object file.
+        Call it once, after the last addFile().
+    */
+    Error writeObject(StringRef Filename);
+
+    // Write a C header declaring the functions the module defines.
+    Error writeHeader(StringRef Filename);
+};
+
+#endif
@@ -2,150 +2,360 @@
 #define __AST_H__
 
 #include "common.h"
+#include "Symbols.h"
+#include "llvm/Support/Allocator.h"
+#include "llvm/Support/Casting.h"
+
+#include <type_traits>
+
+class CodegenSession;
 /*
     ==============================================
-    ========= AST (Abstract Syntax Tree) ========= 
+    ========= AST (Abstract Syntax Tree) =========
     ==============================================
 */
 
 /*
-    The AST for a program captures its behavior in such a way that it is easy for later stages 
-    of the compiler (e.g. code generation) to interpret. 
+    The AST for a program captures its behavior in such a way that it is easy for later stages
+    of the compiler (e.g. code generation) to interpret.
 
-    We basically want one object for each construct in the language. In Kaleidoscope, 
+    We basically want one object for each construct in the language. In Kaleidoscope,
     we have expressions, a prototype, and a function object.
+
+    Expression nodes are allocated from an ASTContext and never destroyed one
+    by one: the whole tree goes away when the context is reset. So they only
+    hold plain pointers to their children, and names as SymbolIDs.
 */
 
-// base class for all expression nodes in the AST 
-// Note: This is an abstract class
-namespace {
-    class ExprAST {
-    public:
-        virtual ~ExprAST() = default;
-        
-        /*
-            The codegen() method says to emit IR for that AST node along with all the 
-            things it depends on, and they all return an LLVM Value object. 
-            
-            “Value” is the class used to represent a 
-            “Static Single Assignment (SSA) register” 
-            or “SSA value” in LLVM. 
-        */
-        virtual Value* codegen() = 0;
-    };
+/*
+    ASTContext - Owns the expression nodes of the item being parsed (a bump
+    allocator reset once the item has been compiled), and caches the IDs of the
+    names it has seen so the shared SymbolTable is only asked once per name.
+*/
+class ASTContext {
+    BumpPtrAllocator Nodes;
+    StringMap<SymbolID> Symbols;
+    size_t NumNodes = 0;
 
-    // number node
-    class NumberExprAST : public ExprAST {
-        double Val;
-        
-    public:
-        NumberExprAST(double Val) : Val(Val) {}
-        Value* codegen() override;
-    };
+public:
+    template <typename T, typename... ArgTs>
+    T* create(ArgTs &&...Args) {
+        static_assert(std::is_trivially_destructible<T>::value,
+                      "AST nodes are freed with their context, without running destructors");
+        ++NumNodes;
+        return new (Nodes.Allocate(sizeof(T), alignof(T))) T(std::forward<ArgTs>(Args)...);
+    }
 
-    // variable/identifier node
-    class VariableExprAST : public ExprAST {
-        std::string Name;
+    // Copy a list of children into the context.
+    template <typename T>
+    ArrayRef<T> copy(ArrayRef<T> Elts) {
+        T* Mem = Nodes.Allocate<T>(Elts.size());
+        std::uninitialized_copy(Elts.begin(), Elts.end(), Mem);
+        return ArrayRef<T>(Mem, Elts.size());
+    }
 
-    public:
-        VariableExprAST(const std::string &Name) : Name(Name) {}
-        Value* codegen() override;
-    };
+    SymbolID intern(StringRef Name) {
+        auto I = Symbols.try_emplace(Name, 0);
+        if (I.second)
+            I.first->second = SymbolTable::get().intern(Name);
+        return I.first->second;
+    }
 
-    // binary expression node
-    class BinaryExprAST : public ExprAST {
-        char Op; // operator of binary expr (e.g. '+', '-', '*', '/')
-        std::unique_ptr<ExprAST> LHS, RHS; // left & right hand sides of the expression (e.g. operands)
+    // Free every node at once.
+    void reset() { Nodes.Reset(); }
 
-    public:
-        BinaryExprAST(char Op, std::unique_ptr<ExprAST> LHS, std::unique_ptr<ExprAST> RHS) 
-            : Op(Op), LHS(std::move(LHS)), RHS(std::move(RHS)) {}
-        Value* codegen() override;
-    };
+    size_t getNumNodes() const { return NumNodes; }
+};
 
-    class UnaryExprAST : public ExprAST {
-        char Opcode;
-        std::unique_ptr<ExprAST> Operand;
+/*
+    ValueType - The type of a value: double, unless annotated otherwise
+    (`x : i64`). Comparisons produce bools, and arithmetic mixing types is done
+    in the wider one (bool < i64 < f32 < double). Arrays are pointers to
+    buffers provided by the caller, which can be indexed (`a[i]`) and stored
+    to (`a[i] = v`), but not created.
+*/
+enum class ValueType : uint8_t {
+    Double,
+    F32,
+    I64,
+    Bool,
+    DoubleArray, // double*
+    F32Array     // f32*
+};
 
-    public:
-        UnaryExprAST(char Opcode, std::unique_ptr<ExprAST> Operand)
-            : Opcode(Opcode), Operand(std::move(Operand)) {}
+inline bool isArrayType(ValueType Ty) {
+    return Ty == ValueType::DoubleArray || Ty == ValueType::F32Array;
+}
 
-        Value* codegen() override;
-    };
+// The type of the elements of an array type.
+inline ValueType getElementType(ValueType Ty) {
+    assert(isArrayType(Ty) && "not an array type");
+    return Ty == ValueType::F32Array ? ValueType::F32 : ValueType::Double;
+}
 
-    class CallExprAST : public ExprAST {
-        std::string Callee;
-        std::vector<std::unique_ptr<ExprAST>> Args;
+// The name of Ty in the source ("double", "i64", "f32*", ...)
+StringRef getTypeName(ValueType Ty);
 
-    public:
-        CallExprAST(const std::string &Callee, std::vector<std::unique_ptr<ExprAST>> Args) 
-            : Callee(Callee), Args(std::move(Args)) {}
-        Value* codegen() override;
+// base class for all expression nodes in the AST
+// Note: only its subclasses are ever created
+class ExprAST {
+public:
+    // Which subclass a node is, for isa<>/cast<>/dyn_cast<>
+    enum ExprKind {
+        EK_Number,
+        EK_Variable,
+        EK_Index,
+        EK_Binary,
+        EK_Unary,
+        EK_Call,
+        EK_If,
+        EK_For,
+        EK_Var
     };
 
-    class IfExprAST : public ExprAST {
-        std::unique_ptr<ExprAST> Cond, Then, Else;
-    public:
-        IfExprAST(std::unique_ptr<ExprAST> Cond, std::unique_ptr<ExprAST> Then,std::unique_ptr<ExprAST> Else) :
-            Cond(std::move(Cond)), Then(std::move(Then)), Else(std::move(Else)) {}
+    ExprKind getKind() const { return Kind; }
 
-        Value* codegen() override;
-    };
+    /*
+        The codegen() method says to emit IR for that AST node along with all the
+        things it depends on, and they all return an LLVM Value object.
 
-    /* 
-        PrototypeAST - This class represents the "prototype" for a function,
-        which captures its name, and its argument names (thus implicitly the number
-        of arguments the function takes).
+        “Value” is the class used to represent a
+        “Static Single Assignment (SSA) register”
+        or “SSA value” in LLVM.
+
+        It switches on the kind of node to the subclass' codegen().
     */
+    Value* codegen(CodegenSession &S);
 
-    class ForExprAST : public ExprAST {
-        std::string VarName;
-        std::unique_ptr<ExprAST> Start, End, Step, Body;
-    public:
-        ForExprAST(const std::string &VarName, std::unique_ptr<ExprAST> Start,
-            std::unique_ptr<ExprAST> End, std::unique_ptr<ExprAST> Step, 
-            std::unique_ptr<ExprAST> Body) : VarName(VarName), Start(std::move(Start)), 
-            End(std::move(End)), Step(std::move(Step)), Body(std::move(Body)) {}
-    
-        Value* codegen() override;
-    };
+    // Print the expression as an s-expression (names as their symbol IDs).
+    // Two expressions print the same exactly if they have the same structure.
+    void print(raw_ostream &OS) const;
 
-    class PrototypeAST {
-        std::string Name;
-        std::vector<std::string> Args;
+protected:
+    ExprAST(ExprKind Kind) : Kind(Kind) {}
 
-        bool isOperator;
-        unsigned Precedence; // Precedence if binay operator
+private:
+    const ExprKind Kind;
+};
 
-    public:
-        PrototypeAST(const std::string &Name, std::vector<std::string> Args, bool isOperator = false, unsigned Prec = 0)
-            : Name(Name), Args(std::move(Args)), isOperator(isOperator), Precedence(Prec) {}
-        
-        const std::string &getName() const { return Name; }
-        Function* codegen();
+// number node
+class NumberExprAST : public ExprAST {
+    double Val;
 
-        bool isUnaryOp() const { return isOperator && Args.size() == 1;}
-        bool isBinaryOp() const { return isOperator && Args.size() == 2; }
+public:
+    NumberExprAST(double Val) : ExprAST(EK_Number), Val(Val) {}
+    Value* codegen(CodegenSession &S);
+    void print(raw_ostream &OS) const;
 
-        char getOperatorName() const {
-            assert(isUnaryOp() || isBinaryOp());
-            return Name[Name.size() - 1];
-        }
+    static bool classof(const ExprAST *E) { return E->getKind() == EK_Number; }
+};
 
-        unsigned getBinaryPrecedence() const { return Precedence; }
-    };
+// variable/identifier node
+class VariableExprAST : public ExprAST {
+    SymbolID Name;
+
+public:
+    VariableExprAST(SymbolID Name) : ExprAST(EK_Variable), Name(Name) {}
+    SymbolID getName() const { return Name; }
+    Value* codegen(CodegenSession &S);
+    void print(raw_ostream &OS) const;
+
+    static bool classof(const ExprAST *E) { return E->getKind() == EK_Variable; }
+};
+
+// array element node: Name[Index], where Name is an array variable
+class IndexExprAST : public ExprAST {
+    SymbolID Name;
+    ExprAST* Index;
+
+public:
+    IndexExprAST(SymbolID Name, ExprAST* Index) : ExprAST(EK_Index), Name(Name), Index(Index) {}
+    SymbolID getName() const { return Name; }
+    ExprAST* getIndex() const { return Index; }
+    Value* codegen(CodegenSession &S);
+    void print(raw_ostream &OS) const;
+
+    static bool classof(const ExprAST *E) { return E->getKind() == EK_Index; }
+};
+
+// binary expression node
+class BinaryExprAST : public ExprAST {
+    char Op; // operator of binary expr (e.g. '+', '-', '*', '/')
+    ExprAST *LHS, *RHS; // left & right hand sides of the expression (e.g. operands)
+
+public:
+    BinaryExprAST(char Op, ExprAST* LHS, ExprAST* RHS)
+        : ExprAST(EK_Binary), Op(Op), LHS(LHS), RHS(RHS) {}
+    char getOp() const { return Op; }
+    ExprAST* getLHS() const { return LHS; }
+    ExprAST* getRHS() const { return RHS; }
+    Value* codegen(CodegenSession &S);
+    void print(raw_ostream &OS) const;
+
+    static bool classof(const ExprAST *E) { return E->getKind() == EK_Binary; }
+};
+
+class UnaryExprAST : public ExprAST {
+    char Opcode;
+    ExprAST* Operand;
+
+public:
+    UnaryExprAST(char Opcode, ExprAST* Operand)
+        : ExprAST(EK_Unary), Opcode(Opcode), Operand(Operand) {}
+    char getOpcode() const { return Opcode; }
+    ExprAST* getOperand() const { return Operand; }
+
+    Value* codegen(CodegenSession &S);
+    void print(raw_ostream &OS) const;
 
-    // FunctionAST - This class represents a function definition itself.
-    class FunctionAST {
-        std::unique_ptr<PrototypeAST> Proto;
-        std::unique_ptr<ExprAST> Body;
+    static bool classof(const ExprAST *E) { return E->getKind() == EK_Unary; }
+};
 
-    public:
-        FunctionAST(std::unique_ptr<PrototypeAST> Proto, std::unique_ptr<ExprAST> Body)
-            : Proto(std::move(Proto)), Body(std::move(Body)) {}
-        Function* codegen();
+class CallExprAST : public ExprAST {
+    SymbolID Callee;
+    ArrayRef<ExprAST*> Args;
+
+public:
+    CallExprAST(SymbolID Callee, ArrayRef<ExprAST*> Args)
+        : ExprAST(EK_Call), Callee(Callee), Args(Args) {}
+    SymbolID getCallee() const { return Callee; }
+    ArrayRef<ExprAST*> getArgs() const { return Args; }
+    Value* codegen(CodegenSession &S);
+    void print(raw_ostream &OS) const;
+
+    static bool classof(const ExprAST *E) { return E->getKind() == EK_Call; }
+};
+
+class IfExprAST : public ExprAST {
+    ExprAST *Cond, *Then, *Else;
+public:
+    IfExprAST(ExprAST* Cond, ExprAST* Then, ExprAST* Else)
+        : ExprAST(EK_If), Cond(Cond), Then(Then), Else(Else) {}
+    ExprAST* getCond() const { return Cond; }
+    ExprAST* getThen() const { return Then; }
+    ExprAST* getElse() const { return Else; }
+
+    Value* codegen(CodegenSession &S);
+    void print(raw_ostream &OS) const;
+
+    static bool classof(const ExprAST *E) { return E->getKind() == EK_If; }
+};
+
+class ForExprAST : public ExprAST {
+    SymbolID VarName;
+    ValueType VarType;
+    ExprAST *Start, *End, *Step, *Body; // Step is null if not given
+public:
+    ForExprAST(SymbolID VarName, ValueType VarType, ExprAST* Start, ExprAST* End, ExprAST* Step, ExprAST* Body)
+        : ExprAST(EK_For), VarName(VarName), VarType(VarType), Start(Start), End(End), Step(Step), Body(Body) {}
+    ExprAST* getStart() const { return Start; }
+    ExprAST* getEnd() const { return End; }
+    ExprAST* getStep() const { return Step; }
+    ExprAST* getBody() const { return Body; }
+
+    Value* codegen(CodegenSession &S);
+    void print(raw_ostream &OS) const;
+
+    static bool classof(const ExprAST *E) { return E->getKind() == EK_For; }
+};
+
+// var/in node: local variables, which can be assigned with '=', in scope for Body
+class VarExprAST : public ExprAST {
+public:
+    struct Binding {
+        SymbolID Name;
+        ValueType Type;
+        ExprAST* Init; // null if not given, for 0 (or a null array)
     };
-}
 
-#endif
\ No newline at end of file
+private:
+    ArrayRef<Binding> Vars;
+    ExprAST* Body;
+
+public:
+    VarExprAST(ArrayRef<Binding> Vars, ExprAST* Body)
+        : ExprAST(EK_Var), Vars(Vars), Body(Body) {}
+    ArrayRef<Binding> getVars() const { return Vars; }
+    ExprAST* getBody() const { return Body; }
+
+    Value* codegen(CodegenSession &S);
+    void print(raw_ostream &OS) const;
+
+    static bool classof(const ExprAST *E) { return E->getKind() == EK_Var; }
+};
+
+/*
+    PrototypeAST - This class represents the "prototype" for a function,
+    which captures its name, and its argument names (thus implicitly the number
+    of arguments the function takes) and types, and its return type.
+
+    Prototypes outlive the item they were parsed in (they're registered for
+    later calls), so unlike expressions they're heap allocated and own their names.
+*/
+class PrototypeAST {
+    std::string Name;
+    std::vector<std::string> Args;
+    SymbolID NameID;
+    std::vector<SymbolID> ArgIDs;
+    std::vector<ValueType> ArgTypes;
+    ValueType ReturnType;
+
+    bool isOperator;
+    unsigned Precedence; // Precedence if binay operator
+
+public:
+    // ArgTypes may be left empty for all doubles.
+    PrototypeAST(const std::string &Name, std::vector<std::string> Args, bool isOperator = false, unsigned Prec = 0,
+                 std::vector<ValueType> ArgTypes = {}, ValueType ReturnType = ValueType::Double)
+        : Name(Name), Args(std::move(Args)), ArgTypes(std::move(ArgTypes)), ReturnType(ReturnType),
+          isOperator(isOperator), Precedence(Prec) {
+        SymbolTable &Symbols = SymbolTable::get();
+        NameID = Symbols.intern(this->Name);
+        for (auto &Arg : this->Args)
+            ArgIDs.push_back(Symbols.intern(Arg));
+        if (this->ArgTypes.empty())
+            this->ArgTypes.resize(this->Args.size(), ValueType::Double);
+        assert(this->ArgTypes.size() == this->Args.size() && "one type per argument");
+    }
+
+    const std::string &getName() const { return Name; }
+    SymbolID getNameID() const { return NameID; }
+    ArrayRef<std::string> getArgs() const { return Args; }
+    ArrayRef<SymbolID> getArgIDs() const { return ArgIDs; }
+    ArrayRef<ValueType> getArgTypes() const { return ArgTypes; }
+    ValueType getReturnType() const { return ReturnType; }
+
+    // Whether it takes and returns only doubles, so it can be called as a double (*)(double, ...)
+    bool hasDoubleSignature() const {
+        return ReturnType == ValueType::Double && llvm::all_of(ArgTypes, [](ValueType Ty) { return Ty == ValueType::Double; });
+    }
+
+    Function* codegen(CodegenSession &S) const;
+
+    bool isUnaryOp() const { return isOperator && Args.size() == 1;}
+    bool isBinaryOp() const { return isOperator && Args.size() == 2; }
+
+    char getOperatorName() const {
+        assert(isUnaryOp() || isBinaryOp());
+        return Name[Name.size() - 1];
+    }
+
+    unsigned getBinaryPrecedence() const { return Precedence; }
+};
+
+// FunctionAST - This class represents a function definition itself.
+class FunctionAST {
+    std::shared_ptr<PrototypeAST> Proto; // shared with the PrototypeRegistry once generated
+    ExprAST* Body; // owned by the ASTContext it was parsed into
+
+public:
+    FunctionAST(std::unique_ptr<PrototypeAST> Proto, ExprAST* Body)
+        : Proto(std::move(Proto)), Body(Body) {}
+
+    const std::string &getName() const { return Proto->getName(); }
+    const PrototypeAST &getProto() const { return *Proto; }
+    ExprAST* getBody() const { return Body; }
+    Function* codegen(CodegenSession &S);
+};
+
+#endif
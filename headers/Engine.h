@@ -0,0 +1,214 @@
+#ifndef __ENGINE_H__
+#define __ENGINE_H__
+
+#include "Incremental.h"
+
+#include <mutex>
+
+/*
+    =================================
+    ========= EMBEDDING API =========
+    =================================
+*/
+
+struct EngineOptions {
+    // IR optimization level, see PipelineOptions::OptLevel (also picks the code generator's level)
+    unsigned OptLevel = 1;
+
+    // Generate code for the host CPU and its features instead of the generic target
+    bool HostCPU = false;
+
+    // Put fast-math flags on all floating point operations
+    bool FastMath = false;
+
+    // Compile each function body on its first call (see KaleidoscopeJITOptions)
+    bool LazyCompile = false;
+    unsigned JITThreads = 0;
+    std::string ObjectCacheDir;
+
+    // See CodegenSession::DefsPerModule
+    unsigned DefsPerModule = 1;
+
+    // Compile definitions unoptimized first, and recompile the ones called
+    // TierUpThreshold times at -O3 (see TieredCompiler)
+    bool Tiered = false;
+    unsigned TierUpThreshold = 1000;
+
+    // Definitions that also get a NAME_batch wrapper (see emitBatchWrapper and callBatch)
+    std::vector<std::string> BatchFunctions;
+
+    // Let externs resolve to any function of the process (see
+    // KaleidoscopeJITOptions); without it they must be bound with bindFunction()
+    bool SearchProcessSymbols = true;
+
+    // Link with JITLink and its slab memory manager instead of RuntimeDyld,
+    // and write the JIT'd functions to perf's map file (see KaleidoscopeJITOptions)
+    bool JITLink = false;
+    bool PerfMap = false;
+
+    // Number of files runFiles() compiles in parallel
+    unsigned NumWorkers = 1;
+
+    // See PipelineOptions
+    bool LogPasses = false;
+    bool TimePasses = false;
+
+    // Time the phases of every top-level item compiled (see PhaseStats)
+    bool CollectPhaseStats = false;
+
+    // Print each function's IR as it's compiled by runBatch() (the REPL always does)
+    bool PrintIR = false;
+
+    // Print each module's optimized IR as it's handed to the JIT
+    bool DumpModules = false;
+
+    // Count the executions of every definition's entry and branches, for
+    // writeProfile(); and optimize with the counts of an earlier run's
+    // profile (see ExecutionProfile)
+    bool ProfileInstrument = false;
+    std::string ProfileUse;
+
+    // The JIT's share of these options.
+    KaleidoscopeJITOptions getJITOptions() const;
+};
+
+// Initialize the native target, the first time it's called in the process.
+void InitializeNativeTargetOnce();
+
+/*
+    Engine - A compiler and JIT for Kaleidoscope code, for embedding in another
+    program: compile() source into the engine, then lookup() or call() the
+    functions it defined, or prepare() expressions over them.
+
+    The native target is initialized by the first engine created in the
+    process. Everything an engine compiles shares one JIT, so a later
+    compile() can call the functions of an earlier one. Engines are
+    independent of each other, except that only one may be Tiered at a time.
+
+    All the methods may be called from several threads; compiles are
+    serialized.
+*/
+class Engine {
+    EngineOptions Opts;
+    FastMathFlags FPFlags;
+
+    std::unique_ptr<KaleidoscopeJIT> JIT;
+    std::vector<std::unique_ptr<TargetMachine>> TMs; // one per worker, queried by its pipeline's passes
+    std::vector<std::unique_ptr<OptimizationPipeline>> Pipelines; // one per worker
+    std::vector<std::unique_ptr<PhaseStats>> Phases; // one per worker, with CollectPhaseStats
+    PrototypeRegistry Protos;
+    std::unique_ptr<TieredCompiler> Tiers;
+    DenseSet<SymbolID> BatchFunctions;
+    HostArrayRegistry HostArrays;
+    std::unique_ptr<ExecutionProfile> Profile;
+
+    // compile() and prepare() go through the first pipeline, so they hold this
+    std::mutex CompileMutex;
+    std::unique_ptr<CodegenSession> Session;
+    std::unique_ptr<PreparedExpressions> Exprs;
+    DefinitionGraph Graph; // of the source reload() is given
+
+    explicit Engine(const EngineOptions &Opts);
+    Error init();
+
+    std::unique_ptr<CodegenSession> createSession(unsigned Worker);
+    PhaseStats* getWorkerPhaseStats(unsigned Worker) { return Phases.empty() ? nullptr : Phases[Worker].get(); }
+    Error bindArray(StringRef Name, const void* Data, ValueType Ty);
+    Error bindSymbol(StringRef Name, ExecutorAddr Addr, JITSymbolFlags Flags);
+
+public:
+    static Expected<std::unique_ptr<Engine>> create(const EngineOptions &Opts = EngineOptions());
+    ~Engine();
+
+    /*
+        Compile Source's definitions and externs, and run its top-level
+        expressions. Errors in the source are printed to stderr as they're
+        found, and make compile() fail once it has compiled the rest.
+    */
+    Error compile(StringRef Source);
+
+    // The address of a function compiled so far.
+    Expected<ExecutorAddr> lookup(StringRef Name);
+
+    // Call the function Name with Args (up to 8 of them, see prepare() for
+    // more). Its arguments and result must all be doubles; lookup() the others.
+    Expected<double> call(StringRef Name, ArrayRef<double> Args = {});
+
+    /*
+        Set Out[I] = Name(Inputs[0][I], ...) for every I < N, through Name's
+        batch wrapper (so Name must be one of Opts.BatchFunctions). Takes up
+        to 8 input arrays, and Name must take and return doubles.
+    */
+    Error callBatch(StringRef Name, ArrayRef<const double*> Inputs, double* Out, size_t N);
+
+    /*
+        Bind Name to the host array Data, in place: code can then index it
+        (Name[i]), assign to its elements and pass it as a double* (or f32*)
+        argument, reading and writing the host's memory without a copy. The
+        engine doesn't know its length, and Data must outlive the code that
+        uses it. Bind an array before compiling the code that uses it.
+    */
+    Error bindArray(StringRef Name, double* Data) { return bindArray(Name, Data, ValueType::DoubleArray); }
+    Error bindArray(StringRef Name, float* Data) { return bindArray(Name, Data, ValueType::F32Array); }
+
+    /*
+        Bind Name to the host function Fn, for code that declares it with an
+        extern of matching types (`extern putchard(c)` for a double(double)).
+        It's linked directly, whether or not SearchProcessSymbols is set.
+    */
+    template <typename RetT, typename... ArgTs>
+    Error bindFunction(StringRef Name, RetT (*Fn)(ArgTs...)) {
+        return bindSymbol(Name, ExecutorAddr::fromPtr(Fn), JITSymbolFlags::Exported | JITSymbolFlags::Callable);
+    }
+
+    // See PreparedExpressions::prepare(); compile() invalidates the expressions prepared before.
+    Expected<PreparedExpression*> prepare(StringRef Source, ArrayRef<std::string> Params = {});
+    void release(PreparedExpression* E);
+
+    /*
+        Compile a new version of the source given to the previous reload()
+        (the first one compiles it all): only its new and changed
+        definitions, and those that depend on them, are recompiled, while
+        the others keep their code. Its externs are compiled and its
+        top-level expressions run again, writing their results to Results if
+        it's given. See ReloadSource.
+    */
+    Expected<ReloadStats> reload(StringRef Source, raw_ostream* Results = nullptr);
+
+    // Run the interactive loop on Lex, printing a prompt and the result of each item.
+    Error runREPL(Lexer &Lex);
+
+    /*
+        Compile and run everything in Lex without a prompt, writing the result
+        of each top-level expression to Results (one per line) and nothing
+        else but errors. Fails if there were errors in the source, once it
+        has compiled the rest.
+    */
+    Error runBatch(Lexer &Lex, raw_ostream &Results);
+
+    /*
+        Compile and run each of Filenames on its own session, up to
+        Opts.NumWorkers files at a time. Files share the JIT, so a file can
+        call a function defined by another one, provided that the other file
+        has already compiled it by then. Returns false if a file couldn't be
+        read, or the JIT failed on one.
+    */
+    bool runFiles(ArrayRef<std::string> Filenames);
+
+    CompileStats getCompileStats() const { return JIT->getCompileStats(); }
+    MemoryStats getMemoryStats() const { return JIT->getMemoryStats(); }
+
+    // Functions recompiled at -O3 so far (with Tiered)
+    unsigned getNumPromoted() const { return Tiers ? Tiers->getNumPromoted() : 0; }
+
+    // The pass timings of all the workers (with TimePasses).
+    PassTimings getPassTimings() const;
+
+    // The phase times of all the workers (with CollectPhaseStats).
+    PhaseStats getPhaseStats() const;
+
+    // Write the execution counts collected so far (with ProfileInstrument).
+    Error writeProfile(StringRef Filename) const;
+};
+
+#endif
@@ -0,0 +1,61 @@
+#ifndef __INCREMENTAL_H__
+#define __INCREMENTAL_H__
+
+#include "TopLevel.h"
+#include "llvm/ADT/DenseMap.h"
+#include "llvm/ADT/DenseSet.h"
+
+/*
+    =============================================
+    ========= INCREMENTAL RECOMPILATION =========
+    =============================================
+*/
+
+/*
+    DefinitionGraph - The definitions of a source file as it was last loaded:
+    a hash of each one's prototype and body, and the functions and user
+    operators it calls.
+
+    Given the definitions of a new version of the file, it works out which to
+    recompile: those that are new or changed, and every definition that calls
+    one of those, directly or not. The callers have to be recompiled too, as
+    code that has been linked keeps calling the version of a function it was
+    linked against (see ModuleTracker), and may have inlined it.
+*/
+class DefinitionGraph {
+public:
+    struct Definition {
+        uint64_t Hash;
+        std::vector<SymbolID> Callees;
+    };
+
+    // Hash FnAST (it prints the same if and only if it's the same) and collect what it calls.
+    static Definition describe(const FunctionAST &FnAST);
+
+    // The names in New to recompile; New then becomes the graph.
+    DenseSet<SymbolID> update(DenseMap<SymbolID, Definition> New);
+
+    // Make the next update() recompile Name (its definition failed to compile).
+    void forget(SymbolID Name) { Definitions.erase(Name); }
+
+private:
+    DenseMap<SymbolID, Definition> Definitions;
+};
+
+struct ReloadStats {
+    unsigned Definitions = 0; // in the new version of the source
+    unsigned Recompiled = 0;  // of those
+};
+
+/*
+    ReloadSource - Compile a new version of the source of the graph G from P:
+    only the definitions it says to recompile (the others keep their code in
+    the JIT, since nothing they depend on has changed), every extern, and run
+    every top-level expression, in the order they're in the source.
+
+    A name defined more than once in the source is always recompiled, so that
+    the expressions between its definitions call the right one.
+*/
+Expected<ReloadStats> ReloadSource(CodegenSession &S, Parser &P, PreparedExpressions &Exprs, DefinitionGraph &G);
+
+#endif
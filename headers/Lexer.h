@@ -3,18 +3,64 @@
 
 #include "Token.h"
 #include "common.h"
+#include "llvm/Support/MemoryBuffer.h"
 
-int gettok();
+/*
+    =========================
+    ========= LEXER =========
+    =========================
+*/
 
 /*
-    Each token returned by our lexer will either be one of the Token enum values 
-    or it will be an ‘unknown’ character like ‘+’, which is returned as its ASCII value. 
+    Each token returned by our lexer will either be one of the Token enum values
+    or it will be an ‘unknown’ character like ‘+’, which is returned as its ASCII value.
+
+    If the current token is an identifier (or a TOK_TYPE), getIdentifier() holds its name.
+    If the current token is a numeric literal (like 1.0), getNumVal() holds its value.
 
-    If the current token is an identifier, the IdentifierStr global variable holds the name of the identifier. 
-    If the current token is a numeric literal (like 1.0), NumVal holds its value.
+    The lexer works on a buffer of source text: [CurPtr, BufEnd) is what hasn't
+    been consumed yet, and TokStart is the start of the token being lexed.
+
+    For a file the buffer is the whole (memory mapped) file. For stdin it's a
+    chunk of input that gets refilled when we run off its end; the part of the
+    current token already read is moved to the front first, so a token is always
+    contiguous in memory.
+
+    All the state lives in the Lexer, so any number of them can run at once
+    (e.g. one per source file, each on its own thread).
 */
+class Lexer {
+    std::unique_ptr<MemoryBuffer> InputFile;
+    SmallVector<char, 0> StdinBuffer;
+    bool ReadingStdin;
+
+    const char* TokStart = nullptr;
+    const char* CurPtr = nullptr;
+    const char* BufEnd = nullptr;
+
+    StringRef IdentifierStr; // Filled in if TOK_IDENTIFIER or TOK_TYPE
+    double NumVal = 0.0;     // Filled in if TOK_NUMBER
+
+    bool refill();
+    int peekChar();
+
+public:
+    // Lex stdin, which is read in chunks as tokens are needed, so interactive
+    // use still works.
+    Lexer();
+
+    // Lex a whole buffer in place (a memory mapped file, or source held in memory).
+    explicit Lexer(std::unique_ptr<MemoryBuffer> Buffer);
+
+    // open - Lex the named file, or stdin for "-".
+    static Expected<std::unique_ptr<Lexer>> open(StringRef Filename);
+
+    int gettok();
 
-static std::string IdentifierStr; // Filled in if TOK_IDENTIFIER
-static double NumVal;             // Filled in if TOK_NUMBER
+    // Points into the input buffer rather than owning a copy, so it's only
+    // valid until the next call to gettok().
+    StringRef getIdentifier() const { return IdentifierStr; }
+    double getNumVal() const { return NumVal; }
+};
 
-#endif
\ No newline at end of file
+#endif
@@ -0,0 +1,358 @@
+#ifndef __MODULE_TRACKER_H__
+#define __MODULE_TRACKER_H__
+
+#include "llvm/ADT/DenseMap.h"
+#include "llvm/ADT/SmallPtrSet.h"
+#include "llvm/ADT/StringMap.h"
+#include "llvm/ExecutionEngine/JITLink/JITLink.h"
+#include "llvm/ExecutionEngine/Orc/Core.h"
+#include "llvm/ExecutionEngine/Orc/Mangling.h"
+#include "llvm/ExecutionEngine/Orc/ObjectLinkingLayer.h"
+#include "llvm/IR/Module.h"
+#include "llvm/Object/ObjectFile.h"
+#include <mutex>
+#include <vector>
+
+namespace llvm {
+namespace orc {
+
+/// ModuleTracker - Gives each module of definitions its own ResourceTracker,
+/// so that redefining its functions frees its code and data.
+///
+/// A definition of NAME is compiled as NAME$<version>, and NAME itself is an
+/// alias of it with a tracker of its own. The version counts the definitions
+/// of NAME before it, so it doesn't depend on what else has been defined: a
+/// script compiles to the same modules, and so hits the object cache, however
+/// its other definitions change. Redefining NAME removes the alias
+/// and points a new one at the new version. The old version's symbol stays
+/// where it is for the code that was already linked against it. A module's
+/// tracker is removed once all of its functions have been redefined and no
+/// live module links against it any more.
+///
+/// Which modules an object links against is recorded from its undefined
+/// symbols when it's loaded (or, with JITLink, from its graph's external
+/// symbols, see ModuleTrackerPlugin), which is before they're looked up. So
+/// until the object is linked (see linked()), a redefinition of one of those
+/// names counts as used by it too: its lookup may find either version, and
+/// both stay alive.
+class ModuleTracker : public ResourceManager {
+  struct TrackedModule {
+    ResourceTrackerSP RT;  // Null for modules added with another tracker
+    bool Owned = false;    // Created by addDefinitions, so removed by us
+    unsigned LiveDefinitions = 0; // Functions not redefined yet
+    unsigned Users = 0;           // Live modules linked against this one
+    std::vector<TrackedModule *> Uses;
+    unsigned Linking = 0;                  // Objects loaded but not linked yet
+    std::vector<SymbolStringPtr> Unresolved; // The names those link against
+  };
+
+  struct Alias {
+    ResourceTrackerSP RT;
+    TrackedModule *Owner;
+    SymbolAliasMapEntry Target; // To put the alias back if publish() fails
+  };
+
+  ExecutionSession &ES;
+  JITDylib &JD;
+
+  // Serializes publish(), which can't hold Mutex while it removes trackers
+  // (that calls back into handleRemoveResources).
+  std::mutex PublishMutex;
+
+  std::mutex Mutex;
+  DenseMap<ResourceKey, std::unique_ptr<TrackedModule>> Modules;
+  DenseMap<SymbolStringPtr, Alias> Aliases; // The current version of each function
+  DenseMap<SymbolStringPtr, TrackedModule *> Publishing; // Versions publish() is making current
+  SmallPtrSet<TrackedModule *, 4> Linking;
+  StringMap<unsigned> Versions; // Definitions of each name so far
+
+  static bool isDead(const TrackedModule &M) {
+    return M.Owned && M.LiveDefinitions == 0 && M.Users == 0;
+  }
+
+  // Expects Mutex to be held.
+  TrackedModule &getModule(ResourceKey K) {
+    auto &M = Modules[K];
+    if (!M)
+      M = std::make_unique<TrackedModule>();
+    return *M;
+  }
+
+  // Expects Mutex to be held.
+  static void recordUse(TrackedModule &User, TrackedModule *Used) {
+    if (Used == &User || is_contained(User.Uses, Used))
+      return;
+    User.Uses.push_back(Used);
+    ++Used->Users;
+  }
+
+  // Expects Mutex to be held. Name is linked against by an object of User
+  // that is being loaded.
+  void recordUse(TrackedModule &User, StringRef Name) {
+    SymbolStringPtr Sym = ES.intern(Name);
+    auto I = Aliases.find(Sym);
+    if (I != Aliases.end())
+      recordUse(User, I->second.Owner);
+    auto P = Publishing.find(Sym);
+    if (P != Publishing.end())
+      recordUse(User, P->second);
+    User.Unresolved.push_back(std::move(Sym));
+  }
+
+  // Expects Mutex to be held.
+  void beginLinking(TrackedModule &User) {
+    ++User.Linking;
+    Linking.insert(&User);
+  }
+
+  static Error removeAll(ArrayRef<ResourceTrackerSP> RTs) {
+    Error Err = Error::success();
+    for (auto &RT : RTs)
+      Err = joinErrors(std::move(Err), RT->remove());
+    return Err;
+  }
+
+public:
+  ModuleTracker(ExecutionSession &ES, JITDylib &JD) : ES(ES), JD(JD) {
+    ES.registerResourceManager(*this);
+  }
+
+  ~ModuleTracker() { ES.deregisterResourceManager(*this); }
+
+  /// addDefinitions - Version the functions M defines and create the tracker
+  /// to add M with. Then call publish() once M has been added.
+  ResourceTrackerSP addDefinitions(Module &M, MangleAndInterner &Mangle,
+                                   SymbolAliasMap &NewAliases) {
+    auto RT = JD.createResourceTracker();
+    unsigned NumDefinitions = 0;
+    std::lock_guard<std::mutex> Lock(Mutex);
+    for (auto &F : M) {
+      if (F.isDeclaration())
+        continue;
+      std::string Name = F.getName().str();
+      std::string Versioned = Name + "$" + std::to_string(Versions[Name]++);
+      F.setName(Versioned);
+      NewAliases[Mangle(Name)] = SymbolAliasMapEntry(
+          Mangle(Versioned), JITSymbolFlags::Exported | JITSymbolFlags::Callable);
+      ++NumDefinitions;
+    }
+
+    TrackedModule &TM = getModule(RT->getKeyUnsafe());
+    TM.RT = RT;
+    TM.Owned = true;
+    TM.LiveDefinitions = NumDefinitions;
+    return RT;
+  }
+
+  /// publish - Point the names in NewAliases at the versions just added with
+  /// tracker RT, retiring the previous versions. If that fails the previous
+  /// versions stay, and the new ones are removed.
+  Error publish(ResourceTrackerSP RT, SymbolAliasMap NewAliases) {
+    std::lock_guard<std::mutex> PublishLock(PublishMutex);
+
+    // Objects being linked may find the new versions from now on
+    std::vector<std::pair<SymbolStringPtr, Alias>> Old, Retired, Defined;
+    TrackedModule *Owner;
+    {
+      std::lock_guard<std::mutex> Lock(Mutex);
+      Owner = &getModule(RT->getKeyUnsafe());
+      for (auto &KV : NewAliases) {
+        Publishing[KV.first] = Owner;
+        auto I = Aliases.find(KV.first);
+        if (I != Aliases.end())
+          Old.push_back(*I);
+      }
+      for (auto *User : Linking)
+        if (any_of(User->Unresolved,
+                   [&](const SymbolStringPtr &Name) { return NewAliases.count(Name); }))
+          recordUse(*User, Owner);
+    }
+
+    // A name can't be defined twice, so the old aliases go first.
+    auto Replace = [&]() -> Error {
+      for (auto &KV : Old) {
+        if (auto Err = KV.second.RT->remove())
+          return Err;
+        Retired.push_back(KV);
+      }
+      for (auto &KV : NewAliases) {
+        auto AliasRT = JD.createResourceTracker();
+        if (auto Err = JD.define(symbolAliases({{KV.first, KV.second}}), AliasRT))
+          return Err;
+        Defined.push_back({KV.first, {std::move(AliasRT), Owner, KV.second}});
+      }
+      return Error::success();
+    };
+    Error Err = Replace();
+    if (Err) {
+      for (auto &KV : Defined)
+        Err = joinErrors(std::move(Err), KV.second.RT->remove());
+      for (auto &KV : Retired) {
+        KV.second.RT = JD.createResourceTracker();
+        Err = joinErrors(std::move(Err),
+                         JD.define(symbolAliases({{KV.first, KV.second.Target}}),
+                                   KV.second.RT));
+      }
+    }
+
+    std::vector<ResourceTrackerSP> Dead;
+    {
+      std::lock_guard<std::mutex> Lock(Mutex);
+      Publishing.clear();
+      if (Err) {
+        for (auto &KV : Retired)
+          Aliases[KV.first].RT = std::move(KV.second.RT);
+        // Nothing can call the new versions
+        Owner->LiveDefinitions = 0;
+        if (isDead(*Owner))
+          Dead.push_back(Owner->RT);
+      } else {
+        for (auto &KV : Defined) {
+          auto I = Aliases.find(KV.first);
+          if (I != Aliases.end() && --I->second.Owner->LiveDefinitions == 0 &&
+              isDead(*I->second.Owner))
+            Dead.push_back(I->second.Owner->RT);
+          Aliases[KV.first] = std::move(KV.second);
+        }
+      }
+    }
+    return joinErrors(std::move(Err), removeAll(Dead));
+  }
+
+  /// addModule - Track a module added with a tracker of the caller's, whose
+  /// removal is up to the caller, so that what it links against stays alive.
+  void addModule(ResourceTrackerSP RT) {
+    std::lock_guard<std::mutex> Lock(Mutex);
+    getModule(RT->getKeyUnsafe()).RT = std::move(RT);
+  }
+
+  /// recordUses - Note the modules that the object Obj, being loaded under
+  /// key K, links against.
+  void recordUses(ResourceKey K, const object::ObjectFile &Obj) {
+    std::lock_guard<std::mutex> Lock(Mutex);
+    TrackedModule &User = getModule(K);
+    beginLinking(User);
+    for (auto &Sym : Obj.symbols()) {
+      auto Flags = Sym.getFlags();
+      if (!Flags) {
+        consumeError(Flags.takeError());
+        continue;
+      }
+      if (!(*Flags & object::BasicSymbolRef::SF_Undefined))
+        continue;
+      auto Name = Sym.getName();
+      if (!Name) {
+        consumeError(Name.takeError());
+        continue;
+      }
+      recordUse(User, *Name);
+    }
+  }
+
+  /// recordUses - The same for the graph G that JITLink is linking under K.
+  void recordUses(ResourceKey K, jitlink::LinkGraph &G) {
+    std::lock_guard<std::mutex> Lock(Mutex);
+    TrackedModule &User = getModule(K);
+    beginLinking(User);
+    for (auto *Sym : G.external_symbols())
+      recordUse(User, Sym->getName());
+  }
+
+  /// linked - An object whose uses were recorded under K has been linked (or
+  /// failed to), so what it uses is settled.
+  void linked(ResourceKey K) {
+    std::lock_guard<std::mutex> Lock(Mutex);
+    auto I = Modules.find(K);
+    if (I == Modules.end() || I->second->Linking == 0 ||
+        --I->second->Linking != 0)
+      return;
+    I->second->Unresolved.clear();
+    Linking.erase(I->second.get());
+  }
+
+  struct Stats {
+    unsigned Trackers = 0; // Live module trackers
+    unsigned Retained = 0; // Of those, fully redefined but still linked against
+  };
+
+  Stats getStats() {
+    std::lock_guard<std::mutex> Lock(Mutex);
+    Stats S;
+    for (auto &KV : Modules) {
+      if (!KV.second->RT)
+        continue;
+      ++S.Trackers;
+      if (KV.second->Owned && KV.second->LiveDefinitions == 0)
+        ++S.Retained;
+    }
+    return S;
+  }
+
+  Error handleRemoveResources(JITDylib &JD, ResourceKey K) override {
+    std::vector<ResourceTrackerSP> Dead;
+    {
+      std::lock_guard<std::mutex> Lock(Mutex);
+      auto I = Modules.find(K);
+      if (I == Modules.end())
+        return Error::success();
+      for (auto *Used : I->second->Uses)
+        if (--Used->Users == 0 && isDead(*Used))
+          Dead.push_back(Used->RT);
+      Linking.erase(I->second.get());
+      Modules.erase(I);
+    }
+    return removeAll(Dead);
+  }
+
+  // Nothing merges the trackers given out here (with transferTo), so there's
+  // never anything to move.
+  void handleTransferResources(JITDylib &JD, ResourceKey DstK,
+                               ResourceKey SrcK) override {}
+};
+
+/// ModuleTrackerPlugin - Records what each graph linked by an
+/// ObjectLinkingLayer uses (see ModuleTracker::recordUses), as the
+/// RTDyldObjectLinkingLayer's NotifyLoaded does for each object.
+class ModuleTrackerPlugin : public ObjectLinkingLayer::Plugin {
+public:
+  ModuleTrackerPlugin(ModuleTracker &Tracker) : Tracker(Tracker) {}
+
+  void modifyPassConfig(MaterializationResponsibility &MR,
+                        jitlink::LinkGraph &G,
+                        jitlink::PassConfiguration &Config) override {
+    Config.PrePrunePasses.push_back([this, &MR](jitlink::LinkGraph &G) {
+      // Fails only if the module is being removed already
+      consumeError(
+          MR.withResourceKeyDo([&](ResourceKey K) { Tracker.recordUses(K, G); }));
+      return Error::success();
+    });
+  }
+
+  Error notifyEmitted(MaterializationResponsibility &MR) override {
+    return linked(MR);
+  }
+
+  Error notifyFailed(MaterializationResponsibility &MR) override {
+    return linked(MR);
+  }
+
+  Error notifyRemovingResources(JITDylib &JD, ResourceKey K) override {
+    return Error::success();
+  }
+
+  void notifyTransferringResources(JITDylib &JD, ResourceKey DstKey,
+                                   ResourceKey SrcKey) override {}
+
+private:
+  ModuleTracker &Tracker;
+
+  Error linked(MaterializationResponsibility &MR) {
+    consumeError(MR.withResourceKeyDo([&](ResourceKey K) { Tracker.linked(K); }));
+    return Error::success();
+  }
+};
+
+} // end namespace orc
+} // end namespace llvm
+
+#endif
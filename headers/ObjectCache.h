@@ -0,0 +1,113 @@
+#ifndef __OBJECT_CACHE_H__
+#define __OBJECT_CACHE_H__
+
+#include "llvm/ADT/DenseMap.h"
+#include "llvm/ADT/SmallString.h"
+#include "llvm/ADT/StringExtras.h"
+#include "llvm/Bitcode/BitcodeWriter.h"
+#include "llvm/ExecutionEngine/ObjectCache.h"
+#include "llvm/IR/Module.h"
+#include "llvm/Support/MemoryBuffer.h"
+#include "llvm/Support/Path.h"
+#include "llvm/Support/SHA1.h"
+#include "llvm/Support/raw_ostream.h"
+#include "llvm/Target/TargetMachine.h"
+#include <atomic>
+#include <mutex>
+
+namespace llvm {
+namespace orc {
+
+/// KaleidoscopeObjectCache - An on-disk cache of compiled object files.
+///
+/// Objects are stored as <CacheDir>/<key>.o, where the key is a SHA1 of the
+/// module's (already optimized) bitcode together with everything else that
+/// affects the generated code: target triple, CPU, features, the codegen
+/// optimization level and FP contraction mode. A hit skips codegen entirely and the object is just
+/// loaded and linked.
+class KaleidoscopeObjectCache : public ObjectCache {
+public:
+  KaleidoscopeObjectCache(std::string CacheDir, const TargetMachine &TM)
+      : CacheDir(std::move(CacheDir)) {
+    raw_string_ostream OS(TargetKey);
+    OS << TM.getTargetTriple().str() << '\0' << TM.getTargetCPU() << '\0'
+       << TM.getTargetFeatureString() << '\0'
+       << static_cast<int>(TM.getOptLevel()) << '\0'
+       << static_cast<int>(TM.Options.AllowFPOpFusion);
+    OS.flush();
+  }
+
+  std::unique_ptr<MemoryBuffer> getObject(const Module *M) override {
+    std::string Key = computeKey(*M);
+    auto Buffer = MemoryBuffer::getFile(getObjectPath(Key));
+    if (Buffer) {
+      ++Hits;
+      return std::move(*Buffer);
+    }
+
+    // Not cached yet: remember the key so notifyObjectCompiled doesn't have
+    // to hash the module a second time.
+    ++Misses;
+    std::lock_guard<std::mutex> Lock(PendingKeysMutex);
+    PendingKeys[M] = std::move(Key);
+    return nullptr;
+  }
+
+  void notifyObjectCompiled(const Module *M, MemoryBufferRef Obj) override {
+    std::string Key;
+    {
+      std::lock_guard<std::mutex> Lock(PendingKeysMutex);
+      auto I = PendingKeys.find(M);
+      if (I != PendingKeys.end()) {
+        Key = std::move(I->second);
+        PendingKeys.erase(I);
+      }
+    }
+    if (Key.empty())
+      Key = computeKey(*M);
+
+    // writeToOutput goes through a temporary file and renames it into place,
+    // so concurrent JIT processes never see a partially written object.
+    if (auto Err = writeToOutput(getObjectPath(Key), [&](raw_ostream &OS) {
+          OS << Obj.getBuffer();
+          return Error::success();
+        }))
+      logAllUnhandledErrors(std::move(Err), errs(),
+                            "Could not write to object cache: ");
+  }
+
+  unsigned getNumHits() const { return Hits; }
+  unsigned getNumMisses() const { return Misses; }
+
+private:
+  std::string computeKey(const Module &M) const {
+    SmallString<0> Bitcode;
+    raw_svector_ostream OS(Bitcode);
+    WriteBitcodeToFile(M, OS);
+
+    SHA1 Hasher;
+    Hasher.update(TargetKey);
+    Hasher.update(Bitcode);
+    return toHex(Hasher.final(), /*LowerCase*/ true);
+  }
+
+  std::string getObjectPath(StringRef Key) const {
+    SmallString<256> Path(CacheDir);
+    sys::path::append(Path, Key + ".o");
+    return std::string(Path);
+  }
+
+  std::string CacheDir;
+  std::string TargetKey;
+
+  std::mutex PendingKeysMutex;
+  DenseMap<const Module *, std::string> PendingKeys;
+
+  std::atomic<unsigned> Hits{0};
+  std::atomic<unsigned> Misses{0};
+};
+
+} // end namespace orc
+} // end namespace llvm
+
+#endif
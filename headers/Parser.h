@@ -5,54 +5,75 @@
 #include "Lexer.h"
 #include "AST.h"
 
+#include <array>
+
 /*
     ==========================
     ========= PARSER =========
-    ========================== 
+    ==========================
 */
-static int CurTok;
-static int getNextToken() { return CurTok = gettok(); }
-
-// BinopPrecedence - This holds the precedence for each binary operator that is defined
-static std::map<char, int> BinopPrecedence = {
-    {'<', 10},
-    {'>', 10},
-    {'+', 20},
-    {'-', 20},
-    {'*', 40},
-    {'/', 40}
-};
 
-static int GetTokPrecedence();
-
-std::unique_ptr<ExprAST> LogError(const char*);
+ExprAST* LogError(const char*);
 
 std::unique_ptr<PrototypeAST> LogErrorP(const char*);
 
-static std::unique_ptr<ExprAST> ParseNumberExpr();
-
-static std::unique_ptr<ExprAST> ParseParenExpr(); 
-
-static std::unique_ptr<ExprAST> ParseIdentifierExpr();
-
-static std::unique_ptr<ExprAST> ParsePrimary();
-
-static std::unique_ptr<ExprAST> ParseUnary();
-
-static std::unique_ptr<ExprAST> ParseBinOpRHS(int, std::unique_ptr<ExprAST>);
-
-static std::unique_ptr<ExprAST> ParseExpression();
-
-static std::unique_ptr<PrototypeAST> ParsePrototype();
-
-static std::unique_ptr<FunctionAST> ParseDefinition();
-
-static std::unique_ptr<FunctionAST> ParseTopLevelExpr();
-
-static std::unique_ptr<PrototypeAST> ParseExtern();
-
-static std::unique_ptr<ExprAST> ParseIfExpr();
+/*
+    Parser - A recursive descent parser over the tokens of one Lexer.
 
-static std::unique_ptr<ExprAST> ParseForExpr();
+    The current token and the binary operator precedences are per parser, so
+    separate sources can be parsed concurrently. User defined operators are
+    installed with setBinopPrecedence once their definition has been compiled,
+    and only affect the parser that read them.
+*/
+class Parser {
+    Lexer &Lex;
+    int CurTok = 0;
+
+    // Holds the expressions of the item being parsed
+    ASTContext AST;
+
+    // BinopPrecedence - This holds the precedence for each binary operator that is
+    // defined, indexed by its character (-1 if the character isn't an operator)
+    std::array<int, 256> BinopPrecedence;
+
+    int GetTokPrecedence();
+
+    ExprAST* ParseNumberExpr();
+    ExprAST* ParseParenExpr();
+    ExprAST* ParseIdentifierExpr();
+    ExprAST* ParsePrimary();
+    ExprAST* ParseUnary();
+    ExprAST* ParseBinOpRHS(int, ExprAST*);
+    bool ParseType(ValueType &Ty);
+    bool ParseTypeAnnotation(ValueType &Ty);
+    std::unique_ptr<PrototypeAST> ParsePrototype();
+    ExprAST* ParseIfExpr();
+    ExprAST* ParseForExpr();
+    ExprAST* ParseVarExpr();
+
+public:
+    explicit Parser(Lexer &Lex);
+
+    int getCurTok() const { return CurTok; }
+    int getNextToken() { return CurTok = Lex.gettok(); }
+
+    // The name of the current token, if it's a TOK_IDENTIFIER.
+    StringRef getIdentifier() const { return Lex.getIdentifier(); }
+
+    void setBinopPrecedence(char Op, int Prec) { BinopPrecedence[(unsigned char)Op] = Prec; }
+
+    /*
+        The expressions returned by the Parse* methods below live until
+        clearAST(), which cheaply frees all of them at once. Call it once an
+        item has been compiled.
+    */
+    void clearAST() { AST.reset(); }
+    const ASTContext &getASTContext() const { return AST; }
+
+    ExprAST* ParseExpression();
+    std::unique_ptr<FunctionAST> ParseDefinition();
+    std::unique_ptr<FunctionAST> ParseTopLevelExpr();
+    std::unique_ptr<PrototypeAST> ParseExtern();
+};
 
-#endif
\ No newline at end of file
+#endif
@@ -0,0 +1,106 @@
+#ifndef __PHASE_STATS_H__
+#define __PHASE_STATS_H__
+
+#include "common.h"
+#include "llvm/Support/raw_ostream.h"
+
+#include <array>
+#include <chrono>
+
+/*
+    ====================================
+    ========= PHASE STATISTICS =========
+    ====================================
+*/
+
+/*
+    The phases of compiling and running a top-level item:
+
+      Parse:       lexing and parsing it
+      IRGen:       generating its IR (and batch wrappers, and the entry point
+                   of an expression)
+      Optimize:    the optimization pipeline, on each function and module
+      Materialize: handing modules to the JIT and the lookup that compiles and
+                   links them (old versions of redefined functions are
+                   retired here too)
+      Lookup:      finding an expression in the prepared expression cache
+      Execute:     running a top-level expression
+      Remove:      freeing the code of expressions that are done with
+*/
+enum class Phase { Parse, IRGen, Optimize, Materialize, Lookup, Execute, Remove };
+constexpr unsigned NumPhases = 7;
+
+StringRef getPhaseName(Phase P);
+
+/*
+    PhaseStats - The wall time spent in each phase by each top-level item,
+    collected over the session. Phases nest (the optimizer runs in the middle
+    of IR generation, and both in the middle of an expression's lookup); each
+    is charged only the time not spent in the phases nested inside it.
+
+    Used by a single thread; each worker of an engine collects its own, and
+    they're merged with add().
+*/
+class PhaseStats {
+    using Clock = std::chrono::steady_clock;
+
+    // The phases running now, innermost last, and when the innermost one
+    // was last charged
+    SmallVector<Phase, 4> Running;
+    Clock::time_point Since;
+
+    // The time of the current item in each phase, and whether it entered it
+    std::array<Clock::duration, NumPhases> ItemTime{};
+    std::array<bool, NumPhases> ItemEntered{};
+
+    // Per phase, the time of each item that entered it, in nanoseconds
+    std::array<std::vector<uint64_t>, NumPhases> Samples;
+
+    unsigned Items = 0;
+    unsigned Modules = 0;
+
+    void charge(Clock::time_point Now);
+
+public:
+    void start(Phase P);
+    void stop();
+
+    // Record the current item's phase times and start the next item.
+    void endItem();
+
+    // Note a module handed to the JIT.
+    void countModule() { ++Modules; }
+
+    // Accumulate the items collected by another worker into these.
+    void add(const PhaseStats &Other);
+
+    // Print count, total, p50/p99/max and a histogram for each phase, and the
+    // number of modules created and the memory the JIT has freed.
+    void print(raw_ostream &OS, const MemoryStats &Memory) const;
+};
+
+// PhaseTimer - Times the phase P for the scope it's in, if there are Stats.
+class PhaseTimer {
+    PhaseStats* Stats;
+
+public:
+    PhaseTimer(PhaseStats* Stats, Phase P) : Stats(Stats) {
+        if (Stats)
+            Stats->start(P);
+    }
+    ~PhaseTimer() {
+        if (Stats)
+            Stats->stop();
+    }
+    PhaseTimer(const PhaseTimer &) = delete;
+    PhaseTimer &operator=(const PhaseTimer &) = delete;
+};
+
+// Call Fn in phase P and return its result.
+template <typename FnT>
+auto timePhase(PhaseStats* Stats, Phase P, FnT &&Fn) -> decltype(Fn()) {
+    PhaseTimer T(Stats, P);
+    return Fn();
+}
+
+#endif
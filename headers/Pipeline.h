@@ -0,0 +1,119 @@
+#ifndef __PIPELINE_H__
+#define __PIPELINE_H__
+
+#include "llvm/ADT/StringMap.h"
+#include "llvm/IR/Function.h"
+#include "llvm/IR/LLVMContext.h"
+#include "llvm/IR/PassManager.h"
+#include "llvm/Passes/PassBuilder.h"
+#include "llvm/Passes/StandardInstrumentations.h"
+#include "llvm/Target/TargetMachine.h"
+#include "llvm/Support/raw_ostream.h"
+
+#include <chrono>
+#include <optional>
+#include <vector>
+
+using namespace llvm;
+
+/*
+    =========================================
+    ========= OPTIMIZATION PIPELINE =========
+    =========================================
+*/
+
+/*
+    PassTimings - Collects the wall time and number of runs of every pass and
+    analysis over the whole session, through pass instrumentation callbacks.
+*/
+class PassTimings {
+    struct Entry {
+        uint64_t Count = 0;
+        std::chrono::steady_clock::duration Time{0};
+    };
+
+    StringMap<Entry> Passes;
+    StringMap<Entry> Analyses;
+
+    // Start times of the passes/analyses currently running (they nest, e.g.
+    // a function pass inside a pass manager, or an analysis requested by a pass)
+    std::vector<std::chrono::steady_clock::time_point> Running;
+
+    void start();
+    void stop(StringMap<Entry> &Table, StringRef Name);
+
+public:
+    void registerCallbacks(PassInstrumentationCallbacks &PIC);
+
+    // Accumulate the timings collected by another pipeline into this one.
+    void add(const PassTimings &Other);
+
+    // Write the collected timings as a JSON object, slowest first.
+    void printJSON(raw_ostream &OS) const;
+};
+
+struct PipelineOptions {
+    /*
+        0: no IR optimization, for the fastest turnaround
+        1: the SROA/InstCombine/Reassociate/GVN/SimplifyCFG/TailCallElim
+           function pipeline, run on each function as soon as it is
+           generated, then inlining within each module of several definitions
+        2/3: LLVM's default per-module pipeline for that level (including loop
+             passes and vectorization), run on each module before it is JIT'd
+    */
+    unsigned OptLevel = 1;
+
+    // Target the code will run on. Gives the passes target information (and
+    // the vectorizer a cost model); without it they assume a generic target.
+    TargetMachine *TM = nullptr;
+
+    // Print every pass execution to stderr (StandardInstrumentations' debug logging).
+    bool DebugLogging = false;
+
+    // Collect per-pass timings, see getTimings().
+    bool TimePasses = false;
+};
+
+/*
+    OptimizationPipeline - Owns the pass builder, the four analysis managers and
+    the function pass manager. It's built once per process and can be run on
+    functions from any module or context, so the registration and allocation
+    cost is paid once instead of once per definition.
+*/
+class OptimizationPipeline {
+    // StandardInstrumentations wants a context (for opt-bisect) and keeps a
+    // reference to it, so give it one that lives as long as the pipeline
+    // instead of one of the short-lived per-module contexts.
+    LLVMContext InstrumentationContext;
+
+    PassInstrumentationCallbacks PIC;
+    StandardInstrumentations SI;
+    PassBuilder PB;
+
+    LoopAnalysisManager LAM;
+    FunctionAnalysisManager FAM;
+    CGSCCAnalysisManager CGAM;
+    ModuleAnalysisManager MAM;
+
+    unsigned OptLevel;
+    FunctionPassManager FPM;
+    ModulePassManager MPM;
+
+    std::unique_ptr<PassTimings> Timings;
+
+    void clearAnalyses();
+
+public:
+    OptimizationPipeline(const PipelineOptions &Opts = PipelineOptions());
+
+    // Null unless the pipeline was created with TimePasses.
+    const PassTimings *getTimings() const { return Timings.get(); }
+
+    // Optimize a function that has just been generated (only does anything at -O1).
+    void run(Function &F);
+
+    // Optimize a module about to be handed to the JIT (at -O1, only inlines).
+    void run(Module &M);
+};
+
+#endif
@@ -0,0 +1,99 @@
+#ifndef __PREPARED_EXPR_H__
+#define __PREPARED_EXPR_H__
+
+#include "common.h"
+#include "codegen.h"
+#include "llvm/ADT/DenseMap.h"
+#include "llvm/ADT/StringMap.h"
+
+#include <mutex>
+
+/*
+    ========================================
+    ========= PREPARED EXPRESSIONS =========
+    ========================================
+*/
+
+/*
+    PreparedExpression - An expression compiled once into a function of its
+    parameters, that can be called any number of times until it's released.
+*/
+class PreparedExpression {
+    friend class PreparedExpressions;
+
+    using EntryFn = double (*)(const double* Args);
+
+    EntryFn Entry = nullptr;
+    size_t NumParams = 0;
+    ResourceTrackerSP RT; // Frees the compiled code
+    unsigned ID = 0;      // N of its function __expr.N
+    unsigned RefCount = 0; // Handles given out, plus one while it's cached
+
+public:
+    size_t getNumParams() const { return NumParams; }
+
+    // Evaluate the expression, with Args giving the parameters in order.
+    double operator()(ArrayRef<double> Args) const {
+        assert(Args.size() == NumParams && "wrong number of arguments");
+        return Entry(Args.data());
+    }
+};
+
+/*
+    PreparedExpressions - Compiles expressions into PreparedExpressions, and
+    caches them so that preparing the same expression again (with the same
+    parameters) skips parsing, codegen and the JIT and returns the same handle.
+
+    Source text is cached by its text. Already parsed expressions (like the
+    REPL's top-level expressions) are cached by their structure, so the same
+    expression typed again hits the cache however it's spaced.
+
+    The expressions call whatever the functions they use were when they were
+    compiled, so invalidate() the cache when a function is (re)defined. Handles
+    that are still held stay valid until they're released.
+
+    Safe to use from several threads; compiles are serialized, as they all go
+    through one optimization pipeline.
+*/
+class PreparedExpressions {
+    KaleidoscopeJIT &JIT;
+    OptimizationPipeline &Pipeline;
+    PrototypeRegistry &Protos;
+    FastMathFlags FPFlags;
+    const HostArrayRegistry* HostArrays;
+    PhaseStats* Stats = nullptr;
+
+    std::mutex Mutex;
+    StringMap<PreparedExpression*> Cache;
+    DenseMap<PreparedExpression*, std::unique_ptr<PreparedExpression>> Live;
+
+    Expected<PreparedExpression*> lookupOrCompile(std::string Key, ExprAST* Body,
+                                                  ArrayRef<std::string> Params);
+    void unref(PreparedExpression* E);
+
+public:
+    PreparedExpressions(KaleidoscopeJIT &JIT, OptimizationPipeline &Pipeline, PrototypeRegistry &Protos,
+                        FastMathFlags FPFlags = FastMathFlags(), const HostArrayRegistry* HostArrays = nullptr);
+    ~PreparedExpressions();
+
+    /*
+        Compile Source, an expression over the parameters Params, e.g.
+        prepare("x * x + y", {"x", "y"}). It's parsed with the precedences of
+        all the binary operators defined so far.
+    */
+    Expected<PreparedExpression*> prepare(StringRef Source, ArrayRef<std::string> Params = {});
+
+    // Compile an expression that's already been parsed.
+    Expected<PreparedExpression*> prepare(ExprAST* Body, ArrayRef<std::string> Params = {});
+
+    // Give up a handle returned by prepare(); each prepare() needs one release().
+    void release(PreparedExpression* E);
+
+    // Drop all cached expressions, so later prepares compile them again.
+    void invalidate();
+
+    // Record the phases of compiling each expression in Stats (from the thread using it).
+    void setPhaseStats(PhaseStats* S) { Stats = S; }
+};
+
+#endif
@@ -0,0 +1,81 @@
+#ifndef __PROFILE_H__
+#define __PROFILE_H__
+
+#include "llvm/ADT/StringMap.h"
+#include "llvm/Support/Error.h"
+
+#include <deque>
+#include <mutex>
+#include <vector>
+
+using namespace llvm;
+
+/*
+    ===============================================
+    ========= PROFILE-GUIDED OPTIMIZATION =========
+    ===============================================
+*/
+
+/*
+    ExecutionProfile - The execution counts of the definitions compiled in
+    one run, for the next run to optimize with.
+
+    Each definition has an entry counter, then two counters for each
+    conditional branch of its body, in the order the branches are generated:
+    the then/else blocks of an if, and the body/exit of a for loop (see
+    IfExprAST and ForExprAST::codegen). A definition is known by its name and
+    how many definitions of that name came before it in the run, so as long
+    as the same script is run, the counts of each definition match it up.
+
+    When instrumenting, the counters of each definition are an array in the
+    host's memory, which the JIT'd code bumps directly and write() saves.
+    When using a profile read(), the counts of each definition are given to
+    its code generation, which turns them into branch weights, an entry
+    count, and inlining hints.
+*/
+class ExecutionProfile {
+    struct Counters {
+        std::string Key;
+        std::unique_ptr<uint64_t[]> Values;
+        size_t Size;
+    };
+
+    bool Instrument;
+
+    mutable std::mutex Mutex;
+    StringMap<unsigned> Definitions; // definitions of each name so far
+    std::deque<Counters> Live;       // the counters of the definitions instrumented
+
+    StringMap<std::vector<uint64_t>> Loaded; // from read(), by key
+    uint64_t MaxEntryCount = 0;
+
+public:
+    explicit ExecutionProfile(bool Instrument) : Instrument(Instrument) {}
+
+    // Whether definitions get counters.
+    bool isInstrumenting() const { return Instrument; }
+
+    // The key of the next definition of Name (call once per definition).
+    std::string getNextKey(StringRef Name);
+
+    // The counts of the definition Key in the profile read, if there are any.
+    const std::vector<uint64_t>* lookup(StringRef Key) const;
+
+    // Counters of a definition called that often are hot (or cold at 0).
+    bool isHot(uint64_t EntryCount) const;
+
+    // N zeroed counters for the definition Key, which live as long as this.
+    uint64_t* allocateCounters(StringRef Key, size_t N);
+
+    /*
+        The file holds a line for each definition:
+
+            <name> <ordinal> <number of counters> <counter>...
+
+        lines starting with '#' are comments.
+    */
+    Error read(StringRef Filename);
+    Error write(StringRef Filename) const;
+};
+
+#endif
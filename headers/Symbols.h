@@ -0,0 +1,91 @@
+#ifndef __SYMBOLS_H__
+#define __SYMBOLS_H__
+
+#include "llvm/ADT/StringMap.h"
+#include "llvm/ADT/StringRef.h"
+
+#include <shared_mutex>
+#include <utility>
+#include <vector>
+
+using namespace llvm;
+
+/*
+    ===================================
+    ========= SYMBOL INTERNING ========
+    ===================================
+*/
+
+/*
+    Every name (variable, argument or function) is interned once into a small
+    integer ID, so that the tables indexed by name during codegen are plain
+    vectors instead of maps of strings.
+*/
+using SymbolID = unsigned;
+
+/*
+    SymbolTable - The process-wide mapping between names and their IDs. IDs are
+    shared by every parser and session (the prototype registry is indexed by
+    them), so interning is thread safe.
+
+    The user definable operator functions ("unaryC"/"binaryC") are interned up
+    front, at fixed IDs, so codegen doesn't have to build and look up their
+    names.
+*/
+class SymbolTable {
+    mutable std::shared_mutex Mutex;
+    StringMap<SymbolID> IDs;
+    std::vector<StringRef> Names; // indexed by ID, pointing at the keys of IDs
+
+    SymbolTable();
+
+public:
+    static SymbolTable &get();
+
+    SymbolID intern(StringRef Name);
+    StringRef getName(SymbolID ID) const;
+
+    static SymbolID getOperatorID(bool IsBinary, char Op) {
+        return (IsBinary ? 128 : 0) + (Op & 127);
+    }
+};
+
+/*
+    ScopedSymbolTable - The values of the variables in scope, indexed by ID.
+
+    Binding a name remembers the value it shadows, so leaving a scope (popTo a
+    mark taken on entry) restores the outer bindings. Lookups are an index,
+    and never insert anything.
+*/
+template <typename ValueT>
+class ScopedSymbolTable {
+    std::vector<ValueT*> Bindings;
+    std::vector<std::pair<SymbolID, ValueT*>> Shadowed;
+
+public:
+    ValueT* lookup(SymbolID ID) const {
+        return ID < Bindings.size() ? Bindings[ID] : nullptr;
+    }
+
+    void push(SymbolID ID, ValueT* V) {
+        if (ID >= Bindings.size())
+            Bindings.resize(ID + 1);
+        Shadowed.emplace_back(ID, Bindings[ID]);
+        Bindings[ID] = V;
+    }
+
+    // Where the current scope starts, for popTo()
+    size_t mark() const { return Shadowed.size(); }
+
+    // Undo every push() since Mark was taken.
+    void popTo(size_t Mark) {
+        while (Shadowed.size() > Mark) {
+            Bindings[Shadowed.back().first] = Shadowed.back().second;
+            Shadowed.pop_back();
+        }
+    }
+
+    void clear() { popTo(0); }
+};
+
+#endif
@@ -0,0 +1,89 @@
+#ifndef __TIERING_H__
+#define __TIERING_H__
+
+#include "kaleidoscopeJIT.h"
+#include "llvm/ADT/SmallVector.h"
+#include "llvm/ADT/StringMap.h"
+#include "llvm/IR/LLVMContext.h"
+#include "llvm/IR/Module.h"
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+
+using namespace llvm;
+using namespace llvm::orc;
+
+/*
+    ===================================
+    ========= TIERED COMPILER =========
+    ===================================
+*/
+
+/*
+    TieredCompiler - Compiles definitions in two tiers.
+
+    Tier 0: the module is compiled as it is (unoptimized), but every function
+    gets a call counter and is renamed to NAME$tier0.<n>, n counting the
+    definitions of NAME. NAME itself becomes an indirect stub that initially
+    jumps to the tier 0 body, so every caller (past or future) calls through
+    the stub.
+
+    Tier 1: when a function's counter reaches the threshold it tells us so
+    through __kaleidoscope_tier_up, and the function is recompiled at -O3 in
+    the background from a copy of its IR taken before instrumentation. The
+    stub is then pointed at the optimized NAME$tier1.<n> body.
+
+    A redefinition points the existing stub at its own tier 0 body, which
+    starts over with a counter and an ID of its own. Tier-ups of the bodies
+    it replaces (still running, or from calls that were already in them) are
+    dropped rather than pointing the stub back at old code.
+
+    Only one TieredCompiler may exist at a time, since JIT'd code reaches it
+    through a plain function.
+*/
+class TieredCompiler {
+    struct TieredFunction {
+        std::string Name;
+        unsigned Version; // n in NAME$tier0.<n>
+        // Bitcode of the (uninstrumented) module the function was defined
+        // in, shared by all the functions of that module.
+        std::shared_ptr<const SmallVector<char, 0>> Bitcode;
+    };
+
+    KaleidoscopeJIT &JIT;
+    uint64_t Threshold;
+
+    std::unique_ptr<IndirectStubsManager> Stubs;
+    std::mutex StubsMutex;
+    StringMap<uint64_t> Current; // ID of the definition each stub is for (under StubsMutex)
+
+    std::mutex FunctionsMutex;
+    std::deque<TieredFunction> Functions; // indexed by the ID passed to __kaleidoscope_tier_up
+    StringMap<unsigned> Versions;         // definitions of each name so far
+
+    std::atomic<unsigned> NumPromoted{0};
+
+    // Recompilations still running in the background
+    std::mutex PendingMutex;
+    std::condition_variable PendingDone;
+    unsigned Pending = 0;
+
+    static TieredCompiler *Active;
+    static void tierUpHook(uint64_t ID);
+
+    void instrument(Function &F, uint64_t ID);
+    void reoptimize(uint64_t ID);
+
+public:
+    TieredCompiler(KaleidoscopeJIT &JIT, uint64_t Threshold);
+    ~TieredCompiler();
+
+    // Compile the functions defined in M (at tier 0) and make them callable.
+    Error addModule(std::unique_ptr<Module> M, std::unique_ptr<LLVMContext> Ctx);
+
+    unsigned getNumPromoted() const { return NumPromoted; }
+};
+
+#endif
@@ -24,7 +24,13 @@ enum Token {
 
     // operators
     TOK_BINARY = -11,
-    TOK_UNARY = -12
+    TOK_UNARY = -12,
+
+    // local variables
+    TOK_VAR = -13,
+
+    // type names in annotations (double, f32, i64, bool)
+    TOK_TYPE = -14
 };
 
 #endif
\ No newline at end of file
@@ -3,17 +3,47 @@
 
 #include "common.h"
 #include "codegen.h"
+#include "PreparedExpr.h"
+#include "Tiering.h"
 
 /*
     ================================================
-    ========= TOP-lEVEL PARSING JIT DRIVER ========= 
+    ========= TOP-lEVEL PARSING JIT DRIVER =========
     ================================================
 */
 
-static void InitializeModuleAndManagers();
-static void HandleDefinition();
-static void HandleExtern();
-static void HandleTopLevelExpression();
-static void MainLoop();
+extern ExitOnError ExitOnErr;
 
-#endif
\ No newline at end of file
+/*
+    The handlers report errors in the source as they find them (counting them
+    in S.NumErrors) and carry on with the next item. The Errors they return
+    come from the JIT.
+*/
+Error FlushDefinitions(CodegenSession &S);
+Error HandleDefinition(CodegenSession &S, Parser &P);
+Error HandleExtern(CodegenSession &S, Parser &P);
+Error HandleTopLevelExpression(CodegenSession &S, Parser &P, PreparedExpressions &Exprs);
+
+// The handlers' work once the item has been parsed (P gets the precedence of a binary operator defined).
+Error CompileDefinition(CodegenSession &S, Parser &P, std::unique_ptr<FunctionAST> FnAST);
+Error CompileExtern(CodegenSession &S, std::unique_ptr<PrototypeAST> ProtoAST);
+Error RunTopLevelExpression(CodegenSession &S, FunctionAST &FnAST, PreparedExpressions &Exprs);
+
+/*
+    command ::= ':' identifier
+
+    REPL commands, which can't be mistaken for an expression as no top-level
+    item starts with ':' (unless it's made a unary operator):
+        :memory   print how much code and data the JIT is holding on to
+*/
+Error HandleCommand(CodegenSession &S, Parser &P);
+
+/*
+    top ::= definition | external | expression | command | ';'
+
+    Compiles (and runs the top-level expressions of) everything up to the end
+    of P's input, through the session S and the expression cache Exprs.
+*/
+Error MainLoop(CodegenSession &S, Parser &P, PreparedExpressions &Exprs);
+
+#endif
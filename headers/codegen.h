@@ -4,33 +4,210 @@
 #include "common.h"
 #include "AST.h"
 #include "Parser.h"
+#include "PhaseStats.h"
+#include "Pipeline.h"
+#include "Profile.h"
+#include "llvm/ADT/DenseSet.h"
+
+#include <deque>
+#include <optional>
+#include <shared_mutex>
+
+class TieredCompiler;
 
 /*
     ===================================
-    ========= CODE GENERATION ========= 
+    ========= CODE GENERATION =========
     ===================================
 */
 
-static std::unique_ptr<LLVMContext> TheContext;
-static std::unique_ptr<Module> TheModule;
-static std::unique_ptr<IRBuilder<>> Builder;
-static std::map<std::string, Value*> NamedValues;
+/*
+    PrototypeRegistry - The prototypes of every function defined or declared so
+    far, by any session. A session that calls a function it hasn't seen itself
+    emits a declaration from here, and the JIT links the call to whichever
+    module defined it.
+*/
+class PrototypeRegistry {
+    mutable std::shared_mutex Mutex;
+    std::vector<std::shared_ptr<const PrototypeAST>> Protos; // indexed by SymbolID
+
+public:
+    // Add (or replace) the prototype for its function name.
+    void add(std::shared_ptr<const PrototypeAST> Proto);
+
+    // Null if no function of that name has been seen.
+    std::shared_ptr<const PrototypeAST> lookup(SymbolID Name) const;
+
+    // Give P the precedences of all the binary operators registered so far.
+    void installOperators(Parser &P) const;
+};
+
+/*
+    HostArrayRegistry - The arrays the host has bound by name (see
+    Engine::bindArray), with their types. Code indexes them, and passes them
+    to functions, like array variables, in the host's memory.
+*/
+class HostArrayRegistry {
+    mutable std::shared_mutex Mutex;
+    std::vector<std::optional<ValueType>> Arrays; // indexed by SymbolID
+
+public:
+    void add(SymbolID Name, ValueType Ty);
+
+    // None if the host hasn't bound an array of that name.
+    std::optional<ValueType> lookup(SymbolID Name) const;
+};
+
+/*
+    LocalVariable - The stack slot of an argument or variable, and its type
+    (which says what an array holds, since a pointer doesn't).
+*/
+struct LocalVariable {
+    AllocaInst* Slot;
+    ValueType Type;
+};
+
+/*
+    ProfiledFunction - The profile counters of the function being generated
+    (see ExecutionProfile): the global they're bumped through when
+    instrumenting, and the counts from the profile in use. Branches are
+    collected as they're generated, and get their weights once the whole
+    function is (when its number of counters can be checked).
+*/
+struct ProfiledFunction {
+    struct Branch {
+        BranchInst* Br;
+        unsigned Counter; // the first of its two
+        bool IsLoop;      // a loop's latch: the counters are of its body and its exit
+    };
+
+    std::string Key;
+    Constant* Counters = nullptr;
+    const std::vector<uint64_t>* Counts = nullptr;
+    unsigned NumCounters = 0;
+    std::vector<Branch> Branches;
+};
+
+/*
+    CodegenSession - Everything needed to generate code for one stream of
+    definitions: its own context, module and builder, plus the JIT, optimizer
+    and prototypes it shares with other sessions.
+
+    A session is used by one thread at a time, so several can generate code in
+    parallel (each with its own OptimizationPipeline) and hand their modules to
+    the same JIT.
+*/
+class CodegenSession {
+public:
+    KaleidoscopeJIT* JIT; // Null when compiling ahead of time
+    const DataLayout DL;
+    const Triple TargetTriple;
+    OptimizationPipeline &Pipeline; // Optimizes each function as it is generated
+    PrototypeRegistry &Protos;
+
+    std::unique_ptr<LLVMContext> TheContext;
+    std::unique_ptr<Module> TheModule;
+    std::unique_ptr<IRBuilder<>> Builder;
+    ScopedSymbolTable<LocalVariable> NamedValues; // the arguments and variables in scope
+    std::deque<LocalVariable> Locals; // all those of the function being generated
+    DenseMap<Value*, ValueType> ArrayValues; // the type of each array value of that function (see convertTo)
+
+    // Set in tiered mode, where definitions are handed to it instead of to JIT directly
+    TieredCompiler* Tiers = nullptr;
+
+    /*
+        Definitions are collected into TheModule and handed to the JIT in
+        batches of DefsPerModule (0 = no limit). A pending batch is also flushed
+        whenever a top-level expression needs to run, and at end of input.
+    */
+    unsigned DefsPerModule = 1;
+
+    // Definitions in TheModule that haven't been handed to the JIT yet
+    unsigned PendingDefinitions = 0;
+
+    // Register the prototype of each definition, so that later code (of any
+    // session) can call it. Off for functions only their creator calls, like
+    // prepared expressions, which would otherwise stay registered for good.
+    bool RegisterDefinitions = true;
+
+    // Definitions that also get a batch wrapper (see emitBatchWrapper)
+    const DenseSet<SymbolID>* BatchFunctions = nullptr;
+
+    // The arrays that names not bound to a variable may refer to
+    const HostArrayRegistry* HostArrays = nullptr;
+
+    // Print (to stderr) the IR each item compiled to, and the result of each expression
+    bool Echo = true;
+
+    // Print the REPL prompt before each item
+    bool Prompt = true;
+
+    // If set, the results of expressions are written here instead, one per line
+    raw_ostream* Results = nullptr;
+
+    // Print each module (to stderr) once it's optimized, as it's handed to the JIT
+    bool DumpModules = false;
+
+    // Items that failed to parse or compile (their errors have been printed)
+    unsigned NumErrors = 0;
 
+    // Where the handlers record the time of each phase of an item, if anywhere
+    PhaseStats* Stats = nullptr;
 
-static std::unique_ptr<KaleidoscopeJIT> TheJIT; // Pointer to a simple JIT compiler
-static std::unique_ptr<FunctionPassManager> TheFPM; // pointer to a Function Pass Manager (FPM), which manages
-                                                    // a series of passes to optimize functions in LLVM IR
+    // Set to instrument definitions, or to optimize them with a profile
+    ExecutionProfile* Profile = nullptr;
+    ProfiledFunction FnProfile; // of the definition being generated
 
-// pointers to unique instances of various analysis managers
-static std::unique_ptr<LoopAnalysisManager> TheLAM;
-static std::unique_ptr<FunctionAnalysisManager> TheFAM;
-static std::unique_ptr<CGSCCAnalysisManager> TheCGAM;
-static std::unique_ptr<ModuleAnalysisManager> TheMAM;
+    CodegenSession(KaleidoscopeJIT &JIT, OptimizationPipeline &Pipeline, PrototypeRegistry &Protos,
+                   FastMathFlags FPFlags = FastMathFlags());
 
+    // A session for compiling ahead of time, where everything stays in
+    // TheModule (see AOTCompiler).
+    CodegenSession(const DataLayout &DL, const Triple &TargetTriple, OptimizationPipeline &Pipeline,
+                   PrototypeRegistry &Protos, FastMathFlags FPFlags = FastMathFlags());
 
-static std::unique_ptr<PassInstrumentationCallbacks> ThePIC;
-static std::unique_ptr<StandardInstrumentations> TheSI;
-static std::map<std::string, std::unique_ptr<PrototypeAST>> FunctionProtos;
-static ExitOnError ExitOnErr;
+    // Open a new context and module, once the previous ones have been handed over.
+    void reset();
+
+    FastMathFlags getFastMathFlags() const { return FPFlags; }
+
+    // Hand TheModule and TheContext over (e.g. to the JIT) and reset().
+    ThreadSafeModule takeModule();
+
+    // Find Name in TheModule, or declare it from its registered prototype.
+    Function* getFunction(SymbolID Name);
+
+    // The function called Name in TheModule, if any.
+    Function* findFunction(SymbolID Name) const {
+        return Name < ModuleFunctions.size() ? ModuleFunctions[Name] : nullptr;
+    }
+
+    // Record that F is TheModule's function called Name (null once it's been erased).
+    void setFunction(SymbolID Name, Function* F) {
+        if (Name >= ModuleFunctions.size())
+            ModuleFunctions.resize(Name + 1);
+        ModuleFunctions[Name] = F;
+    }
+
+private:
+    FastMathFlags FPFlags;
+
+    // TheModule's functions by name, so codegen never looks a name up in the
+    // module's symbol table
+    std::vector<Function*> ModuleFunctions;
+};
+
+// The LLVM type of values of type Ty.
+Type* getLLVMType(LLVMContext &Ctx, ValueType Ty);
+
+/*
+    emitBatchWrapper - Add NAME_batch(const double* In0, ..., double* Out, size_t N)
+    to the module of F, the definition of NAME. It sets Out[I] = NAME(In0[I], ...)
+    for every I < N, with NAME's body inlined into the loop so that the -O2/-O3
+    pipeline can vectorize it. Kaleidoscope identifiers can't contain '_', so
+    the name never clashes with a user function. The arrays hold the types of
+    NAME's arguments and result, which can't be arrays themselves.
+*/
+Function* emitBatchWrapper(CodegenSession &S, Function &F);
 
-#endif
\ No newline at end of file
+#endif
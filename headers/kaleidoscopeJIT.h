@@ -1,87 +1,717 @@
 #ifndef LLVM_EXECUTIONENGINE_ORC_KALEIDOSCOPEJIT_H
 #define LLVM_EXECUTIONENGINE_ORC_KALEIDOSCOPEJIT_H
 
+#include "ModuleTracker.h"
+#include "ObjectCache.h"
 #include "llvm/ADT/StringRef.h"
 #include "llvm/ExecutionEngine/JITSymbol.h"
+#include "llvm/ExecutionEngine/Orc/CompileOnDemandLayer.h"
 #include "llvm/ExecutionEngine/Orc/CompileUtils.h"
 #include "llvm/ExecutionEngine/Orc/Core.h"
+#include "llvm/ExecutionEngine/Orc/EPCIndirectionUtils.h"
 #include "llvm/ExecutionEngine/Orc/ExecutionUtils.h"
+#include "llvm/ExecutionEngine/Orc/EPCEHFrameRegistrar.h"
 #include "llvm/ExecutionEngine/Orc/ExecutorProcessControl.h"
 #include "llvm/ExecutionEngine/Orc/IRCompileLayer.h"
+#include "llvm/ExecutionEngine/Orc/IRTransformLayer.h"
 #include "llvm/ExecutionEngine/Orc/JITTargetMachineBuilder.h"
+#include "llvm/ExecutionEngine/Orc/MapperJITLinkMemoryManager.h"
+#include "llvm/ExecutionEngine/Orc/MemoryMapper.h"
+#include "llvm/ExecutionEngine/Orc/ObjectLinkingLayer.h"
 #include "llvm/ExecutionEngine/Orc/RTDyldObjectLinkingLayer.h"
 #include "llvm/ExecutionEngine/Orc/Shared/ExecutorSymbolDef.h"
+#include "llvm/ExecutionEngine/Orc/TaskDispatch.h"
 #include "llvm/ExecutionEngine/SectionMemoryManager.h"
 #include "llvm/IR/DataLayout.h"
 #include "llvm/IR/LLVMContext.h"
+#include "llvm/Object/SymbolSize.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/Format.h"
+#include "llvm/Support/Process.h"
+#include "llvm/Support/ThreadPool.h"
+#include <atomic>
 #include <memory>
+#include <mutex>
 
 namespace llvm {
 namespace orc {
 
+/// CompileStats - Number of function bodies handed to the native compiler,
+/// split by whether they were compiled as part of a whole module (eagerly) or
+/// on their first call through a lazy stub.
+struct CompileStats {
+  unsigned EagerFunctions = 0;
+  unsigned LazyFunctions = 0;
+  unsigned ObjectCacheHits = 0;
+  unsigned ObjectCacheMisses = 0;
+};
+
+/// MemoryStats - What the JIT is holding on to at the moment.
+struct MemoryStats {
+  uint64_t CodeBytes = 0; // Requested for the code sections of loaded objects
+  uint64_t DataBytes = 0; // ... and for their (read-only or writable) data
+  unsigned Objects = 0;   // Loaded objects, one per compiled module
+  unsigned Trackers = 0;  // Live resource trackers of modules
+  unsigned Retained = 0;  // Modules entirely redefined, kept for their callers
+  uint64_t FreedBytes = 0; // Code and data freed since the JIT was created
+};
+
+/// CountingMemoryManager - A SectionMemoryManager (one is created for each
+/// object) that adds what it allocates to its JIT's totals until it's
+/// destroyed, which is when the object's tracker is removed.
+class CountingMemoryManager : public SectionMemoryManager {
+public:
+  struct Totals {
+    std::atomic<uint64_t> CodeBytes{0};
+    std::atomic<uint64_t> DataBytes{0};
+    std::atomic<unsigned> Objects{0};
+    std::atomic<uint64_t> FreedBytes{0};
+  };
+
+  CountingMemoryManager(Totals &T) : T(T) { ++T.Objects; }
+
+  ~CountingMemoryManager() override {
+    T.CodeBytes -= CodeBytes;
+    T.DataBytes -= DataBytes;
+    T.FreedBytes += CodeBytes + DataBytes;
+    --T.Objects;
+  }
+
+  uint8_t *allocateCodeSection(uintptr_t Size, unsigned Alignment,
+                               unsigned SectionID,
+                               StringRef SectionName) override {
+    CodeBytes += Size;
+    T.CodeBytes += Size;
+    return SectionMemoryManager::allocateCodeSection(Size, Alignment, SectionID,
+                                                     SectionName);
+  }
+
+  uint8_t *allocateDataSection(uintptr_t Size, unsigned Alignment,
+                               unsigned SectionID, StringRef SectionName,
+                               bool IsReadOnly) override {
+    DataBytes += Size;
+    T.DataBytes += Size;
+    return SectionMemoryManager::allocateDataSection(
+        Size, Alignment, SectionID, SectionName, IsReadOnly);
+  }
+
+private:
+  Totals &T;
+  uint64_t CodeBytes = 0;
+  uint64_t DataBytes = 0;
+};
+
+/// CountingLinkPlugin - What CountingMemoryManager is for the RTDyld object
+/// layer, for the JITLink one: adds the memory of each graph linked to its
+/// JIT's totals until the graph's tracker is removed.
+class CountingLinkPlugin : public ObjectLinkingLayer::Plugin {
+  struct Usage {
+    uint64_t CodeBytes = 0;
+    uint64_t DataBytes = 0;
+    unsigned Objects = 0;
+  };
+
+public:
+  CountingLinkPlugin(CountingMemoryManager::Totals &T) : T(T) {}
+
+  void modifyPassConfig(MaterializationResponsibility &MR,
+                        jitlink::LinkGraph &G,
+                        jitlink::PassConfiguration &Config) override {
+    Config.PostAllocationPasses.push_back([this, &MR](jitlink::LinkGraph &G) {
+      Usage U;
+      U.Objects = 1;
+      for (auto &Sec : G.sections()) {
+        uint64_t Size = 0;
+        for (auto *B : Sec.blocks())
+          Size += B->getSize();
+        if ((Sec.getMemProt() & MemProt::Exec) != MemProt::None)
+          U.CodeBytes += Size;
+        else
+          U.DataBytes += Size;
+      }
+      std::lock_guard<std::mutex> Lock(Mutex);
+      Linking[&MR] = U;
+      return Error::success();
+    });
+  }
+
+  Error notifyEmitted(MaterializationResponsibility &MR) override {
+    Usage U;
+    {
+      std::lock_guard<std::mutex> Lock(Mutex);
+      auto I = Linking.find(&MR);
+      if (I == Linking.end())
+        return Error::success();
+      U = I->second;
+      Linking.erase(I);
+    }
+    return MR.withResourceKeyDo([&](ResourceKey K) {
+      std::lock_guard<std::mutex> Lock(Mutex);
+      add(Held[K], U);
+      T.CodeBytes += U.CodeBytes;
+      T.DataBytes += U.DataBytes;
+      T.Objects += U.Objects;
+    });
+  }
+
+  Error notifyFailed(MaterializationResponsibility &MR) override {
+    std::lock_guard<std::mutex> Lock(Mutex);
+    Linking.erase(&MR);
+    return Error::success();
+  }
+
+  Error notifyRemovingResources(JITDylib &JD, ResourceKey K) override {
+    std::lock_guard<std::mutex> Lock(Mutex);
+    auto I = Held.find(K);
+    if (I == Held.end())
+      return Error::success();
+    T.CodeBytes -= I->second.CodeBytes;
+    T.DataBytes -= I->second.DataBytes;
+    T.FreedBytes += I->second.CodeBytes + I->second.DataBytes;
+    T.Objects -= I->second.Objects;
+    Held.erase(I);
+    return Error::success();
+  }
+
+  void notifyTransferringResources(JITDylib &JD, ResourceKey DstKey,
+                                   ResourceKey SrcKey) override {
+    std::lock_guard<std::mutex> Lock(Mutex);
+    auto I = Held.find(SrcKey);
+    if (I == Held.end())
+      return;
+    Usage U = I->second;
+    Held.erase(I);
+    add(Held[DstKey], U);
+  }
+
+private:
+  static void add(Usage &To, const Usage &U) {
+    To.CodeBytes += U.CodeBytes;
+    To.DataBytes += U.DataBytes;
+    To.Objects += U.Objects;
+  }
+
+  CountingMemoryManager::Totals &T;
+  std::mutex Mutex;
+  DenseMap<MaterializationResponsibility *, Usage> Linking; // Allocated, not emitted yet
+  DenseMap<ResourceKey, Usage> Held;
+};
+
+/// PerfMapWriter - Appends the address, size and name of each function the
+/// JIT loads to /tmp/perf-<pid>.map, which is where perf looks up the symbols
+/// of code that isn't backed by a file. Functions that are freed stay in the
+/// map, so samples in memory that was reused for other code may be
+/// attributed to either.
+class PerfMapWriter {
+public:
+  static Expected<std::unique_ptr<PerfMapWriter>> Create() {
+    std::string Path =
+        ("/tmp/perf-" + Twine(sys::Process::getProcessId()) + ".map").str();
+    std::error_code EC;
+    auto OS = std::make_unique<raw_fd_ostream>(
+        Path, EC, sys::fs::OF_Text | sys::fs::OF_Append);
+    if (EC)
+      return createFileError(Path, EC);
+    return std::make_unique<PerfMapWriter>(std::move(OS));
+  }
+
+  PerfMapWriter(std::unique_ptr<raw_fd_ostream> OS) : OS(std::move(OS)) {}
+
+  /// addGraph - The functions JITLink has just fixed up in G.
+  void addGraph(jitlink::LinkGraph &G) {
+    std::lock_guard<std::mutex> Lock(Mutex);
+    for (auto *Sym : G.defined_symbols())
+      if (Sym->hasName() && Sym->isCallable())
+        write(Sym->getAddress().getValue(), Sym->getSize(), Sym->getName());
+    OS->flush();
+  }
+
+  /// addObject - The functions of Obj, which RuntimeDyld has just loaded.
+  void addObject(const object::ObjectFile &Obj,
+                 const RuntimeDyld::LoadedObjectInfo &L) {
+    std::lock_guard<std::mutex> Lock(Mutex);
+    for (auto &SymAndSize : object::computeSymbolSizes(Obj)) {
+      const object::SymbolRef &Sym = SymAndSize.first;
+      Expected<object::SymbolRef::Type> Type = Sym.getType();
+      if (!Type || *Type != object::SymbolRef::ST_Function) {
+        consumeError(Type.takeError());
+        continue;
+      }
+      Expected<StringRef> Name = Sym.getName();
+      Expected<uint64_t> Addr = Sym.getAddress();
+      Expected<object::section_iterator> Sec = Sym.getSection();
+      if (!Name || !Addr || !Sec || *Sec == Obj.section_end()) {
+        consumeError(Name.takeError());
+        consumeError(Addr.takeError());
+        consumeError(Sec.takeError());
+        continue;
+      }
+      // The address in the object is relative to its section's
+      uint64_t Offset = *Addr - (*Sec)->getAddress();
+      write(L.getSectionLoadAddress(**Sec) + Offset, SymAndSize.second, *Name);
+    }
+    OS->flush();
+  }
+
+private:
+  // Expects Mutex to be held.
+  void write(uint64_t Addr, uint64_t Size, StringRef Name) {
+    *OS << format_hex_no_prefix(Addr, 1) << ' ' << format_hex_no_prefix(Size, 1)
+        << ' ' << Name << '\n';
+  }
+
+  std::mutex Mutex;
+  std::unique_ptr<raw_fd_ostream> OS;
+};
+
+/// PerfMapPlugin - Hands each graph the ObjectLinkingLayer links to a
+/// PerfMapWriter once its addresses are final.
+class PerfMapPlugin : public ObjectLinkingLayer::Plugin {
+public:
+  PerfMapPlugin(PerfMapWriter &Perf) : Perf(Perf) {}
+
+  void modifyPassConfig(MaterializationResponsibility &MR,
+                        jitlink::LinkGraph &G,
+                        jitlink::PassConfiguration &Config) override {
+    Config.PostFixupPasses.push_back([this](jitlink::LinkGraph &G) {
+      Perf.addGraph(G);
+      return Error::success();
+    });
+  }
+
+  Error notifyFailed(MaterializationResponsibility &MR) override {
+    return Error::success();
+  }
+
+  Error notifyRemovingResources(JITDylib &JD, ResourceKey K) override {
+    return Error::success();
+  }
+
+  void notifyTransferringResources(JITDylib &JD, ResourceKey DstKey,
+                                   ResourceKey SrcKey) override {}
+
+private:
+  PerfMapWriter &Perf;
+};
+
+/// KaleidoscopeJITOptions - Knobs chosen when the JIT is created.
+struct KaleidoscopeJITOptions {
+  // Compile each function body on its first call (see CompileOnDemandLayer).
+  bool LazyCompile = false;
+
+  // Make indirect stubs available (createIndirectStubsManager) so that code
+  // can be swapped for a recompiled version, as the tiered compiler does.
+  bool IndirectStubs = false;
+
+  // Number of threads used to compile modules in the background. With 0 all
+  // compilation happens on the thread that performs the lookup.
+  unsigned NumCompileThreads = 0;
+
+  // If set, compiled objects are stored in (and reused from) this directory.
+  std::string ObjectCacheDir;
+
+  // Optimization level of the machine code generator (instruction selection,
+  // scheduling, register allocation). IR-level optimization happens before
+  // modules reach the JIT.
+  CodeGenOpt::Level CodeGenOptLevel = CodeGenOpt::Default;
+
+  // Generate code for the host CPU and all of its features (AVX2, FMA, ...)
+  // rather than the triple's baseline.
+  bool HostCPU = false;
+
+  // Let the code generator fuse floating point multiplies and adds into FMAs
+  // even where the IR doesn't say it may.
+  bool FastFPContraction = false;
+
+  // Resolve the symbols nothing in the JIT defines (externs of functions the
+  // host hasn't bound with defineAbsolute) by searching the whole process.
+  bool SearchProcessSymbols = true;
+
+  // Link objects with JITLink (ObjectLinkingLayer) instead of RuntimeDyld.
+  // Its memory manager carves every object out of slabs of address space
+  // reserved JITLinkSlabSize bytes at a time, rather than mapping pages for
+  // each one, and keeps the code of all modules close together.
+  bool UseJITLink = false;
+  size_t JITLinkSlabSize = 64 * 1024 * 1024;
+
+  // Write the JIT'd functions to /tmp/perf-<pid>.map (see PerfMapWriter).
+  bool WritePerfMap = false;
+};
+
+/// ThreadPoolTaskDispatcher - Runs ORC tasks (for us mostly materialization,
+/// i.e. compiling a module) on a fixed-size pool of threads.
+class ThreadPoolTaskDispatcher : public TaskDispatcher {
+public:
+  ThreadPoolTaskDispatcher(unsigned NumThreads)
+      : Pool(hardware_concurrency(NumThreads)) {}
+
+  void dispatch(std::unique_ptr<Task> T) override {
+    // ThreadPool only takes copyable callables, so pass the task as a raw
+    // pointer and take ownership back on the worker thread.
+    Pool.async([UnownedT = T.release()]() {
+      std::unique_ptr<Task> T(UnownedT);
+      T->run();
+    });
+  }
+
+  void shutdown() override { Pool.wait(); }
+
+private:
+  ThreadPool Pool;
+};
+
 class KaleidoscopeJIT {
 private:
+  KaleidoscopeJITOptions Opts;
+
   std::unique_ptr<ExecutionSession> ES;
 
+  // Only present in lazy mode or with IndirectStubs: provides the lazy
+  // call-through manager and the indirect stubs that the CompileOnDemandLayer
+  // (or the tiered compiler) emits for each function.
+  std::unique_ptr<EPCIndirectionUtils> EPCIU;
+
+  JITTargetMachineBuilder TMBuilder;
   DataLayout DL;
   MangleAndInterner Mangle;
 
-  RTDyldObjectLinkingLayer ObjectLayer;
+  std::unique_ptr<KaleidoscopeObjectCache> ObjCache;
+
+  CountingMemoryManager::Totals Memory;
+  std::unique_ptr<PerfMapWriter> Perf;
+  // An RTDyldObjectLinkingLayer, or with UseJITLink an ObjectLinkingLayer
+  std::unique_ptr<ObjectLayer> ObjLayer;
   IRCompileLayer CompileLayer;
+  IRTransformLayer LazyCountLayer;
+  std::unique_ptr<CompileOnDemandLayer> CODLayer;
 
   JITDylib &MainJD;
 
+  // Only present when functions can be redefined (not lazily, and without
+  // indirect stubs, whose users own the names of the functions they manage).
+  std::unique_ptr<ModuleTracker> Tracker;
+
+  std::atomic<unsigned> CompiledFunctions{0};
+  std::atomic<unsigned> LazilyCompiledFunctions{0};
+
+  static unsigned countDefinedFunctions(ThreadSafeModule &TSM) {
+    return TSM.withModuleDo([](Module &M) {
+      unsigned N = 0;
+      for (auto &F : M)
+        if (!F.isDeclaration())
+          ++N;
+      return N;
+    });
+  }
+
+  std::unique_ptr<ObjectLayer> createRTDyldLayer() {
+    return std::make_unique<RTDyldObjectLinkingLayer>(*ES, [this]() {
+      return std::make_unique<CountingMemoryManager>(Memory);
+    });
+  }
+
+  static void handleLazyCallThroughError() {
+    errs() << "LazyCallThrough error: Could not find function body";
+    exit(1);
+  }
+
 public:
-  KaleidoscopeJIT(std::unique_ptr<ExecutionSession> ES,
+  KaleidoscopeJIT(KaleidoscopeJITOptions Opts,
+                  std::unique_ptr<ExecutionSession> ES,
+                  std::unique_ptr<EPCIndirectionUtils> EPCIU,
+                  std::unique_ptr<KaleidoscopeObjectCache> ObjCache,
+                  std::unique_ptr<ObjectLinkingLayer> JITLinkLayer,
+                  std::unique_ptr<PerfMapWriter> Perf,
                   JITTargetMachineBuilder JTMB, DataLayout DL)
-      : ES(std::move(ES)), DL(std::move(DL)), Mangle(*this->ES, this->DL),
-        ObjectLayer(*this->ES,
-                    []() { return std::make_unique<SectionMemoryManager>(); }),
-        CompileLayer(*this->ES, ObjectLayer,
-                     std::make_unique<ConcurrentIRCompiler>(std::move(JTMB))),
+      : Opts(std::move(Opts)), ES(std::move(ES)), EPCIU(std::move(EPCIU)),
+        TMBuilder(JTMB), DL(std::move(DL)), Mangle(*this->ES, this->DL),
+        ObjCache(std::move(ObjCache)), Perf(std::move(Perf)),
+        ObjLayer(JITLinkLayer
+                     ? std::unique_ptr<ObjectLayer>(std::move(JITLinkLayer))
+                     : createRTDyldLayer()),
+        CompileLayer(*this->ES, *ObjLayer,
+                     std::make_unique<ConcurrentIRCompiler>(std::move(JTMB),
+                                                            this->ObjCache.get())),
+        LazyCountLayer(*this->ES, CompileLayer,
+                       [this](ThreadSafeModule TSM,
+                              MaterializationResponsibility &R) {
+                         LazilyCompiledFunctions += countDefinedFunctions(TSM);
+                         return Expected<ThreadSafeModule>(std::move(TSM));
+                       }),
         MainJD(this->ES->createBareJITDylib("<main>")) {
-    MainJD.addGenerator(
-        cantFail(DynamicLibrarySearchGenerator::GetForCurrentProcess(
-            DL.getGlobalPrefix())));
-    if (JTMB.getTargetTriple().isOSBinFormatCOFF()) {
-      ObjectLayer.setOverrideObjectFlagsWithResponsibilityFlags(true);
-      ObjectLayer.setAutoClaimResponsibilityForObjectSymbols(true);
+    if (this->Opts.SearchProcessSymbols)
+      MainJD.addGenerator(
+          cantFail(DynamicLibrarySearchGenerator::GetForCurrentProcess(
+              DL.getGlobalPrefix())));
+    if (!this->Opts.LazyCompile && !this->Opts.IndirectStubs)
+      Tracker = std::make_unique<ModuleTracker>(*this->ES, MainJD);
+
+    if (auto *RTDyldLayer = dyn_cast<RTDyldObjectLinkingLayer>(ObjLayer.get())) {
+      if (TMBuilder.getTargetTriple().isOSBinFormatCOFF()) {
+        RTDyldLayer->setOverrideObjectFlagsWithResponsibilityFlags(true);
+        RTDyldLayer->setAutoClaimResponsibilityForObjectSymbols(true);
+      }
+      if (Tracker || this->Perf)
+        RTDyldLayer->setNotifyLoaded(
+            [this](MaterializationResponsibility &R,
+                   const object::ObjectFile &Obj,
+                   const RuntimeDyld::LoadedObjectInfo &L) {
+              // Fails only if the module is being removed already
+              if (Tracker)
+                consumeError(R.withResourceKeyDo(
+                    [&](ResourceKey K) { Tracker->recordUses(K, Obj); }));
+              if (this->Perf)
+                this->Perf->addObject(Obj, L);
+            });
+      // Not called for an object that fails to link, which the tracker then
+      // just keeps treating as linking (until its module is removed).
+      if (Tracker)
+        RTDyldLayer->setNotifyEmitted(
+            [this](MaterializationResponsibility &R,
+                   std::unique_ptr<MemoryBuffer> ObjBuffer) {
+              consumeError(R.withResourceKeyDo(
+                  [&](ResourceKey K) { Tracker->linked(K); }));
+            });
+    } else {
+      auto &LinkLayer = cast<ObjectLinkingLayer>(*ObjLayer);
+      LinkLayer.addPlugin(std::make_unique<CountingLinkPlugin>(Memory));
+      if (Tracker)
+        LinkLayer.addPlugin(std::make_unique<ModuleTrackerPlugin>(*Tracker));
+      if (this->Perf)
+        LinkLayer.addPlugin(std::make_unique<PerfMapPlugin>(*this->Perf));
     }
+
+    CompileLayer.setNotifyCompiled(
+        [this](MaterializationResponsibility &R, ThreadSafeModule TSM) {
+          CompiledFunctions += countDefinedFunctions(TSM);
+        });
+
+    // In lazy mode each function gets a stub that compiles its body (through
+    // LazyCountLayer and CompileLayer) the first time it is called.
+    if (this->Opts.LazyCompile)
+      CODLayer = std::make_unique<CompileOnDemandLayer>(
+          *this->ES, LazyCountLayer, this->EPCIU->getLazyCallThroughManager(),
+          [this] { return this->EPCIU->createIndirectStubsManager(); });
   }
 
   ~KaleidoscopeJIT() {
+    // Ending the session removes every tracker anyway
+    Tracker.reset();
     if (auto Err = ES->endSession())
       ES->reportError(std::move(Err));
+    if (EPCIU)
+      if (auto Err = EPCIU->cleanup())
+        ES->reportError(std::move(Err));
   }
 
-  static Expected<std::unique_ptr<KaleidoscopeJIT>> Create() {
-    auto EPC = SelfExecutorProcessControl::Create();
+  /// createTargetMachineBuilder - Describes the target machine for TT
+  /// configured by Opts (HostCPU, CodeGenOptLevel, FastFPContraction). Also
+  /// used to compile ahead of time for the same target as the JIT would.
+  static Expected<JITTargetMachineBuilder>
+  createTargetMachineBuilder(const KaleidoscopeJITOptions &Opts, Triple TT) {
+    JITTargetMachineBuilder JTMB(std::move(TT));
+    if (Opts.HostCPU) {
+      auto HostJTMB = JITTargetMachineBuilder::detectHost();
+      if (!HostJTMB)
+        return HostJTMB.takeError();
+      JTMB = std::move(*HostJTMB);
+    }
+    JTMB.setCodeGenOptLevel(Opts.CodeGenOptLevel);
+    if (Opts.FastFPContraction)
+      JTMB.getOptions().AllowFPOpFusion = FPOpFusion::Fast;
+    return JTMB;
+  }
+
+  static Expected<std::unique_ptr<KaleidoscopeJIT>>
+  Create(KaleidoscopeJITOptions Opts = KaleidoscopeJITOptions()) {
+    // Materialization tasks are run by the executor process control's task
+    // dispatcher. The default one runs them in place on the looking-up thread.
+    std::unique_ptr<TaskDispatcher> D;
+    if (Opts.NumCompileThreads > 0)
+      D = std::make_unique<ThreadPoolTaskDispatcher>(Opts.NumCompileThreads);
+    auto EPC = SelfExecutorProcessControl::Create(nullptr, std::move(D));
     if (!EPC)
       return EPC.takeError();
 
     auto ES = std::make_unique<ExecutionSession>(std::move(*EPC));
 
-    JITTargetMachineBuilder JTMB(
-        ES->getExecutorProcessControl().getTargetTriple());
+    std::unique_ptr<EPCIndirectionUtils> EPCIU;
+    if (Opts.LazyCompile || Opts.IndirectStubs) {
+      auto EPCIUOrErr =
+          EPCIndirectionUtils::Create(ES->getExecutorProcessControl());
+      if (!EPCIUOrErr)
+        return EPCIUOrErr.takeError();
+      EPCIU = std::move(*EPCIUOrErr);
+    }
+
+    if (Opts.LazyCompile) {
+      EPCIU->createLazyCallThroughManager(
+          *ES, ExecutorAddr::fromPtr(&handleLazyCallThroughError));
+
+      if (auto Err = setUpInProcessLCTMReentryViaEPCIU(*EPCIU))
+        return std::move(Err);
+    }
+
+    auto JTMBOrErr = createTargetMachineBuilder(
+        Opts, ES->getExecutorProcessControl().getTargetTriple());
+    if (!JTMBOrErr)
+      return JTMBOrErr.takeError();
+    JITTargetMachineBuilder JTMB = std::move(*JTMBOrErr);
 
     auto DL = JTMB.getDefaultDataLayoutForTarget();
     if (!DL)
       return DL.takeError();
 
-    return std::make_unique<KaleidoscopeJIT>(std::move(ES), std::move(JTMB),
-                                             std::move(*DL));
+    std::unique_ptr<KaleidoscopeObjectCache> ObjCache;
+    if (!Opts.ObjectCacheDir.empty()) {
+      if (auto EC = sys::fs::create_directories(Opts.ObjectCacheDir))
+        return createFileError(Opts.ObjectCacheDir, EC);
+      // The cache key depends on the configuration of the target machine that
+      // ConcurrentIRCompiler will build from JTMB.
+      auto TM = JTMB.createTargetMachine();
+      if (!TM)
+        return TM.takeError();
+      ObjCache = std::make_unique<KaleidoscopeObjectCache>(Opts.ObjectCacheDir,
+                                                           **TM);
+    }
+
+    std::unique_ptr<ObjectLinkingLayer> JITLinkLayer;
+    if (Opts.UseJITLink) {
+      auto MemMgr = MapperJITLinkMemoryManager::CreateWithMapper<
+          InProcessMemoryMapper>(Opts.JITLinkSlabSize);
+      if (!MemMgr)
+        return MemMgr.takeError();
+      JITLinkLayer = std::make_unique<ObjectLinkingLayer>(*ES, std::move(*MemMgr));
+
+      // Register the unwind info of each object, as SectionMemoryManager does
+      auto EHFrames = EPCEHFrameRegistrar::Create(*ES);
+      if (!EHFrames)
+        return EHFrames.takeError();
+      JITLinkLayer->addPlugin(std::make_unique<EHFrameRegistrationPlugin>(
+          *ES, std::move(*EHFrames)));
+    }
+
+    std::unique_ptr<PerfMapWriter> Perf;
+    if (Opts.WritePerfMap) {
+      auto PerfOrErr = PerfMapWriter::Create();
+      if (!PerfOrErr)
+        return PerfOrErr.takeError();
+      Perf = std::move(*PerfOrErr);
+    }
+
+    return std::make_unique<KaleidoscopeJIT>(
+        std::move(Opts), std::move(ES), std::move(EPCIU), std::move(ObjCache),
+        std::move(JITLinkLayer), std::move(Perf), std::move(JTMB),
+        std::move(*DL));
   }
 
   const DataLayout &getDataLayout() const { return DL; }
 
+  const Triple &getTargetTriple() const { return TMBuilder.getTargetTriple(); }
+
+  /// getTargetMachineBuilder - Describes the target machine the JIT compiles
+  /// for, so IR-level passes can be given matching target information.
+  JITTargetMachineBuilder getTargetMachineBuilder() const { return TMBuilder; }
+
   JITDylib &getMainJITDylib() { return MainJD; }
 
-  Error addModule(ThreadSafeModule TSM, ResourceTrackerSP RT = nullptr) {
+  bool isLazy() const { return CODLayer != nullptr; }
+
+  CompileStats getCompileStats() const {
+    CompileStats S;
+    S.LazyFunctions = LazilyCompiledFunctions;
+    S.EagerFunctions = CompiledFunctions - S.LazyFunctions;
+    if (ObjCache) {
+      S.ObjectCacheHits = ObjCache->getNumHits();
+      S.ObjectCacheMisses = ObjCache->getNumMisses();
+    }
+    return S;
+  }
+
+  /// addModule - Add a module to MainJD. In lazy mode the module's functions
+  /// are only compiled when first called, unless AllowLazy is false (used for
+  /// code that is about to be run anyway, like top-level expressions).
+  ///
+  /// Without RT the module gets a tracker of its own (see ModuleTracker), if
+  /// functions can be redefined, and redefines the functions it defines.
+  /// Those that were defined before are freed once nothing uses them.
+  Error addModule(ThreadSafeModule TSM, ResourceTrackerSP RT = nullptr,
+                  bool AllowLazy = true) {
+    if (Tracker && !RT) {
+      SymbolAliasMap Aliases;
+      RT = TSM.withModuleDo([&](Module &M) {
+        return Tracker->addDefinitions(M, Mangle, Aliases);
+      });
+      if (auto Err = CompileLayer.add(RT, std::move(TSM)))
+        return Err;
+      return Tracker->publish(std::move(RT), std::move(Aliases));
+    }
+
     if (!RT)
       RT = MainJD.getDefaultResourceTracker();
+    else if (Tracker)
+      Tracker->addModule(RT);
+    if (CODLayer && AllowLazy)
+      return CODLayer->add(RT, std::move(TSM));
     return CompileLayer.add(RT, std::move(TSM));
   }
 
+  MemoryStats getMemoryStats() const {
+    MemoryStats S;
+    S.CodeBytes = Memory.CodeBytes;
+    S.DataBytes = Memory.DataBytes;
+    S.Objects = Memory.Objects;
+    S.FreedBytes = Memory.FreedBytes;
+    if (Tracker) {
+      auto TS = Tracker->getStats();
+      S.Trackers = TS.Trackers;
+      S.Retained = TS.Retained;
+    }
+    return S;
+  }
+
+  /// compileInBackground - Start materializing the given symbols on the
+  /// compile threads without waiting for them. A later lookup of one of them
+  /// only blocks until that symbol (and what it depends on) is ready. Does
+  /// nothing without compile threads, or in lazy mode where compiling on
+  /// first call is the point.
+  void compileInBackground(ArrayRef<std::string> Names) {
+    if (Opts.NumCompileThreads == 0 || isLazy())
+      return;
+
+    SymbolLookupSet Symbols;
+    for (auto &Name : Names)
+      Symbols.add(Mangle(Name));
+
+    ES->lookup(
+        LookupKind::Static, makeJITDylibSearchOrder(&MainJD),
+        std::move(Symbols), SymbolState::Ready,
+        [this](Expected<SymbolMap> Result) {
+          if (!Result)
+            ES->reportError(Result.takeError());
+        },
+        NoDependenciesToRegister);
+  }
+
+  /// createIndirectStubsManager - Stubs whose targets can be updated while
+  /// the program runs. Requires the IndirectStubs (or LazyCompile) option.
+  std::unique_ptr<IndirectStubsManager> createIndirectStubsManager() {
+    assert(EPCIU && "JIT was created without indirect stubs support");
+    return EPCIU->createIndirectStubsManager();
+  }
+
+  /// defineAbsolute - Make Name resolve to an address that's managed outside
+  /// of the JIT's layers (a host function or array, or an indirect stub).
+  Error defineAbsolute(StringRef Name, ExecutorSymbolDef Sym) {
+    return MainJD.define(absoluteSymbols({{Mangle(Name), Sym}}));
+  }
+
+  /// runInBackground - Run Work on the compile threads, or right away on the
+  /// calling thread if there are none.
+  void runInBackground(unique_function<void()> Work, const char *Desc) {
+    ES->dispatchTask(makeGenericNamedTask(std::move(Work), Desc));
+  }
+
   Expected<ExecutorSymbolDef> lookup(StringRef Name) {
     return ES->lookup({&MainJD}, Mangle(Name.str()));
   }
@@ -0,0 +1,203 @@
+#include "../headers/AOT.h"
+#include "llvm/ADT/StringExtras.h"
+#include "llvm/IR/LegacyPassManager.h"
+#include "llvm/Object/ArchiveWriter.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/Path.h"
+#include "llvm/Support/ToolOutputFile.h"
+
+AOTCompiler::AOTCompiler(const EngineOptions &Opts) : Opts(Opts) {
+    for (auto &Name : Opts.BatchFunctions)
+        BatchFunctions.insert(SymbolTable::get().intern(Name));
+}
+
+Expected<std::unique_ptr<AOTCompiler>> AOTCompiler::create(const EngineOptions &Opts) {
+    InitializeNativeTargetOnce();
+
+    if (Opts.OptLevel > 3)
+        return createStringError(inconvertibleErrorCode(), "invalid optimization level -O%u", Opts.OptLevel);
+
+    std::unique_ptr<AOTCompiler> C(new AOTCompiler(Opts));
+    if (auto Err = C->init())
+        return std::move(Err);
+    return std::move(C);
+}
+
+Error AOTCompiler::init() {
+    auto Host = JITTargetMachineBuilder::detectHost();
+    if (!Host)
+        return Host.takeError();
+    auto JTMB = KaleidoscopeJIT::createTargetMachineBuilder(Opts.getJITOptions(), Host->getTargetTriple());
+    if (!JTMB)
+        return JTMB.takeError();
+    // The object may be linked into a position independent executable or shared library
+    JTMB->setRelocationModel(Reloc::PIC_);
+    auto TMOrErr = JTMB->createTargetMachine();
+    if (!TMOrErr)
+        return TMOrErr.takeError();
+    TM = std::move(*TMOrErr);
+
+    PipelineOptions PipelineOpts;
+    PipelineOpts.OptLevel = Opts.OptLevel;
+    PipelineOpts.TM = TM.get();
+    PipelineOpts.DebugLogging = Opts.LogPasses;
+    PipelineOpts.TimePasses = Opts.TimePasses;
+    Pipeline = std::make_unique<OptimizationPipeline>(PipelineOpts);
+
+    FastMathFlags FPFlags;
+    if (Opts.FastMath)
+        FPFlags.setFast();
+    Session = std::make_unique<CodegenSession>(TM->createDataLayout(), TM->getTargetTriple(), *Pipeline, Protos,
+                                               FPFlags);
+    Session->BatchFunctions = &BatchFunctions;
+    Session->Echo = false;
+
+    // Counters need the JIT, but an earlier run's profile can be used ahead of time too
+    if (!Opts.ProfileUse.empty()) {
+        Profile = std::make_unique<ExecutionProfile>(/*Instrument*/ false);
+        if (auto Err = Profile->read(Opts.ProfileUse))
+            return Err;
+        Session->Profile = Profile.get();
+    }
+    Session->reset();
+    return Error::success();
+}
+
+Error AOTCompiler::addFile(StringRef Filename) {
+    auto Lex = Lexer::open(Filename);
+    if (!Lex)
+        return Lex.takeError();
+
+    Parser P(**Lex);
+    Protos.installOperators(P);
+
+    CodegenSession &S = *Session;
+    unsigned ErrorsBefore = S.NumErrors;
+    P.getNextToken();
+    while (P.getCurTok() != TOK_EOF) {
+        // Nothing is handed to the JIT, so the handlers don't fail
+        switch (P.getCurTok()) {
+            case ';':
+                P.getNextToken();
+                break;
+            case TOK_DEF:
+                cantFail(HandleDefinition(S, P));
+                break;
+            case TOK_EXTERN:
+                cantFail(HandleExtern(S, P));
+                break;
+            default:
+                if (P.ParseTopLevelExpr()) {
+                    fprintf(stderr, "Warning: %s: top-level expression skipped, there's nothing to run it ahead of time\n",
+                            Filename.str().c_str());
+                } else {
+                    ++S.NumErrors;
+                    P.getNextToken();
+                }
+                break;
+        }
+        P.clearAST();
+    }
+
+    if (unsigned NumErrors = S.NumErrors - ErrorsBefore)
+        return createStringError(inconvertibleErrorCode(), "%s: %u error(s)", Filename.str().c_str(), NumErrors);
+    return Error::success();
+}
+
+Error AOTCompiler::writeObject(StringRef Filename) {
+    Module &M = *Session->TheModule;
+    Pipeline->run(M);
+
+    SmallVector<char, 0> Object;
+    raw_svector_ostream ObjectOS(Object);
+    legacy::PassManager CodeGenPasses;
+    if (TM->addPassesToEmitFile(CodeGenPasses, ObjectOS, nullptr, CGFT_ObjectFile))
+        return createStringError(inconvertibleErrorCode(), "the target can't emit object files");
+    CodeGenPasses.run(M);
+
+    if (Filename.endswith(".a")) {
+        std::string MemberName = (sys::path::stem(Filename) + ".o").str();
+        NewArchiveMember Member(MemoryBufferRef(StringRef(Object.data(), Object.size()), MemberName));
+        Member.MemberName = MemberName;
+        auto Kind = TM->getTargetTriple().isOSDarwin() ? object::Archive::K_DARWIN : object::Archive::K_GNU;
+        return writeArchive(Filename, Member, SymtabWritingMode::NormalSymtab, Kind, /*Deterministic*/ true,
+                            /*Thin*/ false);
+    }
+
+    std::error_code EC;
+    ToolOutputFile Out(Filename, EC, sys::fs::OF_None);
+    if (EC)
+        return createFileError(Filename, EC);
+    Out.os() << StringRef(Object.data(), Object.size());
+    Out.keep();
+    return Error::success();
+}
+
+// The C type a value of type Ty is passed as.
+static StringRef getCTypeName(ValueType Ty) {
+    switch (Ty) {
+        case ValueType::Double: return "double";
+        case ValueType::F32: return "float";
+        case ValueType::I64: return "int64_t";
+        case ValueType::Bool: return "bool";
+        case ValueType::DoubleArray: return "double*";
+        case ValueType::F32Array: return "float*";
+    }
+    llvm_unreachable("unknown value type");
+}
+
+Error AOTCompiler::writeHeader(StringRef Filename) {
+    std::error_code EC;
+    ToolOutputFile Out(Filename, EC, sys::fs::OF_Text);
+    if (EC)
+        return createFileError(Filename, EC);
+    raw_ostream &OS = Out.os();
+
+    std::string Guard = sys::path::filename(Filename).upper();
+    for (char &C : Guard)
+        if (!isalnum((unsigned char)C))
+            C = '_';
+
+    OS << "/* Generated by kaleidoscope, declares the functions of its compiled object. */\n"
+       << "#ifndef " << Guard << "\n"
+       << "#define " << Guard << "\n\n"
+       << "#include <stdbool.h>\n"
+       << "#include <stddef.h>\n"
+       << "#include <stdint.h>\n\n"
+       << "#ifdef __cplusplus\n"
+       << "extern \"C\" {\n"
+       << "#endif\n\n";
+
+    SymbolTable &Symbols = SymbolTable::get();
+    for (Function &F : *Session->TheModule) {
+        if (F.isDeclaration())
+            continue;
+
+        // A batch wrapper takes an array for each argument of the function it wraps
+        StringRef Name = F.getName();
+        bool IsBatch = Name.consume_back("_batch");
+        auto Proto = Protos.lookup(Symbols.intern(Name));
+
+        // Operators have no C name
+        if (!Proto || Proto->isUnaryOp() || Proto->isBinaryOp())
+            continue;
+
+        OS << (IsBatch ? "void" : getCTypeName(Proto->getReturnType())) << ' ' << F.getName() << '(';
+        ListSeparator Sep;
+        for (auto [Arg, Ty] : zip(Proto->getArgs(), Proto->getArgTypes()))
+            OS << Sep << (IsBatch ? "const " : "") << getCTypeName(Ty) << (IsBatch ? "* " : " ") << Arg;
+        // Kaleidoscope names can't contain '_', so these can't clash with the arguments
+        if (IsBatch)
+            OS << Sep << getCTypeName(Proto->getReturnType()) << "* out_" << Sep << "size_t n_";
+        else if (Proto->getArgs().empty())
+            OS << "void";
+        OS << ");\n";
+    }
+
+    OS << "\n#ifdef __cplusplus\n"
+       << "}\n"
+       << "#endif\n\n"
+       << "#endif\n";
+    Out.keep();
+    return Error::success();
+}
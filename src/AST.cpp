@@ -0,0 +1,106 @@
+#include "../headers/AST.h"
+#include "llvm/Support/Format.h"
+
+StringRef getTypeName(ValueType Ty) {
+    switch (Ty) {
+        case ValueType::Double: return "double";
+        case ValueType::F32: return "f32";
+        case ValueType::I64: return "i64";
+        case ValueType::Bool: return "bool";
+        case ValueType::DoubleArray: return "double*";
+        case ValueType::F32Array: return "f32*";
+    }
+    llvm_unreachable("unknown value type");
+}
+
+void ExprAST::print(raw_ostream &OS) const {
+    switch (getKind()) {
+        case EK_Number: return cast<NumberExprAST>(this)->print(OS);
+        case EK_Variable: return cast<VariableExprAST>(this)->print(OS);
+        case EK_Index: return cast<IndexExprAST>(this)->print(OS);
+        case EK_Binary: return cast<BinaryExprAST>(this)->print(OS);
+        case EK_Unary: return cast<UnaryExprAST>(this)->print(OS);
+        case EK_Call: return cast<CallExprAST>(this)->print(OS);
+        case EK_If: return cast<IfExprAST>(this)->print(OS);
+        case EK_For: return cast<ForExprAST>(this)->print(OS);
+        case EK_Var: return cast<VarExprAST>(this)->print(OS);
+    }
+    llvm_unreachable("unknown expression kind");
+}
+
+void NumberExprAST::print(raw_ostream &OS) const {
+    // Hex floats are exact, so different values never print the same
+    OS << format("%a", Val);
+}
+
+void VariableExprAST::print(raw_ostream &OS) const {
+    OS << '$' << Name;
+}
+
+void IndexExprAST::print(raw_ostream &OS) const {
+    OS << "(index $" << Name << ' ';
+    Index->print(OS);
+    OS << ')';
+}
+
+void BinaryExprAST::print(raw_ostream &OS) const {
+    OS << "(binary " << (unsigned)(unsigned char)Op << ' ';
+    LHS->print(OS);
+    OS << ' ';
+    RHS->print(OS);
+    OS << ')';
+}
+
+void UnaryExprAST::print(raw_ostream &OS) const {
+    OS << "(unary " << (unsigned)(unsigned char)Opcode << ' ';
+    Operand->print(OS);
+    OS << ')';
+}
+
+void CallExprAST::print(raw_ostream &OS) const {
+    OS << "(call " << Callee;
+    for (ExprAST* Arg : Args) {
+        OS << ' ';
+        Arg->print(OS);
+    }
+    OS << ')';
+}
+
+void IfExprAST::print(raw_ostream &OS) const {
+    OS << "(if ";
+    Cond->print(OS);
+    OS << ' ';
+    Then->print(OS);
+    OS << ' ';
+    Else->print(OS);
+    OS << ')';
+}
+
+void ForExprAST::print(raw_ostream &OS) const {
+    OS << "(for $" << VarName << ':' << getTypeName(VarType) << ' ';
+    Start->print(OS);
+    OS << ' ';
+    End->print(OS);
+    OS << ' ';
+    if (Step)
+        Step->print(OS);
+    else
+        OS << '_';
+    OS << ' ';
+    Body->print(OS);
+    OS << ')';
+}
+
+void VarExprAST::print(raw_ostream &OS) const {
+    OS << "(var";
+    for (auto &Var : Vars) {
+        OS << " $" << Var.Name << ':' << getTypeName(Var.Type) << ' ';
+        if (Var.Init)
+            Var.Init->print(OS);
+        else
+            OS << '_';
+    }
+    OS << ' ';
+    Body->print(OS);
+    OS << ')';
+}
@@ -0,0 +1,368 @@
+#include "../headers/Engine.h"
+
+#include <thread>
+#include <utility>
+
+void InitializeNativeTargetOnce() {
+    static std::once_flag Initialized;
+    std::call_once(Initialized, [] {
+        InitializeNativeTarget();
+        InitializeNativeTargetAsmPrinter();
+        InitializeNativeTargetAsmParser();
+    });
+}
+
+Engine::Engine(const EngineOptions &Opts) : Opts(Opts) {
+    if (Opts.FastMath)
+        FPFlags.setFast();
+    for (auto &Name : Opts.BatchFunctions)
+        BatchFunctions.insert(SymbolTable::get().intern(Name));
+}
+
+Engine::~Engine() {
+    // The expressions' code and the tiered compiler's stubs live in the JIT
+    Exprs.reset();
+    Session.reset();
+    Tiers.reset();
+}
+
+Expected<std::unique_ptr<Engine>> Engine::create(const EngineOptions &Opts) {
+    InitializeNativeTargetOnce();
+
+    if (Opts.OptLevel > 3)
+        return createStringError(inconvertibleErrorCode(), "invalid optimization level -O%u", Opts.OptLevel);
+
+    std::unique_ptr<Engine> E(new Engine(Opts));
+    if (auto Err = E->init())
+        return std::move(Err);
+    return std::move(E);
+}
+
+KaleidoscopeJITOptions EngineOptions::getJITOptions() const {
+    KaleidoscopeJITOptions JITOpts;
+    JITOpts.LazyCompile = LazyCompile;
+    JITOpts.NumCompileThreads = JITThreads;
+    JITOpts.ObjectCacheDir = ObjectCacheDir;
+    JITOpts.IndirectStubs = Tiered;
+    JITOpts.HostCPU = HostCPU;
+    JITOpts.FastFPContraction = FastMath;
+    JITOpts.SearchProcessSymbols = SearchProcessSymbols;
+    JITOpts.UseJITLink = JITLink;
+    JITOpts.WritePerfMap = PerfMap;
+    switch (OptLevel) {
+        case 0: JITOpts.CodeGenOptLevel = CodeGenOpt::None; break;
+        case 1: JITOpts.CodeGenOptLevel = CodeGenOpt::Less; break;
+        case 2: JITOpts.CodeGenOptLevel = CodeGenOpt::Default; break;
+        default: JITOpts.CodeGenOptLevel = CodeGenOpt::Aggressive; break;
+    }
+    return JITOpts;
+}
+
+Error Engine::init() {
+    auto J = KaleidoscopeJIT::Create(Opts.getJITOptions());
+    if (!J)
+        return J.takeError();
+    JIT = std::move(*J);
+
+    // The optimizers are built once and shared by every module
+    for (unsigned I = 0, E = std::max(Opts.NumWorkers, 1u); I != E; ++I) {
+        auto TM = JIT->getTargetMachineBuilder().createTargetMachine();
+        if (!TM)
+            return TM.takeError();
+        TMs.push_back(std::move(*TM));
+
+        PipelineOptions PipelineOpts;
+        PipelineOpts.OptLevel = Opts.Tiered ? 0 : Opts.OptLevel; // tier 0 is unoptimized
+        PipelineOpts.TM = TMs.back().get();
+        PipelineOpts.DebugLogging = Opts.LogPasses;
+        PipelineOpts.TimePasses = Opts.TimePasses;
+        Pipelines.push_back(std::make_unique<OptimizationPipeline>(PipelineOpts));
+        if (Opts.CollectPhaseStats)
+            Phases.push_back(std::make_unique<PhaseStats>());
+    }
+
+    if (Opts.Tiered)
+        Tiers = std::make_unique<TieredCompiler>(*JIT, Opts.TierUpThreshold);
+
+    if (Opts.ProfileInstrument || !Opts.ProfileUse.empty()) {
+        Profile = std::make_unique<ExecutionProfile>(Opts.ProfileInstrument);
+        if (!Opts.ProfileUse.empty())
+            if (auto Err = Profile->read(Opts.ProfileUse))
+                return Err;
+    }
+
+    Session = createSession(0);
+    Session->Echo = false;
+    Session->Prompt = false;
+    Exprs = std::make_unique<PreparedExpressions>(*JIT, *Pipelines[0], Protos, FPFlags, &HostArrays);
+    Exprs->setPhaseStats(getWorkerPhaseStats(0));
+    return Error::success();
+}
+
+std::unique_ptr<CodegenSession> Engine::createSession(unsigned Worker) {
+    auto S = std::make_unique<CodegenSession>(*JIT, *Pipelines[Worker], Protos, FPFlags);
+    S->Tiers = Tiers.get();
+    S->DefsPerModule = Opts.DefsPerModule;
+    S->BatchFunctions = &BatchFunctions;
+    S->HostArrays = &HostArrays;
+    S->Stats = getWorkerPhaseStats(Worker);
+    S->DumpModules = Opts.DumpModules;
+    S->Profile = Profile.get();
+    S->reset();
+    return S;
+}
+
+Error Engine::compile(StringRef Source) {
+    std::lock_guard<std::mutex> Lock(CompileMutex);
+
+    Lexer Lex(MemoryBuffer::getMemBuffer(Source, "<source>", /*RequiresNullTerminator*/ false));
+    Parser P(Lex);
+    Protos.installOperators(P);
+
+    unsigned ErrorsBefore = Session->NumErrors;
+    P.getNextToken();
+    if (auto Err = MainLoop(*Session, P, *Exprs))
+        return Err;
+
+    if (unsigned NumErrors = Session->NumErrors - ErrorsBefore)
+        return createStringError(inconvertibleErrorCode(), "%u error(s) in source", NumErrors);
+    return Error::success();
+}
+
+Expected<ReloadStats> Engine::reload(StringRef Source, raw_ostream* Results) {
+    std::lock_guard<std::mutex> Lock(CompileMutex);
+
+    Lexer Lex(MemoryBuffer::getMemBuffer(Source, "<source>", /*RequiresNullTerminator*/ false));
+    Parser P(Lex);
+    Protos.installOperators(P);
+
+    unsigned ErrorsBefore = Session->NumErrors;
+    Session->Results = Results;
+    P.getNextToken();
+    auto Stats = ReloadSource(*Session, P, *Exprs, Graph);
+    Session->Results = nullptr;
+    if (!Stats)
+        return Stats.takeError();
+
+    if (unsigned NumErrors = Session->NumErrors - ErrorsBefore)
+        return createStringError(inconvertibleErrorCode(), "%u error(s) in source", NumErrors);
+    return Stats;
+}
+
+// Host symbols are absolute symbols of the main JITDylib, so the JIT never
+// searches for them (or copies anything).
+Error Engine::bindSymbol(StringRef Name, ExecutorAddr Addr, JITSymbolFlags Flags) {
+    return JIT->defineAbsolute(Name, ExecutorSymbolDef(Addr, Flags));
+}
+
+Error Engine::bindArray(StringRef Name, const void* Data, ValueType Ty) {
+    SymbolID ID = SymbolTable::get().intern(Name);
+    if (Protos.lookup(ID))
+        return createStringError(inconvertibleErrorCode(), "'%s' is already a function", Name.str().c_str());
+
+    if (auto Err = bindSymbol(Name, ExecutorAddr::fromPtr(Data), JITSymbolFlags::Exported))
+        return Err;
+    HostArrays.add(ID, Ty);
+    return Error::success();
+}
+
+Expected<ExecutorAddr> Engine::lookup(StringRef Name) {
+    auto Sym = JIT->lookup(Name);
+    if (!Sym)
+        return Sym.takeError();
+    return Sym->getAddress();
+}
+
+// Call the double(double, ...) function at Addr with one argument for each of I
+template <size_t... I>
+static double callWithArgs(ExecutorAddr Addr, ArrayRef<double> Args, std::index_sequence<I...>) {
+    using FnTy = double (*)(decltype((void)I, 0.0)...);
+    return Addr.toPtr<FnTy>()(Args[I]...);
+}
+
+Expected<double> Engine::call(StringRef Name, ArrayRef<double> Args) {
+    auto Proto = Protos.lookup(SymbolTable::get().intern(Name));
+    if (!Proto)
+        return createStringError(inconvertibleErrorCode(), "unknown function '%s'", Name.str().c_str());
+    if (!Proto->hasDoubleSignature())
+        return createStringError(inconvertibleErrorCode(), "'%s' has arguments or a result that aren't doubles",
+                                 Name.str().c_str());
+    if (Proto->getArgIDs().size() != Args.size())
+        return createStringError(inconvertibleErrorCode(), "'%s' takes %zu arguments, not %zu",
+                                 Name.str().c_str(), Proto->getArgIDs().size(), Args.size());
+
+    auto Addr = lookup(Name);
+    if (!Addr)
+        return Addr.takeError();
+
+    switch (Args.size()) {
+        case 0: return callWithArgs(*Addr, Args, std::make_index_sequence<0>());
+        case 1: return callWithArgs(*Addr, Args, std::make_index_sequence<1>());
+        case 2: return callWithArgs(*Addr, Args, std::make_index_sequence<2>());
+        case 3: return callWithArgs(*Addr, Args, std::make_index_sequence<3>());
+        case 4: return callWithArgs(*Addr, Args, std::make_index_sequence<4>());
+        case 5: return callWithArgs(*Addr, Args, std::make_index_sequence<5>());
+        case 6: return callWithArgs(*Addr, Args, std::make_index_sequence<6>());
+        case 7: return callWithArgs(*Addr, Args, std::make_index_sequence<7>());
+        case 8: return callWithArgs(*Addr, Args, std::make_index_sequence<8>());
+    }
+    return createStringError(inconvertibleErrorCode(), "can't call '%s' with %zu arguments, prepare() a call instead",
+                             Name.str().c_str(), Args.size());
+}
+
+// Call the batch wrapper at Addr with one input array for each of I
+template <size_t... I>
+static void callBatchWithInputs(ExecutorAddr Addr, ArrayRef<const double*> Inputs, double* Out, size_t N,
+                                std::index_sequence<I...>) {
+    using FnTy = void (*)(decltype((void)I, (const double*)nullptr)..., double*, size_t);
+    Addr.toPtr<FnTy>()(Inputs[I]..., Out, N);
+}
+
+Error Engine::callBatch(StringRef Name, ArrayRef<const double*> Inputs, double* Out, size_t N) {
+    SymbolID ID = SymbolTable::get().intern(Name);
+    if (!BatchFunctions.count(ID))
+        return createStringError(inconvertibleErrorCode(), "'%s' has no batch wrapper", Name.str().c_str());
+    auto Proto = Protos.lookup(ID);
+    if (!Proto)
+        return createStringError(inconvertibleErrorCode(), "unknown function '%s'", Name.str().c_str());
+    if (!Proto->hasDoubleSignature())
+        return createStringError(inconvertibleErrorCode(), "'%s' has arguments or a result that aren't doubles",
+                                 Name.str().c_str());
+    if (Proto->getArgIDs().size() != Inputs.size())
+        return createStringError(inconvertibleErrorCode(), "'%s' takes %zu arguments, not %zu",
+                                 Name.str().c_str(), Proto->getArgIDs().size(), Inputs.size());
+
+    auto Addr = lookup((Name + "_batch").str());
+    if (!Addr)
+        return Addr.takeError();
+
+    switch (Inputs.size()) {
+        case 0: callBatchWithInputs(*Addr, Inputs, Out, N, std::make_index_sequence<0>()); break;
+        case 1: callBatchWithInputs(*Addr, Inputs, Out, N, std::make_index_sequence<1>()); break;
+        case 2: callBatchWithInputs(*Addr, Inputs, Out, N, std::make_index_sequence<2>()); break;
+        case 3: callBatchWithInputs(*Addr, Inputs, Out, N, std::make_index_sequence<3>()); break;
+        case 4: callBatchWithInputs(*Addr, Inputs, Out, N, std::make_index_sequence<4>()); break;
+        case 5: callBatchWithInputs(*Addr, Inputs, Out, N, std::make_index_sequence<5>()); break;
+        case 6: callBatchWithInputs(*Addr, Inputs, Out, N, std::make_index_sequence<6>()); break;
+        case 7: callBatchWithInputs(*Addr, Inputs, Out, N, std::make_index_sequence<7>()); break;
+        case 8: callBatchWithInputs(*Addr, Inputs, Out, N, std::make_index_sequence<8>()); break;
+        default:
+            return createStringError(inconvertibleErrorCode(), "can't call '%s_batch' with %zu inputs",
+                                     Name.str().c_str(), Inputs.size());
+    }
+    return Error::success();
+}
+
+Expected<PreparedExpression*> Engine::prepare(StringRef Source, ArrayRef<std::string> Params) {
+    std::lock_guard<std::mutex> Lock(CompileMutex);
+    return Exprs->prepare(Source, Params);
+}
+
+void Engine::release(PreparedExpression* E) {
+    Exprs->release(E);
+}
+
+Error Engine::runREPL(Lexer &Lex) {
+    std::lock_guard<std::mutex> Lock(CompileMutex);
+
+    Parser P(Lex);
+    Protos.installOperators(P);
+    auto S = createSession(0);
+
+    // Prime the first token.
+    fprintf(stderr, "ready> ");
+    P.getNextToken();
+
+    // Run the main "interpreter loop" now.
+    PreparedExpressions REPLExprs(*JIT, *Pipelines[0], Protos, FPFlags, &HostArrays);
+    REPLExprs.setPhaseStats(S->Stats);
+    Error Err = MainLoop(*S, P, REPLExprs);
+    Exprs->invalidate();
+    return Err;
+}
+
+Error Engine::runBatch(Lexer &Lex, raw_ostream &Results) {
+    std::lock_guard<std::mutex> Lock(CompileMutex);
+
+    Parser P(Lex);
+    Protos.installOperators(P);
+    auto S = createSession(0);
+    S->Echo = Opts.PrintIR;
+    S->Prompt = false;
+    S->Results = &Results;
+
+    PreparedExpressions BatchExprs(*JIT, *Pipelines[0], Protos, FPFlags, &HostArrays);
+    BatchExprs.setPhaseStats(S->Stats);
+    P.getNextToken();
+    Error Err = MainLoop(*S, P, BatchExprs);
+    Exprs->invalidate();
+    if (Err)
+        return Err;
+
+    if (S->NumErrors)
+        return createStringError(inconvertibleErrorCode(), "%u error(s) in source", S->NumErrors);
+    return Error::success();
+}
+
+bool Engine::runFiles(ArrayRef<std::string> Filenames) {
+    std::atomic<size_t> NextFile{0};
+    std::atomic<bool> Failed{false};
+
+    auto Worker = [&](unsigned W) {
+        // One session per thread, reset for each file it picks up
+        auto S = createSession(W);
+        PreparedExpressions WorkerExprs(*JIT, *Pipelines[W], Protos, FPFlags, &HostArrays);
+        WorkerExprs.setPhaseStats(S->Stats);
+
+        for (size_t I; (I = NextFile++) < Filenames.size();) {
+            auto Lex = Lexer::open(Filenames[I]);
+            if (!Lex) {
+                logAllUnhandledErrors(Lex.takeError(), errs(), "Error: ");
+                Failed = true;
+                continue;
+            }
+
+            Parser P(**Lex);
+            Protos.installOperators(P);
+            S->reset();
+            P.getNextToken();
+            if (auto Err = MainLoop(*S, P, WorkerExprs)) {
+                logAllUnhandledErrors(std::move(Err), errs(), "Error: ");
+                Failed = true;
+            }
+        }
+    };
+
+    // The first pipeline is shared with compile() and prepare()
+    std::lock_guard<std::mutex> Lock(CompileMutex);
+    std::vector<std::thread> Threads;
+    for (unsigned W = 1; W != Pipelines.size(); ++W)
+        Threads.emplace_back(Worker, W);
+    Worker(0);
+    for (auto &T : Threads)
+        T.join();
+
+    Exprs->invalidate();
+    return !Failed;
+}
+
+PassTimings Engine::getPassTimings() const {
+    PassTimings Timings;
+    for (auto &Pipeline : Pipelines)
+        if (auto *PipelineTimings = Pipeline->getTimings())
+            Timings.add(*PipelineTimings);
+    return Timings;
+}
+
+PhaseStats Engine::getPhaseStats() const {
+    PhaseStats Stats;
+    for (auto &WorkerStats : Phases)
+        Stats.add(*WorkerStats);
+    return Stats;
+}
+
+Error Engine::writeProfile(StringRef Filename) const {
+    if (!Profile || !Profile->isInstrumenting())
+        return createStringError(inconvertibleErrorCode(), "the engine wasn't created with ProfileInstrument");
+    return Profile->write(Filename);
+}
@@ -0,0 +1,198 @@
+#include "../headers/Incremental.h"
+#include "llvm/Support/xxhash.h"
+
+// Add the functions E calls (user operators included) to Callees.
+static void collectCallees(const ExprAST* E, std::vector<SymbolID> &Callees) {
+    if (!E)
+        return;
+
+    SymbolTable &Symbols = SymbolTable::get();
+    switch (E->getKind()) {
+        case ExprAST::EK_Number:
+        case ExprAST::EK_Variable:
+            return;
+        case ExprAST::EK_Index:
+            return collectCallees(cast<IndexExprAST>(E)->getIndex(), Callees);
+        case ExprAST::EK_Binary: {
+            auto* B = cast<BinaryExprAST>(E);
+            // A builtin operator has no definition, so depending on it changes nothing
+            Callees.push_back(Symbols.intern(std::string("binary") + B->getOp()));
+            collectCallees(B->getLHS(), Callees);
+            return collectCallees(B->getRHS(), Callees);
+        }
+        case ExprAST::EK_Unary: {
+            auto* U = cast<UnaryExprAST>(E);
+            Callees.push_back(Symbols.intern(std::string("unary") + U->getOpcode()));
+            return collectCallees(U->getOperand(), Callees);
+        }
+        case ExprAST::EK_Call: {
+            auto* C = cast<CallExprAST>(E);
+            Callees.push_back(C->getCallee());
+            for (ExprAST* Arg : C->getArgs())
+                collectCallees(Arg, Callees);
+            return;
+        }
+        case ExprAST::EK_If: {
+            auto* I = cast<IfExprAST>(E);
+            collectCallees(I->getCond(), Callees);
+            collectCallees(I->getThen(), Callees);
+            return collectCallees(I->getElse(), Callees);
+        }
+        case ExprAST::EK_For: {
+            auto* F = cast<ForExprAST>(E);
+            collectCallees(F->getStart(), Callees);
+            collectCallees(F->getEnd(), Callees);
+            collectCallees(F->getStep(), Callees);
+            return collectCallees(F->getBody(), Callees);
+        }
+        case ExprAST::EK_Var: {
+            auto* V = cast<VarExprAST>(E);
+            for (auto &Var : V->getVars())
+                collectCallees(Var.Init, Callees);
+            return collectCallees(V->getBody(), Callees);
+        }
+    }
+    llvm_unreachable("unknown expression kind");
+}
+
+DefinitionGraph::Definition DefinitionGraph::describe(const FunctionAST &FnAST) {
+    // Everything of the prototype that its callers are compiled against, then the body
+    const PrototypeAST &Proto = FnAST.getProto();
+    std::string Printed;
+    raw_string_ostream OS(Printed);
+    OS << Proto.getName() << ':' << getTypeName(Proto.getReturnType()) << ':' << Proto.getBinaryPrecedence();
+    for (auto [Arg, Ty] : zip(Proto.getArgs(), Proto.getArgTypes()))
+        OS << ' ' << Arg << ':' << getTypeName(Ty);
+    OS << ' ';
+    FnAST.getBody()->print(OS);
+    OS.flush();
+
+    Definition D;
+    D.Hash = xxHash64(Printed);
+    collectCallees(FnAST.getBody(), D.Callees);
+    llvm::sort(D.Callees);
+    D.Callees.erase(std::unique(D.Callees.begin(), D.Callees.end()), D.Callees.end());
+    return D;
+}
+
+DenseSet<SymbolID> DefinitionGraph::update(DenseMap<SymbolID, Definition> New) {
+    DenseMap<SymbolID, std::vector<SymbolID>> Callers;
+    SmallVector<SymbolID, 16> Worklist;
+    for (auto &KV : New) {
+        for (SymbolID Callee : KV.second.Callees)
+            if (Callee != KV.first)
+                Callers[Callee].push_back(KV.first);
+
+        auto Old = Definitions.find(KV.first);
+        if (Old == Definitions.end() || Old->second.Hash != KV.second.Hash)
+            Worklist.push_back(KV.first);
+    }
+
+    DenseSet<SymbolID> Recompile(Worklist.begin(), Worklist.end());
+    while (!Worklist.empty()) {
+        SymbolID Name = Worklist.pop_back_val();
+        auto I = Callers.find(Name);
+        if (I == Callers.end())
+            continue;
+        for (SymbolID Caller : I->second)
+            if (Recompile.insert(Caller).second)
+                Worklist.push_back(Caller);
+    }
+
+    Definitions = std::move(New);
+    return Recompile;
+}
+
+Expected<ReloadStats> ReloadSource(CodegenSession &S, Parser &P, PreparedExpressions &Exprs, DefinitionGraph &G) {
+    // Parse the whole source first, as what to recompile depends on all of
+    // it. Its expression nodes stay in P's arena until the end.
+    struct Item {
+        std::unique_ptr<FunctionAST> Definition; // or
+        std::unique_ptr<PrototypeAST> Extern;    // or
+        std::unique_ptr<FunctionAST> Expression;
+    };
+    std::vector<Item> Items;
+    DenseMap<SymbolID, DefinitionGraph::Definition> Definitions;
+    DenseSet<SymbolID> Redefined;
+
+    while (P.getCurTok() != TOK_EOF) {
+        Item I;
+        switch (P.getCurTok()) {
+            case ';':
+                P.getNextToken();
+                continue;
+            case TOK_DEF:
+                I.Definition = timePhase(S.Stats, Phase::Parse, [&] { return P.ParseDefinition(); });
+                if (I.Definition) {
+                    // Later items may use the operator it defines
+                    const PrototypeAST &Proto = I.Definition->getProto();
+                    if (Proto.isBinaryOp())
+                        P.setBinopPrecedence(Proto.getOperatorName(), Proto.getBinaryPrecedence());
+
+                    auto Inserted = Definitions.try_emplace(Proto.getNameID(), DefinitionGraph::describe(*I.Definition));
+                    if (!Inserted.second)
+                        Redefined.insert(Proto.getNameID());
+                }
+                break;
+            case TOK_EXTERN:
+                I.Extern = timePhase(S.Stats, Phase::Parse, [&] { return P.ParseExtern(); });
+                break;
+            default:
+                I.Expression = timePhase(S.Stats, Phase::Parse, [&] { return P.ParseTopLevelExpr(); });
+                break;
+        }
+
+        if (!I.Definition && !I.Extern && !I.Expression) {
+            // Skip token for error recovery
+            ++S.NumErrors;
+            P.getNextToken();
+            continue;
+        }
+        Items.push_back(std::move(I));
+    }
+
+    ReloadStats Stats;
+    Stats.Definitions = Definitions.size();
+    DenseSet<SymbolID> Recompile = G.update(std::move(Definitions));
+    for (SymbolID Name : Redefined)
+        Recompile.insert(Name);
+    Stats.Recompiled = Recompile.size();
+
+    // The cached expressions may call what a recompiled definition replaces,
+    // so the cache is dropped before the next expression runs
+    bool Redefining = false;
+    for (auto &I : Items) {
+        if (I.Definition) {
+            SymbolID Name = I.Definition->getProto().getNameID();
+            if (!Recompile.count(Name))
+                continue;
+            unsigned ErrorsBefore = S.NumErrors;
+            if (auto Err = CompileDefinition(S, P, std::move(I.Definition)))
+                return std::move(Err);
+            if (S.NumErrors != ErrorsBefore)
+                G.forget(Name);
+            Redefining = true;
+        } else if (I.Extern) {
+            if (auto Err = CompileExtern(S, std::move(I.Extern)))
+                return std::move(Err);
+        } else {
+            if (Redefining) {
+                PhaseTimer T(S.Stats, Phase::Remove);
+                Exprs.invalidate();
+                Redefining = false;
+            }
+            if (auto Err = RunTopLevelExpression(S, *I.Expression, Exprs))
+                return std::move(Err);
+        }
+    }
+
+    if (auto Err = FlushDefinitions(S))
+        return std::move(Err);
+    if (Redefining)
+        Exprs.invalidate();
+    P.clearAST();
+    // The whole reload is one item
+    if (S.Stats)
+        S.Stats->endItem();
+    return Stats;
+}
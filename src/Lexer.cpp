@@ -1,71 +1,129 @@
 #include "../headers/Lexer.h"
+#include "llvm/ADT/StringSwitch.h"
+#include "llvm/Support/FileSystem.h"
 
-int gettok() {
-    static int lastChar = ' ';
-    
-    // skip whitespaces
-    while (isspace(lastChar)) {
-        lastChar = getchar();
-    }
-    
-    // [a-zA-Z][a-zA-Z0-9]*
-    if (isalpha(lastChar)) {
-        IdentifierStr = lastChar;
-
-        while (isalnum(lastChar = getchar()))
-            IdentifierStr += lastChar;
-        
-        if (IdentifierStr == "def")
-            return TOK_DEF;
-        if (IdentifierStr == "extern")
-            return TOK_EXTERN;
-        if (IdentifierStr == "if")
-            return TOK_IF;
-        if (IdentifierStr == "then")
-            return TOK_THEN;
-        if (IdentifierStr == "else")
-            return TOK_ELSE;
-        if (IdentifierStr == "for")
-            return TOK_FOR;
-        if (IdentifierStr == "in")
-            return TOK_IN;
-        if (IdentifierStr == "binary")
-            return TOK_BINARY;
-        if (IdentifierStr == "unary")
-            return TOK_UNARY;
-
-        return TOK_IDENTIFIER;
-    }
-    
-    // Number: [0-9.]+
-    if (isdigit(lastChar) || lastChar == '.') {
-        std::string numStr = "";
-        
-        do {
-            numStr += lastChar;
-            lastChar = getchar();
-        } while (isdigit(lastChar) || lastChar == '.');
-
-        NumVal = strtod(numStr.c_str(), nullptr); // string to numeric value
-        return TOK_NUMBER;
-    }
-    
-    // ignore comments
-    if (lastChar == '#') {
-        do 
-            lastChar = getchar();
-        while (lastChar != EOF && lastChar != '\n' && lastChar != '\r');
-
-        if (lastChar != EOF)
-            return gettok();
+#include <charconv>
+
+static const size_t StdinChunkSize = 64 * 1024;
+
+Lexer::Lexer() : ReadingStdin(true) {}
+
+Lexer::Lexer(std::unique_ptr<MemoryBuffer> Buffer)
+    : InputFile(std::move(Buffer)), ReadingStdin(false) {
+    TokStart = CurPtr = InputFile->getBufferStart();
+    BufEnd = InputFile->getBufferEnd();
+}
+
+Expected<std::unique_ptr<Lexer>> Lexer::open(StringRef Filename) {
+    if (Filename == "-")
+        return std::make_unique<Lexer>();
+
+    auto File = MemoryBuffer::getFile(Filename, /*IsText*/ false, /*RequiresNullTerminator*/ false);
+    if (!File)
+        return createFileError(Filename, File.getError());
+    return std::make_unique<Lexer>(std::move(*File));
+}
+
+// refill - Read the next chunk of stdin. Returns false at end of input.
+bool Lexer::refill() {
+    if (!ReadingStdin)
+        return false;
+
+    size_t Keep = TokStart ? BufEnd - TokStart : 0;
+    if (Keep)
+        memmove(StdinBuffer.data(), TokStart, Keep);
+    StdinBuffer.resize(Keep + StdinChunkSize);
+
+    // Unlike fread, this returns as soon as some input is available (e.g. a line
+    // typed at the prompt) instead of waiting for the whole chunk.
+    Expected<size_t> Read = sys::fs::readNativeFile(
+        sys::fs::getStdinHandle(), MutableArrayRef<char>(StdinBuffer.data() + Keep, StdinChunkSize));
+    size_t N = 0;
+    if (Read)
+        N = *Read;
+    else
+        consumeError(Read.takeError());
+    StdinBuffer.resize(Keep + N);
+
+    TokStart = StdinBuffer.data();
+    CurPtr = TokStart + Keep;
+    BufEnd = CurPtr + N;
+    return N != 0;
+}
+
+// peekChar - The next character of input (without consuming it), or EOF.
+int Lexer::peekChar() {
+    if (CurPtr == BufEnd && !refill())
+        return EOF;
+    return (unsigned char)*CurPtr;
+}
+
+int Lexer::gettok() {
+    while (true) {
+        // skip whitespaces
+        TokStart = nullptr;
+        while (isspace(peekChar()))
+            ++CurPtr;
+
+        TokStart = CurPtr;
+        int thisChar = peekChar();
+
+        // [a-zA-Z][a-zA-Z0-9]*
+        if (isalpha(thisChar)) {
+            do
+                ++CurPtr;
+            while (isalnum(peekChar()));
+
+            IdentifierStr = StringRef(TokStart, CurPtr - TokStart);
+            return StringSwitch<int>(IdentifierStr)
+                .Case("def", TOK_DEF)
+                .Case("extern", TOK_EXTERN)
+                .Case("if", TOK_IF)
+                .Case("then", TOK_THEN)
+                .Case("else", TOK_ELSE)
+                .Case("for", TOK_FOR)
+                .Case("in", TOK_IN)
+                .Case("var", TOK_VAR)
+                .Case("binary", TOK_BINARY)
+                .Case("unary", TOK_UNARY)
+                .Cases("double", "f32", "i64", "bool", TOK_TYPE)
+                .Default(TOK_IDENTIFIER);
+        }
+
+        // Number: [0-9.]+
+        if (isdigit(thisChar) || thisChar == '.') {
+            int C;
+            do {
+                ++CurPtr;
+                C = peekChar();
+            } while (isdigit(C) || C == '.');
+
+            // Parse straight out of the buffer. Like strtod, this stops at a
+            // second '.', and a lone "." is 0.
+            if (std::from_chars(TokStart, CurPtr, NumVal).ec != std::errc())
+                NumVal = 0.0;
+            return TOK_NUMBER;
+        }
+
+        // ignore comments
+        if (thisChar == '#') {
+            int C;
+            do {
+                ++CurPtr;
+                C = peekChar();
+            } while (C != EOF && C != '\n' && C != '\r');
+
+            if (C != EOF)
+                continue;
+            thisChar = EOF;
+        }
+
+        // check for end of file
+        if (thisChar == EOF)
+            return TOK_EOF;
+
+        // if it doesnt match any of the above we return the default ascii value
+        ++CurPtr;
+        return thisChar;
     }
-    
-    // check for end of file
-    if (lastChar == EOF)
-        return TOK_EOF;
-   
-    // if it doesnt match any of the above we return the default ascii value
-    int thisChar = lastChar;
-    lastChar = getchar();
-    return thisChar;
 }
@@ -1,19 +1,27 @@
 #include "../headers/Parser.h"
+#include "llvm/ADT/StringSwitch.h"
+
+Parser::Parser(Lexer &Lex) : Lex(Lex) {
+    BinopPrecedence.fill(-1);
+    BinopPrecedence['='] = 2;
+    BinopPrecedence['<'] = 10;
+    BinopPrecedence['>'] = 10;
+    BinopPrecedence['+'] = 20;
+    BinopPrecedence['-'] = 20;
+    BinopPrecedence['*'] = 40;
+    BinopPrecedence['/'] = 40;
+}
 
 // GetTokPrecedence - Get the precedence of the pending binary operator token.
-static int GetTokPrecedence() {
-    if (!isascii(CurTok))
-        return -1;
-
-    // Make sure it's a declared binop.
-    int TokPrec = BinopPrecedence[CurTok];
-    if (TokPrec <= 0)
+int Parser::GetTokPrecedence() {
+    // Tokens other than characters (negative) aren't operators
+    if ((unsigned)CurTok >= BinopPrecedence.size())
         return -1;
-    return TokPrec;
+    return BinopPrecedence[CurTok];
 }
 
 // LogError* - These are little helper functions for error handling
-std::unique_ptr<ExprAST> LogError(const char *Str) {
+ExprAST* LogError(const char *Str) {
     fprintf(stderr, "Error: %s\n", Str);
     return nullptr;
 }
@@ -23,25 +31,22 @@ std::unique_ptr<PrototypeAST> LogErrorP(const char *Str) {
     return nullptr;
 }
 
-static std::unique_ptr<ExprAST> ParseExpression();
-static std::unique_ptr<ExprAST> ParseIfExpr();
-static std::unique_ptr<ExprAST> ParseForExpr();
 /*
 
     Production Rule:
     NumberExpr -> number literal
 */
-static std::unique_ptr<ExprAST> ParseNumberExpr() {
-    auto Result = std::make_unique<NumberExprAST>(NumVal);
+ExprAST* Parser::ParseNumberExpr() {
+    auto Result = AST.create<NumberExprAST>(Lex.getNumVal());
     getNextToken(); // consume the number
-    return std::move(Result);
+    return Result;
 }
 
 /*
     Production Rule:
     ParenExpr -> '(' expression ')'
 */
-static std::unique_ptr<ExprAST> ParseParenExpr() {
+ExprAST* Parser::ParseParenExpr() {
     getNextToken(); // eat (.
     auto V = ParseExpression();
     if (!V)
@@ -55,23 +60,35 @@ static std::unique_ptr<ExprAST> ParseParenExpr() {
 
 /*
     Production Rule:
-    Identifier -> '(' expression* ')'
+    Identifier -> identifier | identifier '[' expression ']' | identifier '(' expression* ')'
 */
-static std::unique_ptr<ExprAST> ParseIdentifierExpr() {
-    std::string IdName = IdentifierStr;
+ExprAST* Parser::ParseIdentifierExpr() {
+    SymbolID IdName = AST.intern(Lex.getIdentifier());
 
     getNextToken(); // eat identifier.
 
+    // Array element.
+    if (CurTok == '[') {
+        getNextToken(); // eat [
+        auto Index = ParseExpression();
+        if (!Index)
+            return nullptr;
+        if (CurTok != ']')
+            return LogError("expected ']'");
+        getNextToken(); // eat ]
+        return AST.create<IndexExprAST>(IdName, Index);
+    }
+
     if (CurTok != '(') // Simple variable ref.
-        return std::make_unique<VariableExprAST>(IdName);
+        return AST.create<VariableExprAST>(IdName);
 
     // Call.
     getNextToken(); // eat (
-    std::vector<std::unique_ptr<ExprAST>> Args;
+    SmallVector<ExprAST*, 8> Args;
     if (CurTok != ')') {
         while (true) {
             if (auto Arg = ParseExpression())
-                Args.push_back(std::move(Arg));
+                Args.push_back(Arg);
             else
                 return nullptr;
 
@@ -86,14 +103,14 @@ static std::unique_ptr<ExprAST> ParseIdentifierExpr() {
     // Eat the ')'.
     getNextToken();
 
-    return std::make_unique<CallExprAST>(IdName, std::move(Args));
+    return AST.create<CallExprAST>(IdName, AST.copy(ArrayRef<ExprAST*>(Args)));
 }
 
 /*
     Production Rule:
     Primary -> IdentifierExpr | NumberExpr | ParenExpr
 */
-static std::unique_ptr<ExprAST> ParsePrimary() {
+ExprAST* Parser::ParsePrimary() {
     switch (CurTok) {
     default:
         return LogError("unknown token when expecting an expression");
@@ -107,6 +124,8 @@ static std::unique_ptr<ExprAST> ParsePrimary() {
         return ParseIfExpr();
     case TOK_FOR:
         return ParseForExpr(); 
+    case TOK_VAR:
+        return ParseVarExpr();
     }
 }
 
@@ -115,7 +134,7 @@ static std::unique_ptr<ExprAST> ParsePrimary() {
 
     Unary -> PrimaryExpr | '!' Unary
 */
-static std::unique_ptr<ExprAST> ParseUnary() {
+ExprAST* Parser::ParseUnary() {
     // if the current token isnt an operator it must be a primay expr
     if (!isascii(CurTok) || CurTok == '(' || CurTok == ',')
         return ParsePrimary();
@@ -124,7 +143,7 @@ static std::unique_ptr<ExprAST> ParseUnary() {
     int Opc = CurTok;
     getNextToken();
     if (auto Operand = ParseUnary())
-        return std::make_unique<UnaryExprAST>(Opc, std::move(Operand));
+        return AST.create<UnaryExprAST>(Opc, Operand);
     return nullptr;
 }
 
@@ -132,7 +151,7 @@ static std::unique_ptr<ExprAST> ParseUnary() {
     Production Rule:
     BinOpRHS -> ('+' primary)*
 */
-static std::unique_ptr<ExprAST> ParseBinOpRHS(int ExprPrec, std::unique_ptr<ExprAST> LHS) {
+ExprAST* Parser::ParseBinOpRHS(int ExprPrec, ExprAST* LHS) {
     // If this is a binop, find its precedence.
     while (true) {
         int TokPrec = GetTokPrecedence();
@@ -153,12 +172,12 @@ static std::unique_ptr<ExprAST> ParseBinOpRHS(int ExprPrec, std::unique_ptr<Expr
     // the pending operator take RHS as its LHS.
     int NextPrec = GetTokPrecedence();
     if (TokPrec < NextPrec) {
-        RHS = ParseBinOpRHS(TokPrec + 1, std::move(RHS));
+        RHS = ParseBinOpRHS(TokPrec + 1, RHS);
         if (!RHS) return nullptr;
     }
 
     // Merge LHS/RHS.
-    LHS = std::make_unique<BinaryExprAST>(BinOp, std::move(LHS), std::move(RHS));
+    LHS = AST.create<BinaryExprAST>(BinOp, LHS, RHS);
   }
 }
 
@@ -166,17 +185,59 @@ static std::unique_ptr<ExprAST> ParseBinOpRHS(int ExprPrec, std::unique_ptr<Expr
     Production Rule:
     Expression -> primary binoprhs
 */
-static std::unique_ptr<ExprAST> ParseExpression() {
+ExprAST* Parser::ParseExpression() {
     auto LHS = ParseUnary();
     if (!LHS) return nullptr;
-    return ParseBinOpRHS(0, std::move(LHS));
+    return ParseBinOpRHS(0, LHS);
 }
 
 /*
     Production Rule:
-    Prototype ->  id '(' id* ')' | binary LETTER number? (id, id)
+    Type -> ('double' | 'f32' | 'i64' | 'bool') '*'?
+
+    Only double and f32 arrays ('*') are supported.
 */
-static std::unique_ptr<PrototypeAST> ParsePrototype() {
+bool Parser::ParseType(ValueType &Ty) {
+    if (CurTok != TOK_TYPE) {
+        LogError("expected a type (double, f32, i64 or bool)");
+        return false;
+    }
+    Ty = StringSwitch<ValueType>(Lex.getIdentifier())
+        .Case("f32", ValueType::F32)
+        .Case("i64", ValueType::I64)
+        .Case("bool", ValueType::Bool)
+        .Default(ValueType::Double);
+    getNextToken(); // eat the type name.
+
+    if (CurTok == '*') {
+        if (Ty != ValueType::Double && Ty != ValueType::F32) {
+            LogError("only arrays of double or f32 are supported");
+            return false;
+        }
+        Ty = Ty == ValueType::F32 ? ValueType::F32Array : ValueType::DoubleArray;
+        getNextToken(); // eat '*'
+    }
+    return true;
+}
+
+/*
+    Production Rule:
+    TypeAnnotation -> (':' Type)?
+
+    Ty is left alone (the default type) if there's no annotation.
+*/
+bool Parser::ParseTypeAnnotation(ValueType &Ty) {
+    if (CurTok != ':')
+        return true;
+    getNextToken(); // eat ':'
+    return ParseType(Ty);
+}
+
+/*
+    Production Rule:
+    Prototype ->  (id '(' (id TypeAnnotation)* ')' | binary LETTER number? (id, id)) TypeAnnotation
+*/
+std::unique_ptr<PrototypeAST> Parser::ParsePrototype() {
     std::string FnName;
 
     unsigned Kind = 0; // 0 = Identifier, 1 = Unary, 2 = Binary
@@ -186,7 +247,7 @@ static std::unique_ptr<PrototypeAST> ParsePrototype() {
         default:
             return LogErrorP("Expected function name in prototye\n");
         case TOK_IDENTIFIER:
-            FnName = IdentifierStr;
+            FnName = Lex.getIdentifier().str();
             Kind = 0;
             getNextToken();
             break;
@@ -210,9 +271,9 @@ static std::unique_ptr<PrototypeAST> ParsePrototype() {
 
             // Read the precedence if present
             if (CurTok == TOK_NUMBER) {
-                if (NumVal < 1 || NumVal > 100)
+                if (Lex.getNumVal() < 1 || Lex.getNumVal() > 100)
                     return LogErrorP("Invalid precedence: must be 1..100\n");
-                BinaryPrecedence = (unsigned)NumVal;
+                BinaryPrecedence = (unsigned)Lex.getNumVal();
                 getNextToken();
             }
             break;
@@ -222,8 +283,16 @@ static std::unique_ptr<PrototypeAST> ParsePrototype() {
         return LogErrorP("Expected '(' in prototype\n");
     
     std::vector<std::string> ArgNames;
-    while (getNextToken() == TOK_IDENTIFIER)
-        ArgNames.push_back(IdentifierStr);
+    std::vector<ValueType> ArgTypes;
+    getNextToken(); // eat '('
+    while (CurTok == TOK_IDENTIFIER) {
+        ArgNames.push_back(Lex.getIdentifier().str());
+        getNextToken(); // eat identifier.
+
+        ArgTypes.push_back(ValueType::Double);
+        if (!ParseTypeAnnotation(ArgTypes.back()))
+            return nullptr;
+    }
     if (CurTok != ')')
         return LogErrorP("Expected ')' in prototype\n");
 
@@ -234,7 +303,12 @@ static std::unique_ptr<PrototypeAST> ParsePrototype() {
     if (Kind && ArgNames.size() != Kind)
         return LogErrorP("Invalid number of operands for operator\n");
 
-    return std::make_unique<PrototypeAST>(FnName, std::move(ArgNames), Kind != 0, BinaryPrecedence);
+    ValueType ReturnType = ValueType::Double;
+    if (!ParseTypeAnnotation(ReturnType))
+        return nullptr;
+
+    return std::make_unique<PrototypeAST>(FnName, std::move(ArgNames), Kind != 0, BinaryPrecedence,
+                                          std::move(ArgTypes), ReturnType);
 }
 
 /*
@@ -243,23 +317,23 @@ static std::unique_ptr<PrototypeAST> ParsePrototype() {
 
     Note: 'def' is a keyword
 */
-static std::unique_ptr<FunctionAST> ParseDefinition() {
+std::unique_ptr<FunctionAST> Parser::ParseDefinition() {
     getNextToken(); // eat def.
     auto Proto = ParsePrototype();
     if (!Proto)
         return nullptr;
 
     if (auto E = ParseExpression())
-        return std::make_unique<FunctionAST>(std::move(Proto), std::move(E));
+        return std::make_unique<FunctionAST>(std::move(Proto), E);
     return nullptr;
 }
 
 // toplevelexpr ::= expression
-static std::unique_ptr<FunctionAST> ParseTopLevelExpr() {
+std::unique_ptr<FunctionAST> Parser::ParseTopLevelExpr() {
     if (auto E = ParseExpression()) {
         // Make an anonymous proto
         auto Proto = std::make_unique<PrototypeAST>("__anon_expr", std::vector<std::string>());
-        return std::make_unique<FunctionAST>(std::move(Proto), std::move(E));
+        return std::make_unique<FunctionAST>(std::move(Proto), E);
     }
     return nullptr;
 }
@@ -270,7 +344,7 @@ static std::unique_ptr<FunctionAST> ParseTopLevelExpr() {
 
     Note: 'extern' is a keyword
 */
-static std::unique_ptr<PrototypeAST> ParseExtern() {
+std::unique_ptr<PrototypeAST> Parser::ParseExtern() {
     getNextToken(); // eat extern.
     return ParsePrototype();
 }
@@ -280,7 +354,7 @@ static std::unique_ptr<PrototypeAST> ParseExtern() {
 
     IfExpression -> 'if' expression 'then' expression 'else' expression
 */
-static std::unique_ptr<ExprAST> ParseIfExpr() {
+ExprAST* Parser::ParseIfExpr() {
     getNextToken(); // eat if
 
     auto Cond = ParseExpression(); // parse expression
@@ -304,21 +378,27 @@ static std::unique_ptr<ExprAST> ParseIfExpr() {
     if (!Else)
         return nullptr;
 
-    return std::make_unique<IfExprAST>(std::move(Cond), std::move(Then), std::move(Else));
+    return AST.create<IfExprAST>(Cond, Then, Else);
 }
 
 /*
     Production Rule:
-    ForExpr -> 'for' identifier '=' expr ',' (',' expr)? 'in' expression
+    ForExpr -> 'for' identifier TypeAnnotation '=' expr ',' (',' expr)? 'in' expression
 */
-static std::unique_ptr<ExprAST> ParseForExpr() {
+ExprAST* Parser::ParseForExpr() {
     getNextToken();
     
     if (CurTok != TOK_IDENTIFIER)
         return LogError("expected identifier after for\n");
-    std::string idName = IdentifierStr;
+    SymbolID idName = AST.intern(Lex.getIdentifier());
     getNextToken();
 
+    ValueType VarType = ValueType::Double;
+    if (!ParseTypeAnnotation(VarType))
+        return nullptr;
+    if (isArrayType(VarType))
+        return LogError("a for loop variable can't be an array");
+
     if (CurTok != '=')
         return LogError("Expected '=' after for\n");
     getNextToken();
@@ -333,7 +413,7 @@ static std::unique_ptr<ExprAST> ParseForExpr() {
     if (!End) return nullptr;
 
     // Step value is optional
-    std::unique_ptr<ExprAST> Step;
+    ExprAST* Step = nullptr;
     if (CurTok == ',') {
         getNextToken();
         Step = ParseExpression();
@@ -346,5 +426,55 @@ static std::unique_ptr<ExprAST> ParseForExpr() {
 
     auto Body = ParseExpression();
     if (!Body) return nullptr;
-    return std::make_unique<ForExprAST>(idName, std::move(Start), std::move(End), std::move(Step), std::move(Body));
-}
\ No newline at end of file
+    return AST.create<ForExprAST>(idName, VarType, Start, End, Step, Body);
+}
+
+/*
+    Production Rule:
+    VarExpr -> 'var' identifier TypeAnnotation ('=' expression)? (',' identifier TypeAnnotation ('=' expression)?)*
+               'in' expression
+*/
+ExprAST* Parser::ParseVarExpr() {
+    getNextToken(); // eat the var.
+
+    SmallVector<VarExprAST::Binding, 4> Vars;
+
+    // At least one variable name is required.
+    if (CurTok != TOK_IDENTIFIER)
+        return LogError("expected identifier after var");
+
+    while (true) {
+        SymbolID Name = AST.intern(Lex.getIdentifier());
+        getNextToken(); // eat identifier.
+
+        ValueType Type = ValueType::Double;
+        if (!ParseTypeAnnotation(Type))
+            return nullptr;
+
+        // Read the optional initializer.
+        ExprAST* Init = nullptr;
+        if (CurTok == '=') {
+            getNextToken(); // eat the '='.
+            Init = ParseExpression();
+            if (!Init) return nullptr;
+        }
+        Vars.push_back({Name, Type, Init});
+
+        // End of var list, exit loop.
+        if (CurTok != ',')
+            break;
+        getNextToken(); // eat the ','.
+
+        if (CurTok != TOK_IDENTIFIER)
+            return LogError("expected identifier list after var");
+    }
+
+    // At this point, we have to have 'in'.
+    if (CurTok != TOK_IN)
+        return LogError("expected 'in' keyword after 'var'");
+    getNextToken(); // eat 'in'.
+
+    auto Body = ParseExpression();
+    if (!Body) return nullptr;
+    return AST.create<VarExprAST>(AST.copy(ArrayRef<VarExprAST::Binding>(Vars)), Body);
+}
@@ -0,0 +1,119 @@
+#include "../headers/PhaseStats.h"
+#include "llvm/Support/Format.h"
+
+#include <cmath>
+
+StringRef getPhaseName(Phase P) {
+    switch (P) {
+        case Phase::Parse: return "parse";
+        case Phase::IRGen: return "irgen";
+        case Phase::Optimize: return "optimize";
+        case Phase::Materialize: return "materialize";
+        case Phase::Lookup: return "lookup";
+        case Phase::Execute: return "execute";
+        case Phase::Remove: return "remove";
+    }
+    llvm_unreachable("unknown phase");
+}
+
+// charge - Give the time since the last charge to the innermost running phase
+void PhaseStats::charge(Clock::time_point Now) {
+    if (!Running.empty())
+        ItemTime[(unsigned)Running.back()] += Now - Since;
+    Since = Now;
+}
+
+void PhaseStats::start(Phase P) {
+    charge(Clock::now());
+    Running.push_back(P);
+    ItemEntered[(unsigned)P] = true;
+}
+
+void PhaseStats::stop() {
+    assert(!Running.empty() && "phase stopped without starting");
+    charge(Clock::now());
+    Running.pop_back();
+}
+
+void PhaseStats::endItem() {
+    assert(Running.empty() && "item ended in the middle of a phase");
+    bool Entered = false;
+    for (unsigned I = 0; I != NumPhases; ++I) {
+        if (!ItemEntered[I])
+            continue;
+        Samples[I].push_back(std::chrono::duration_cast<std::chrono::nanoseconds>(ItemTime[I]).count());
+        ItemTime[I] = Clock::duration(0);
+        ItemEntered[I] = false;
+        Entered = true;
+    }
+    // Items that never entered a phase (like a lone ';') aren't counted
+    if (Entered)
+        ++Items;
+}
+
+void PhaseStats::add(const PhaseStats &Other) {
+    for (unsigned I = 0; I != NumPhases; ++I)
+        Samples[I].insert(Samples[I].end(), Other.Samples[I].begin(), Other.Samples[I].end());
+    Items += Other.Items;
+    Modules += Other.Modules;
+}
+
+// The nearest-rank percentile P of the sorted samples
+static uint64_t percentile(ArrayRef<uint64_t> Sorted, double P) {
+    size_t Rank = (size_t)std::ceil(P * Sorted.size());
+    return Sorted[std::max<size_t>(Rank, 1) - 1];
+}
+
+static double toMicros(uint64_t NS) {
+    return NS / 1000.0;
+}
+
+/*
+    The histogram has a bucket for each power of two of microseconds: [0, 1us),
+    [1us, 2us), [2us, 4us) and so on, with only the buckets between the first
+    and last non-empty ones printed.
+*/
+static void printHistogram(raw_ostream &OS, ArrayRef<uint64_t> Sorted) {
+    SmallVector<unsigned, 32> Buckets;
+    for (uint64_t NS : Sorted) {
+        uint64_t US = NS / 1000;
+        unsigned B = US ? Log2_64(US) + 1 : 0;
+        if (B >= Buckets.size())
+            Buckets.resize(B + 1);
+        ++Buckets[B];
+    }
+
+    unsigned First = 0;
+    while (!Buckets[First])
+        ++First;
+    unsigned Largest = *std::max_element(Buckets.begin(), Buckets.end());
+    for (unsigned B = First; B != Buckets.size(); ++B) {
+        uint64_t Low = B ? 1ull << (B - 1) : 0, High = 1ull << B;
+        OS << format("      [%7llu, %7llu) us %8u ", (unsigned long long)Low, (unsigned long long)High, Buckets[B]);
+        // A bar of up to 40 '#', at least one for a bucket that isn't empty
+        OS << std::string(Buckets[B] ? std::max(Buckets[B] * 40 / Largest, 1u) : 0, '#') << '\n';
+    }
+}
+
+void PhaseStats::print(raw_ostream &OS, const MemoryStats &Memory) const {
+    OS << "Phase times of " << Items << " top-level items (us):\n";
+    OS << "  phase           items        total       mean        p50        p99        max\n";
+    for (unsigned I = 0; I != NumPhases; ++I) {
+        if (Samples[I].empty())
+            continue;
+        std::vector<uint64_t> Sorted = Samples[I];
+        llvm::sort(Sorted);
+        uint64_t Total = 0;
+        for (uint64_t NS : Sorted)
+            Total += NS;
+
+        OS << format("  %-12s %8zu %12.1f %10.1f %10.1f %10.1f %10.1f\n", getPhaseName((Phase)I).str().c_str(),
+                     Sorted.size(), toMicros(Total), toMicros(Total) / Sorted.size(),
+                     toMicros(percentile(Sorted, 0.5)), toMicros(percentile(Sorted, 0.99)),
+                     toMicros(Sorted.back()));
+        printHistogram(OS, Sorted);
+    }
+    OS << "Modules handed to the JIT: " << Modules << "\n";
+    OS << "JIT memory freed: " << Memory.FreedBytes << " bytes (" << Memory.CodeBytes + Memory.DataBytes
+       << " still held)\n";
+}
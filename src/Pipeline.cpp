@@ -0,0 +1,199 @@
+#include "../headers/Pipeline.h"
+#include "llvm/Analysis/InlineCost.h"
+#include "llvm/IR/PassInstrumentation.h"
+#include "llvm/Support/JSON.h"
+#include "llvm/Transforms/IPO/Inliner.h"
+#include "llvm/Transforms/InstCombine/InstCombine.h"
+#include "llvm/Transforms/Scalar/GVN.h"
+#include "llvm/Transforms/Scalar/Reassociate.h"
+#include "llvm/Transforms/Scalar/SROA.h"
+#include "llvm/Transforms/Scalar/SimplifyCFG.h"
+#include "llvm/Transforms/Scalar/TailRecursionElimination.h"
+
+void PassTimings::start() {
+    Running.push_back(std::chrono::steady_clock::now());
+}
+
+void PassTimings::stop(StringMap<Entry> &Table, StringRef Name) {
+    assert(!Running.empty() && "pass finished without starting");
+    auto Elapsed = std::chrono::steady_clock::now() - Running.back();
+    Running.pop_back();
+
+    // Pass managers and adaptors only run other passes, which are timed on
+    // their own; counting them too would count that time twice.
+    if (isSpecialPass(Name, {"PassManager", "PassAdaptor", "AnalysisManagerProxy"}))
+        return;
+
+    Entry &E = Table[Name];
+    ++E.Count;
+    E.Time += Elapsed;
+}
+
+void PassTimings::registerCallbacks(PassInstrumentationCallbacks &PIC) {
+    PIC.registerBeforeNonSkippedPassCallback([this](StringRef, Any) { start(); });
+    PIC.registerAfterPassCallback([this](StringRef P, Any, const PreservedAnalyses &) {
+        stop(Passes, P);
+    });
+    PIC.registerAfterPassInvalidatedCallback([this](StringRef P, const PreservedAnalyses &) {
+        stop(Passes, P);
+    });
+
+    PIC.registerBeforeAnalysisCallback([this](StringRef, Any) { start(); });
+    PIC.registerAfterAnalysisCallback([this](StringRef A, Any) { stop(Analyses, A); });
+}
+
+void PassTimings::add(const PassTimings &Other) {
+    auto AddTable = [](StringMap<Entry> &To, const StringMap<Entry> &From) {
+        for (auto &E : From) {
+            Entry &Sum = To[E.first()];
+            Sum.Count += E.second.Count;
+            Sum.Time += E.second.Time;
+        }
+    };
+    AddTable(Passes, Other.Passes);
+    AddTable(Analyses, Other.Analyses);
+}
+
+void PassTimings::printJSON(raw_ostream &OS) const {
+    auto PrintTable = [](json::OStream &J, const StringMap<Entry> &Table) {
+        std::vector<const StringMapEntry<Entry> *> Sorted;
+        for (auto &E : Table)
+            Sorted.push_back(&E);
+        llvm::sort(Sorted, [](auto *A, auto *B) { return A->second.Time > B->second.Time; });
+
+        J.array([&] {
+            for (auto *E : Sorted) {
+                J.object([&] {
+                    J.attribute("name", E->first());
+                    J.attribute("count", (int64_t)E->second.Count);
+                    J.attribute("wall_ms", std::chrono::duration<double, std::milli>(E->second.Time).count());
+                });
+            }
+        });
+    };
+
+    json::OStream J(OS, /*IndentSize*/ 2);
+    J.object([&] {
+        J.attributeBegin("passes");
+        PrintTable(J, Passes);
+        J.attributeEnd();
+        J.attributeBegin("analyses");
+        PrintTable(J, Analyses);
+        J.attributeEnd();
+    });
+    OS << "\n";
+}
+
+static PipelineTuningOptions getTuningOptions(unsigned OptLevel) {
+    PipelineTuningOptions PTO;
+    PTO.LoopUnrolling = OptLevel >= 2;
+    PTO.LoopVectorization = OptLevel >= 2;
+    PTO.SLPVectorization = OptLevel >= 2;
+    return PTO;
+}
+
+/*
+    The -O1 function pipeline, run on each function as it's generated, and
+    again on the functions the inliner has inlined into.
+*/
+static FunctionPassManager buildFunctionPipeline() {
+    FunctionPassManager FPM;
+/*
+    We use a series of “addPass” calls to add a bunch of LLVM transform passes
+*/
+
+    // Promote the allocas of variables (and arguments) to registers, first,
+    // so the passes below see SSA values (SROA does mem2reg and more).
+    FPM.addPass(SROAPass(SROAOptions::ModifyCFG));
+    // Do simple "peephole" optimizations and bit-twiddling optimizations.
+    FPM.addPass(InstCombinePass());
+    // Reassociate expressions.
+    FPM.addPass(ReassociatePass());
+    // Eliminate Common SubExpressions.
+    FPM.addPass(GVNPass());
+    // Simplify the control flow graph (deleting unreachable blocks, etc).
+    FPM.addPass(SimplifyCFGPass());
+    // Turn self-recursive tail calls into loops, so deep recursion doesn't
+    // grow the stack; the other calls in tail position are marked 'tail'.
+    FPM.addPass(TailCallElimPass());
+    FPM.addPass(SimplifyCFGPass());
+    return FPM;
+}
+
+/*
+    The pass builder is given our instrumentation callbacks so that the
+    PassInstrumentationAnalysis it registers (which every pass manager queries
+    before running a pass) actually reports to StandardInstrumentations and the
+    timing collector.
+*/
+OptimizationPipeline::OptimizationPipeline(const PipelineOptions &Opts)
+    : SI(InstrumentationContext, Opts.DebugLogging),
+      PB(Opts.TM, getTuningOptions(Opts.OptLevel), std::nullopt, &PIC),
+      OptLevel(Opts.OptLevel) {
+    SI.registerCallbacks(PIC, &MAM);
+    if (Opts.TimePasses) {
+        Timings = std::make_unique<PassTimings>();
+        Timings->registerCallbacks(PIC);
+    }
+
+    if (OptLevel == 1) {
+        FPM = buildFunctionPipeline();
+
+        // A module holding several definitions gets its small functions (and
+        // operators) inlined into their callers, which are then simplified
+        // again. Functions stay external, since other modules may call them.
+        ModuleInlinerWrapperPass Inliner(getInlineParams(/*OptLevel*/ 1, /*SizeOptLevel*/ 0));
+        Inliner.getPM().addPass(createCGSCCToFunctionPassAdaptor(buildFunctionPipeline()));
+        MPM.addPass(std::move(Inliner));
+    }
+
+/*
+    Next, we register the analysis passes
+    used by the transform passes.
+*/
+    PB.registerModuleAnalyses(MAM);
+    PB.registerCGSCCAnalyses(CGAM);
+    PB.registerFunctionAnalyses(FAM);
+    PB.registerLoopAnalyses(LAM);
+    PB.crossRegisterProxies(LAM, FAM, CGAM, MAM);
+
+    // The standard pipelines inline, unroll and vectorize loops, which the
+    // per-function pipeline above can't do.
+    if (OptLevel == 2)
+        MPM = PB.buildPerModuleDefaultPipeline(OptimizationLevel::O2);
+    else if (OptLevel >= 3)
+        MPM = PB.buildPerModuleDefaultPipeline(OptimizationLevel::O3);
+}
+
+/*
+    The analysis managers cache results keyed by the address of the IR unit.
+    Once a function's module is handed to the JIT it can be freed at any time
+    and its address reused by a later function, so nothing may stay cached
+    between runs.
+*/
+void OptimizationPipeline::clearAnalyses() {
+    LAM.clear();
+    FAM.clear();
+    CGAM.clear();
+    MAM.clear();
+}
+
+void OptimizationPipeline::run(Function &F) {
+    if (OptLevel != 1)
+        return;
+    FPM.run(F, FAM);
+    clearAnalyses();
+}
+
+void OptimizationPipeline::run(Module &M) {
+    if (OptLevel == 0)
+        return;
+
+    // At -O1 the functions have been optimized already, which leaves inlining
+    // one into another, so a module of a single definition has nothing to do.
+    if (OptLevel == 1 && count_if(M, [](const Function &F) { return !F.isDeclaration(); }) < 2)
+        return;
+
+    MPM.run(M, MAM);
+    clearAnalyses();
+}
@@ -0,0 +1,197 @@
+#include "../headers/PreparedExpr.h"
+
+/*
+    The numbers N of the __expr.N of all caches, which share the JIT and so
+    need distinct symbol names. The number of an expression whose code has
+    been freed is given to the next one, so the names (each interned for good,
+    see SymbolTable) are only as many as the expressions live at once.
+*/
+static std::mutex ExprIDsMutex;
+static unsigned NextExprID = 0;
+static std::vector<unsigned> FreeExprIDs;
+
+static unsigned takeExprID() {
+    std::lock_guard<std::mutex> Lock(ExprIDsMutex);
+    if (FreeExprIDs.empty())
+        return NextExprID++;
+    unsigned ID = FreeExprIDs.back();
+    FreeExprIDs.pop_back();
+    return ID;
+}
+
+static void giveBackExprID(unsigned ID) {
+    std::lock_guard<std::mutex> Lock(ExprIDsMutex);
+    FreeExprIDs.push_back(ID);
+}
+
+// Free RT's code, and the expression's number if it's no longer defined.
+static Error discardExpr(ResourceTracker &RT, unsigned ID) {
+    if (auto Err = RT.remove())
+        return Err;
+    giveBackExprID(ID);
+    return Error::success();
+}
+
+PreparedExpressions::PreparedExpressions(KaleidoscopeJIT &JIT, OptimizationPipeline &Pipeline,
+                                         PrototypeRegistry &Protos, FastMathFlags FPFlags,
+                                         const HostArrayRegistry* HostArrays)
+    : JIT(JIT), Pipeline(Pipeline), Protos(Protos), FPFlags(FPFlags), HostArrays(HostArrays) {}
+
+PreparedExpressions::~PreparedExpressions() {
+    for (auto &E : Live)
+        if (auto Err = discardExpr(*E.second->RT, E.second->ID))
+            logAllUnhandledErrors(std::move(Err), errs(), "Error: ");
+}
+
+/*
+    The key is the parameter list and what identifies the expression (its
+    source text or printed AST), separated by characters that can't appear in
+    either: the source form "T" is followed by the raw text, the AST form "A"
+    by its s-expression.
+*/
+static std::string makeKey(char Form, StringRef Expr, ArrayRef<std::string> Params) {
+    std::string Key;
+    raw_string_ostream OS(Key);
+    for (auto &Param : Params)
+        OS << Param << ',';
+    OS << '\0' << Form << Expr;
+    OS.flush();
+    return Key;
+}
+
+Expected<PreparedExpression*> PreparedExpressions::prepare(StringRef Source, ArrayRef<std::string> Params) {
+    std::string Key = makeKey('T', Source, Params);
+    {
+        std::lock_guard<std::mutex> Lock(Mutex);
+        auto I = Cache.find(Key);
+        if (I != Cache.end()) {
+            ++I->second->RefCount;
+            return I->second;
+        }
+    }
+
+    Lexer Lex(MemoryBuffer::getMemBuffer(Source, "<expression>", /*RequiresNullTerminator*/ false));
+    Parser P(Lex);
+
+    // The user defined operators are known by their registered prototypes
+    Protos.installOperators(P);
+
+    P.getNextToken();
+    ExprAST* Body = P.ParseExpression();
+    if (!Body)
+        return createStringError(inconvertibleErrorCode(), "could not parse expression '%s'",
+                                 Source.str().c_str());
+    if (P.getCurTok() == ';')
+        P.getNextToken();
+    if (P.getCurTok() != TOK_EOF)
+        return createStringError(inconvertibleErrorCode(), "unexpected input after expression '%s'",
+                                 Source.str().c_str());
+
+    return lookupOrCompile(std::move(Key), Body, Params);
+}
+
+Expected<PreparedExpression*> PreparedExpressions::prepare(ExprAST* Body, ArrayRef<std::string> Params) {
+    std::string Printed;
+    raw_string_ostream OS(Printed);
+    Body->print(OS);
+    OS.flush();
+    return lookupOrCompile(makeKey('A', Printed, Params), Body, Params);
+}
+
+/*
+    The expression becomes a function __expr.N taking its parameters, plus an
+    entry point __expr.N.entry(const double* Args) that loads them from an
+    array and calls it. Callers go through the entry point, so a handle doesn't
+    need a different function pointer type for each number of parameters.
+
+    Neither is registered as a prototype, as nothing else calls them, and the
+    session has no ExecutionProfile, so they get no profile key or counters.
+*/
+Expected<PreparedExpression*> PreparedExpressions::lookupOrCompile(std::string Key, ExprAST* Body,
+                                                                   ArrayRef<std::string> Params) {
+    std::lock_guard<std::mutex> Lock(Mutex);
+    auto I = Cache.find(Key);
+    if (I != Cache.end()) {
+        ++I->second->RefCount;
+        return I->second;
+    }
+
+    unsigned ID = takeExprID();
+    std::string Name = "__expr." + std::to_string(ID);
+    FunctionAST FnAST(std::make_unique<PrototypeAST>(Name, std::vector<std::string>(Params.begin(), Params.end())),
+                      Body);
+
+    CodegenSession S(JIT, Pipeline, Protos, FPFlags);
+    S.HostArrays = HostArrays;
+    S.Stats = Stats;
+    S.RegisterDefinitions = false;
+    S.reset();
+    std::optional<PhaseTimer> T(std::in_place, Stats, Phase::IRGen);
+    Function* F = FnAST.codegen(S);
+    if (!F) {
+        giveBackExprID(ID);
+        return createStringError(inconvertibleErrorCode(), "could not compile expression");
+    }
+
+    IRBuilder<> &Builder = *S.Builder;
+    FunctionType* EntryTy = FunctionType::get(Builder.getDoubleTy(), {Builder.getPtrTy()}, false);
+    Function* EntryF = Function::Create(EntryTy, Function::ExternalLinkage, Name + ".entry", S.TheModule.get());
+    Builder.SetInsertPoint(BasicBlock::Create(*S.TheContext, "entry", EntryF));
+
+    SmallVector<Value*, 8> Args;
+    for (unsigned Idx = 0; Idx != Params.size(); ++Idx) {
+        Value* Addr = Builder.CreateConstInBoundsGEP1_64(Builder.getDoubleTy(), EntryF->getArg(0), Idx);
+        Args.push_back(Builder.CreateLoad(Builder.getDoubleTy(), Addr, Params[Idx]));
+    }
+    Builder.CreateRet(Builder.CreateCall(F, Args, "result"));
+    verifyFunction(*EntryF);
+    T.emplace(Stats, Phase::Optimize);
+    Pipeline.run(*EntryF);
+    Pipeline.run(*S.TheModule);
+
+    T.emplace(Stats, Phase::Materialize);
+    if (Stats)
+        Stats->countModule();
+    auto RT = JIT.getMainJITDylib().createResourceTracker();
+    if (auto Err = JIT.addModule(S.takeModule(), RT, /*AllowLazy*/ false))
+        return joinErrors(std::move(Err), discardExpr(*RT, ID));
+    auto EntrySym = JIT.lookup(Name + ".entry");
+    if (!EntrySym)
+        return joinErrors(EntrySym.takeError(), discardExpr(*RT, ID));
+    T.reset();
+
+    auto E = std::make_unique<PreparedExpression>();
+    E->Entry = EntrySym->getAddress().toPtr<PreparedExpression::EntryFn>();
+    E->NumParams = Params.size();
+    E->RT = std::move(RT);
+    E->ID = ID;
+    E->RefCount = 2; // the caller's and the cache's
+
+    PreparedExpression* Handle = E.get();
+    Live[Handle] = std::move(E);
+    Cache[Key] = Handle;
+    return Handle;
+}
+
+// unref - Drop a reference to E, freeing its code once nobody has one. Expects Mutex to be held.
+void PreparedExpressions::unref(PreparedExpression* E) {
+    assert(E->RefCount && "expression released too many times");
+    if (--E->RefCount)
+        return;
+
+    if (auto Err = discardExpr(*E->RT, E->ID))
+        logAllUnhandledErrors(std::move(Err), errs(), "Error: ");
+    Live.erase(E);
+}
+
+void PreparedExpressions::release(PreparedExpression* E) {
+    std::lock_guard<std::mutex> Lock(Mutex);
+    unref(E);
+}
+
+void PreparedExpressions::invalidate() {
+    std::lock_guard<std::mutex> Lock(Mutex);
+    for (auto &Entry : Cache)
+        unref(Entry.second);
+    Cache.clear();
+}
@@ -0,0 +1,82 @@
+#include "../headers/Profile.h"
+#include "llvm/ADT/StringExtras.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/MemoryBuffer.h"
+#include "llvm/Support/ToolOutputFile.h"
+
+// Keys are "<name> <ordinal>", which is also how they start their line in the file
+std::string ExecutionProfile::getNextKey(StringRef Name) {
+    std::lock_guard<std::mutex> Lock(Mutex);
+    return (Name + " " + Twine(Definitions[Name]++)).str();
+}
+
+const std::vector<uint64_t>* ExecutionProfile::lookup(StringRef Key) const {
+    // Loaded isn't changed once it's read
+    auto I = Loaded.find(Key);
+    return I == Loaded.end() ? nullptr : &I->second;
+}
+
+// Hot: called at least 1% as often as the most called definition
+bool ExecutionProfile::isHot(uint64_t EntryCount) const {
+    return EntryCount && EntryCount * 100 >= MaxEntryCount;
+}
+
+uint64_t* ExecutionProfile::allocateCounters(StringRef Key, size_t N) {
+    std::lock_guard<std::mutex> Lock(Mutex);
+    Live.push_back({Key.str(), std::make_unique<uint64_t[]>(N), N});
+    return Live.back().Values.get();
+}
+
+Error ExecutionProfile::read(StringRef Filename) {
+    auto Buffer = MemoryBuffer::getFile(Filename, /*IsText*/ true);
+    if (!Buffer)
+        return createFileError(Filename, Buffer.getError());
+
+    SmallVector<StringRef, 16> Lines;
+    (*Buffer)->getBuffer().split(Lines, '\n'); // keeping empty lines, so errors have the right line numbers
+    for (size_t LineNo = 0; LineNo != Lines.size(); ++LineNo) {
+        StringRef Line = Lines[LineNo].trim();
+        if (Line.empty() || Line.startswith("#"))
+            continue;
+
+        auto Malformed = [&] {
+            return createStringError(inconvertibleErrorCode(), "%s:%zu: malformed profile line",
+                                     Filename.str().c_str(), LineNo + 1);
+        };
+        SmallVector<StringRef, 16> Fields;
+        Line.split(Fields, ' ', -1, /*KeepEmpty*/ false);
+        unsigned Ordinal;
+        size_t N;
+        if (Fields.size() < 3 || !to_integer(Fields[1], Ordinal) || !to_integer(Fields[2], N) ||
+            Fields.size() != N + 3)
+            return Malformed();
+
+        std::vector<uint64_t> Counts(N);
+        for (size_t I = 0; I != N; ++I)
+            if (!to_integer(Fields[I + 3], Counts[I]))
+                return Malformed();
+        if (!Counts.empty())
+            MaxEntryCount = std::max(MaxEntryCount, Counts[0]);
+        Loaded[(Fields[0] + " " + Fields[1]).str()] = std::move(Counts);
+    }
+    return Error::success();
+}
+
+Error ExecutionProfile::write(StringRef Filename) const {
+    std::error_code EC;
+    ToolOutputFile Out(Filename, EC, sys::fs::OF_Text);
+    if (EC)
+        return createFileError(Filename, EC);
+
+    raw_ostream &OS = Out.os();
+    OS << "# kaleidoscope execution profile: <name> <ordinal> <number of counters> <counter>...\n";
+    std::lock_guard<std::mutex> Lock(Mutex);
+    for (auto &C : Live) {
+        OS << C.Key << ' ' << C.Size;
+        for (size_t I = 0; I != C.Size; ++I)
+            OS << ' ' << C.Values[I];
+        OS << '\n';
+    }
+    Out.keep();
+    return Error::success();
+}
@@ -0,0 +1,41 @@
+#include "../headers/Symbols.h"
+
+#include <cassert>
+#include <mutex>
+
+SymbolTable::SymbolTable() {
+    for (bool IsBinary : {false, true}) {
+        for (unsigned Op = 0; Op != 128; ++Op) {
+            std::string Name = IsBinary ? "binary" : "unary";
+            Name += (char)Op;
+            intern(Name);
+            assert(IDs[Name] == getOperatorID(IsBinary, (char)Op) && "operator IDs out of order");
+        }
+    }
+}
+
+SymbolTable &SymbolTable::get() {
+    static SymbolTable Table;
+    return Table;
+}
+
+SymbolID SymbolTable::intern(StringRef Name) {
+    {
+        std::shared_lock<std::shared_mutex> Lock(Mutex);
+        auto I = IDs.find(Name);
+        if (I != IDs.end())
+            return I->second;
+    }
+
+    std::unique_lock<std::shared_mutex> Lock(Mutex);
+    auto [I, Inserted] = IDs.try_emplace(Name, (SymbolID)Names.size());
+    if (Inserted)
+        Names.push_back(I->first());
+    return I->second;
+}
+
+StringRef SymbolTable::getName(SymbolID ID) const {
+    std::shared_lock<std::shared_mutex> Lock(Mutex);
+    assert(ID < Names.size() && "unknown symbol");
+    return Names[ID];
+}
@@ -0,0 +1,202 @@
+#include "../headers/Tiering.h"
+#include "../headers/Pipeline.h"
+#include "llvm/Bitcode/BitcodeReader.h"
+#include "llvm/Bitcode/BitcodeWriter.h"
+#include "llvm/IR/IRBuilder.h"
+#include "llvm/Support/MemoryBuffer.h"
+
+TieredCompiler *TieredCompiler::Active = nullptr;
+
+TieredCompiler::TieredCompiler(KaleidoscopeJIT &JIT, uint64_t Threshold)
+    : JIT(JIT), Threshold(std::max<uint64_t>(Threshold, 1)),
+      Stubs(JIT.createIndirectStubsManager()) {
+    assert(!Active && "only one TieredCompiler may exist at a time");
+    Active = this;
+
+    cantFail(JIT.defineAbsolute("__kaleidoscope_tier_up",
+        ExecutorSymbolDef(ExecutorAddr::fromPtr(&tierUpHook),
+                          JITSymbolFlags::Exported | JITSymbolFlags::Callable)));
+}
+
+TieredCompiler::~TieredCompiler() {
+    // Background recompilations use the stubs and the function table
+    std::unique_lock<std::mutex> Lock(PendingMutex);
+    PendingDone.wait(Lock, [this] { return Pending == 0; });
+    Active = nullptr;
+}
+
+// Called (once) by a tier 0 function when its counter reaches the threshold
+void TieredCompiler::tierUpHook(uint64_t ID) {
+    TieredCompiler *TC = Active;
+    {
+        std::lock_guard<std::mutex> Lock(TC->PendingMutex);
+        ++TC->Pending;
+    }
+    TC->JIT.runInBackground([TC, ID] {
+        TC->reoptimize(ID);
+        std::lock_guard<std::mutex> Lock(TC->PendingMutex);
+        if (--TC->Pending == 0)
+            TC->PendingDone.notify_all();
+    }, "tier-up");
+}
+
+/*
+    Prepend a block to F that bumps its call counter and calls the tier-up hook
+    exactly once, on the call that takes the counter to the threshold:
+
+        count:
+          %calls = atomicrmw add ptr @F$calls, i64 1 monotonic
+          %hot = icmp eq i64 %calls, <threshold - 1>
+          br i1 %hot, label %tierup, label %entry
+        tierup:
+          call void @__kaleidoscope_tier_up(i64 <ID>)
+          br label %entry
+*/
+void TieredCompiler::instrument(Function &F, uint64_t ID) {
+    LLVMContext &Ctx = F.getContext();
+    Module &M = *F.getParent();
+    Type* Int64Ty = Type::getInt64Ty(Ctx);
+
+    auto *Counter = new GlobalVariable(M, Int64Ty, /*isConstant*/ false, GlobalValue::InternalLinkage,
+                                       ConstantInt::get(Int64Ty, 0), F.getName() + "$calls");
+    FunctionCallee Hook = M.getOrInsertFunction("__kaleidoscope_tier_up", Type::getVoidTy(Ctx), Int64Ty);
+
+    BasicBlock* Body = &F.getEntryBlock();
+    BasicBlock* CountBB = BasicBlock::Create(Ctx, "count", &F, Body);
+    BasicBlock* TierUpBB = BasicBlock::Create(Ctx, "tierup", &F, Body);
+
+    IRBuilder<> Builder(CountBB);
+    Value* Calls = Builder.CreateAtomicRMW(AtomicRMWInst::Add, Counter, ConstantInt::get(Int64Ty, 1),
+                                           MaybeAlign(), AtomicOrdering::Monotonic);
+    Value* Hot = Builder.CreateICmpEQ(Calls, ConstantInt::get(Int64Ty, Threshold - 1), "hot");
+    Builder.CreateCondBr(Hot, TierUpBB, Body);
+
+    Builder.SetInsertPoint(TierUpBB);
+    Builder.CreateCall(Hook, ConstantInt::get(Int64Ty, ID));
+    Builder.CreateBr(Body);
+}
+
+Error TieredCompiler::addModule(std::unique_ptr<Module> M, std::unique_ptr<LLVMContext> Ctx) {
+    // Tier 1 is compiled from the IR as it is now, before instrumentation
+    auto Bitcode = std::make_shared<SmallVector<char, 0>>();
+    raw_svector_ostream OS(*Bitcode);
+    WriteBitcodeToFile(*M, OS);
+
+    std::vector<Function*> Defined;
+    for (auto &F : *M)
+        if (!F.isDeclaration())
+            Defined.push_back(&F);
+
+    std::vector<std::tuple<std::string, std::string, uint64_t>> Names; // name, tier 0 body, ID
+    for (Function* F : Defined) {
+        std::string Name = F->getName().str();
+        uint64_t ID;
+        unsigned Version;
+        {
+            std::lock_guard<std::mutex> Lock(FunctionsMutex);
+            ID = Functions.size();
+            Version = Versions[Name]++;
+            Functions.push_back({Name, Version, Bitcode});
+        }
+        instrument(*F, ID);
+
+        // Move the body out of the way and make every use in this module
+        // (including recursive calls) go through the stub named Name.
+        std::string BodyName = (Name + "$tier0." + Twine(Version)).str();
+        F->setName(BodyName);
+        Function* Stub = Function::Create(F->getFunctionType(), Function::ExternalLinkage, Name, M.get());
+        F->replaceAllUsesWith(Stub);
+
+        Names.emplace_back(std::move(Name), std::move(BodyName), ID);
+    }
+
+    if (auto Err = JIT.addModule(ThreadSafeModule(std::move(M), std::move(Ctx)), nullptr, /*AllowLazy*/ false))
+        return Err;
+
+    for (auto &[Name, BodyName, ID] : Names) {
+        auto Body = JIT.lookup(BodyName);
+        if (!Body)
+            return Body.takeError();
+
+        ExecutorSymbolDef Stub;
+        {
+            std::lock_guard<std::mutex> Lock(StubsMutex);
+            // A redefinition: callers already go through the stub
+            auto It = Current.find(Name);
+            if (It != Current.end()) {
+                if (auto Err = Stubs->updatePointer(Name, Body->getAddress()))
+                    return Err;
+                It->second = ID;
+                continue;
+            }
+            if (auto Err = Stubs->createStub(Name, Body->getAddress(), JITSymbolFlags::Exported | JITSymbolFlags::Callable))
+                return Err;
+            Current[Name] = ID;
+            Stub = Stubs->findStub(Name, /*ExportedStubsOnly*/ false);
+        }
+        if (auto Err = JIT.defineAbsolute(Name, Stub))
+            return Err;
+    }
+    return Error::success();
+}
+
+// Recompile one function at -O3 and point its stub at the result
+void TieredCompiler::reoptimize(uint64_t ID) {
+    TieredFunction TF;
+    {
+        std::lock_guard<std::mutex> Lock(FunctionsMutex);
+        TF = Functions[ID];
+    }
+
+    // Redefined since it got hot
+    auto IsCurrent = [&] { return Current.lookup(TF.Name) == ID; };
+    {
+        std::lock_guard<std::mutex> Lock(StubsMutex);
+        if (!IsCurrent())
+            return;
+    }
+
+    auto ReportError = [&](Error Err) {
+        logAllUnhandledErrors(std::move(Err), errs(), "Error: could not reoptimize " + TF.Name + ": ");
+    };
+
+    auto Ctx = std::make_unique<LLVMContext>();
+    auto M = parseBitcodeFile(MemoryBufferRef(StringRef(TF.Bitcode->data(), TF.Bitcode->size()), TF.Name), *Ctx);
+    if (!M)
+        return ReportError(M.takeError());
+
+    // Keep only this function's body; everything else resolves to what is
+    // already in the JIT (other functions through their stubs).
+    for (auto &F : **M)
+        if (!F.isDeclaration() && F.getName() != TF.Name)
+            F.deleteBody();
+    for (auto &GV : (*M)->globals())
+        if (GV.hasInitializer() && !GV.hasLocalLinkage()) {
+            GV.setInitializer(nullptr);
+            GV.setLinkage(GlobalValue::ExternalLinkage);
+        }
+    std::string BodyName = (TF.Name + "$tier1." + Twine(TF.Version)).str();
+    (*M)->getFunction(TF.Name)->setName(BodyName);
+
+    // The pipeline isn't thread safe, so each recompilation gets its own.
+    auto TM = JIT.getTargetMachineBuilder().createTargetMachine();
+    if (!TM)
+        return ReportError(TM.takeError());
+    PipelineOptions Opts;
+    Opts.OptLevel = 3;
+    Opts.TM = TM->get();
+    OptimizationPipeline(Opts).run(**M);
+
+    if (auto Err = JIT.addModule(ThreadSafeModule(std::move(*M), std::move(Ctx)), nullptr, /*AllowLazy*/ false))
+        return ReportError(std::move(Err));
+    auto Body = JIT.lookup(BodyName);
+    if (!Body)
+        return ReportError(Body.takeError());
+
+    std::lock_guard<std::mutex> Lock(StubsMutex);
+    if (!IsCurrent())
+        return;
+    if (auto Err = Stubs->updatePointer(TF.Name, Body->getAddress()))
+        return ReportError(std::move(Err));
+    ++NumPromoted;
+}
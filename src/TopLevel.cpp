@@ -1,126 +1,230 @@
 #include "../headers/TopLevel.h"
+#include "llvm/Support/Format.h"
 
-static void InitializeModuleAndManagers() {
-    // Open a new context module
-    TheContext = std::make_unique<LLVMContext>();
-    TheModule = std::make_unique<Module>("KaleidoscopeJIT", *TheContext);
-    TheModule->setDataLayout(TheJIT->getDataLayout());    
-
-    // Create new builder for the module
-    Builder = std::make_unique<IRBuilder<>>(*TheContext);
-
-    // Create new pass analysis managers
-    TheFPM = std::make_unique<FunctionPassManager>();
-    TheLAM = std::make_unique<LoopAnalysisManager>();
-    TheFAM = std::make_unique<FunctionAnalysisManager>();
-
-    TheCGAM = std::make_unique<CGSCCAnalysisManager>();
-    TheMAM = std::make_unique<ModuleAnalysisManager>();
-    ThePIC = std::make_unique<PassInstrumentationCallbacks>();
-    TheSI = std::make_unique<StandardInstrumentations>(*TheContext, /*DebugLogging*/ true);
-    TheSI->registerCallbacks(*ThePIC, TheMAM.get());
-
-/*
-    Once these managers are set up, we use a series of 
-    “addPass” calls to add a bunch of LLVM transform passes
-*/
-
-    // Do simple "peephole" optimizations and bit-twiddling optimizations.
-    TheFPM->addPass(InstCombinePass());
-    // Reassociate expressions.
-    TheFPM->addPass(ReassociatePass());
-    // Eliminate Common SubExpressions.
-    TheFPM->addPass(GVNPass());
-    // Simplify the control flow graph (deleting unreachable blocks, etc).
-    TheFPM->addPass(SimplifyCFGPass());
-
-/*
-    Next, we register the analysis passes 
-    used by the transform passes.
-*/
-    PassBuilder PB;
-    PB.registerModuleAnalyses(*TheMAM);
-    PB.registerFunctionAnalyses(*TheFAM);
-    PB.crossRegisterProxies(*TheLAM, *TheFAM, *TheCGAM, *TheMAM);
+ExitOnError ExitOnErr;
+
+// FlushDefinitions - Hand the pending definitions to the JIT and start a new module
+Error FlushDefinitions(CodegenSession &S) {
+    // Ahead of time all the definitions go into one module
+    if (S.PendingDefinitions == 0 || !S.JIT)
+        return Error::success();
+
+    PhaseTimer T(S.Stats, Phase::Materialize);
+    if (S.Stats)
+        S.Stats->countModule();
+
+    // In tiered mode definitions start out unoptimized, and are compiled
+    // right away so their stubs can be created.
+    if (S.Tiers) {
+        Error Err = S.Tiers->addModule(std::move(S.TheModule), std::move(S.TheContext));
+        S.reset();
+        S.PendingDefinitions = 0;
+        return Err;
+    }
+
+    std::vector<std::string> FnNames;
+    for (auto &F : *S.TheModule)
+        if (!F.isDeclaration())
+            FnNames.push_back(F.getName().str());
+
+    {
+        PhaseTimer T(S.Stats, Phase::Optimize);
+        S.Pipeline.run(*S.TheModule);
+    }
+    if (S.DumpModules) {
+        // In one piece, as stderr isn't buffered
+        std::string IR;
+        raw_string_ostream OS(IR);
+        S.TheModule->print(OS, nullptr);
+        errs() << OS.str();
+    }
+    S.PendingDefinitions = 0;
+    if (auto Err = S.JIT->addModule(S.takeModule()))
+        return Err;
+
+    // Let the compile threads (if any) start on it while we parse
+    // the next item.
+    S.JIT->compileInBackground(FnNames);
+    return Error::success();
 }
 
-static void HandleDefinition() {
-    if (auto FnAST = ParseDefinition()) {
-        if (auto *FnIR = FnAST->codegen()) {
-            fprintf(stderr, "\nRead function definition:");
-            FnIR->print(errs());
-            fprintf(stderr, "\n");
-            ExitOnErr(TheJIT->addModule(ThreadSafeModule(std::move(TheModule), std::move(TheContext))));
-            InitializeModuleAndManagers();
+Error CompileDefinition(CodegenSession &S, Parser &P, std::unique_ptr<FunctionAST> FnAST) {
+    // A redefinition can't share a module with the body it replaces.
+    if (auto *F = S.findFunction(FnAST->getProto().getNameID()))
+        if (!F->isDeclaration()) {
+            if (!S.JIT) {
+                LogError("functions can only be defined once when compiling ahead of time");
+                ++S.NumErrors;
+                return Error::success();
+            }
+            if (auto Err = FlushDefinitions(S))
+                return Err;
         }
-    } else {
-        // Skip token for error recovery
-        getNextToken();
+
+    auto *FnIR = timePhase(S.Stats, Phase::IRGen, [&] { return FnAST->codegen(S); });
+    if (!FnIR) {
+        ++S.NumErrors;
+        return Error::success();
     }
+
+    // If this is an operator, install it.
+    const PrototypeAST &Proto = FnAST->getProto();
+    if (Proto.isBinaryOp())
+        P.setBinopPrecedence(Proto.getOperatorName(), Proto.getBinaryPrecedence());
+
+    if (S.BatchFunctions && S.BatchFunctions->count(Proto.getNameID()))
+        if (!timePhase(S.Stats, Phase::IRGen, [&] { return emitBatchWrapper(S, *FnIR); }))
+            ++S.NumErrors;
+
+    if (S.Echo) {
+        fprintf(stderr, "\nRead function definition:");
+        FnIR->print(errs());
+        fprintf(stderr, "\n");
+    }
+
+    if (++S.PendingDefinitions == S.DefsPerModule)
+        return FlushDefinitions(S);
+    return Error::success();
 }
 
-static void HandleExtern() {
-    if (auto ProtoAST = ParseExtern()) {
-        if (auto *FnIR = ProtoAST->codegen()) {
+Error HandleDefinition(CodegenSession &S, Parser &P) {
+    if (auto FnAST = timePhase(S.Stats, Phase::Parse, [&] { return P.ParseDefinition(); }))
+        return CompileDefinition(S, P, std::move(FnAST));
+
+    // Skip token for error recovery
+    ++S.NumErrors;
+    P.getNextToken();
+    return Error::success();
+}
+
+Error CompileExtern(CodegenSession &S, std::unique_ptr<PrototypeAST> ProtoAST) {
+    if (auto *FnIR = timePhase(S.Stats, Phase::IRGen, [&] { return ProtoAST->codegen(S); })) {
+        if (S.Echo) {
             fprintf(stderr, "\nRead extern: ");
             FnIR->print(errs());
             fprintf(stderr, "\n");
-            FunctionProtos[ProtoAST->getName()] = std::move(ProtoAST);
         }
+        S.Protos.add(std::move(ProtoAST));
     } else {
-        // Skip token for error recovery.
-        getNextToken();
+        ++S.NumErrors;
+    }
+    return Error::success();
+}
+
+Error HandleExtern(CodegenSession &S, Parser &P) {
+    if (auto ProtoAST = timePhase(S.Stats, Phase::Parse, [&] { return P.ParseExtern(); }))
+        return CompileExtern(S, std::move(ProtoAST));
+
+    // Skip token for error recovery.
+    ++S.NumErrors;
+    P.getNextToken();
+    return Error::success();
+}
+
+Error RunTopLevelExpression(CodegenSession &S, FunctionAST &FnAST, PreparedExpressions &Exprs) {
+    // The expression may call any of the pending definitions.
+    if (auto Err = FlushDefinitions(S))
+        return Err;
+
+    // The same expression typed again reuses the code compiled the first time.
+    auto Expr = timePhase(S.Stats, Phase::Lookup, [&] { return Exprs.prepare(FnAST.getBody()); });
+    if (!Expr) {
+        logAllUnhandledErrors(Expr.takeError(), errs(), "Error: ");
+        ++S.NumErrors;
+        return Error::success();
     }
+    double Result = timePhase(S.Stats, Phase::Execute, [&] { return (**Expr)({}); });
+    if (S.Results)
+        *S.Results << format("%.15g\n", Result);
+    else if (S.Echo)
+        fprintf(stderr, "Evaluated to %f\n", Result);
+    PhaseTimer T(S.Stats, Phase::Remove);
+    Exprs.release(*Expr);
+    return Error::success();
 }
 
-static void HandleTopLevelExpression() {
+Error HandleTopLevelExpression(CodegenSession &S, Parser &P, PreparedExpressions &Exprs) {
     // Evaluate a top-level expression into an anonymous function.
-    if (auto FnAST = ParseTopLevelExpr()) {
-        if (FnAST->codegen()) {
-            // Create a ResourceTracker to track JIT'd memory allocated to our
-            // anonymous expression -- that way we can free it after executing.
-            auto RT = TheJIT->getMainJITDylib().createResourceTracker();
-
-            auto TSM = ThreadSafeModule(std::move(TheModule), std::move(TheContext));
-            ExitOnErr(TheJIT->addModule(std::move(TSM), RT));
-            InitializeModuleAndManagers();
-
-            // Search the JIT for the __anon_expr symbol.
-            auto ExprSymbol = ExitOnErr(TheJIT->lookup("__anon_expr"));
-
-            // Get the symbol's address and cast it to the right type (takes no
-            // arguments, returns a double) so we can call it as a native function.
-            double (*FP)() = ExprSymbol.getAddress().toPtr<double (*)()>();
-            fprintf(stderr, "Evaluated to %f\n", FP());
-
-            // Delete the anonymous expression module from the JIT.
-            ExitOnErr(RT->remove());
-        }
+    if (auto FnAST = timePhase(S.Stats, Phase::Parse, [&] { return P.ParseTopLevelExpr(); }))
+        return RunTopLevelExpression(S, *FnAST, Exprs);
+
+    // Skip token for error recovery.
+    ++S.NumErrors;
+    P.getNextToken();
+    return Error::success();
+}
+
+Error HandleCommand(CodegenSession &S, Parser &P) {
+    P.getNextToken(); // eat ':'
+    if (P.getCurTok() != TOK_IDENTIFIER) {
+        LogError("expected a command name after ':'");
+        ++S.NumErrors;
+        return Error::success();
+    }
+    std::string Command = P.getIdentifier().str();
+    P.getNextToken();
+
+    if (Command == "memory" && S.JIT) {
+        MemoryStats M = S.JIT->getMemoryStats();
+        fprintf(stderr, "JIT memory: %llu code bytes, %llu data bytes in %u objects; "
+                        "%u module trackers (%u kept only for code that calls them)\n",
+                (unsigned long long)M.CodeBytes, (unsigned long long)M.DataBytes, M.Objects,
+                M.Trackers, M.Retained);
     } else {
-        // Skip token for error recovery.
-        getNextToken();
+        LogError("unknown command");
+        ++S.NumErrors;
     }
+    return Error::success();
 }
 
-// top ::= definition | external | expression | ';'
-static void MainLoop() {
+Error MainLoop(CodegenSession &S, Parser &P, PreparedExpressions &Exprs) {
     while (true) {
-        fprintf(stderr, "ready> ");
-        switch (CurTok) {
-            case TOK_EOF:
-            return;
-        case ';': // ignore top-level semicolons.
-            getNextToken();
-            break;
-        case TOK_DEF:
-            HandleDefinition();
-            break;
-        case TOK_EXTERN:
-            HandleExtern();
-            break;
-        default:
-            HandleTopLevelExpression();
-            break;
+        // The previous item has been compiled (or rejected), so its expressions can go.
+        P.clearAST();
+        if (S.Stats)
+            S.Stats->endItem();
+
+        if (S.Prompt)
+            fprintf(stderr, "ready> ");
+        switch (P.getCurTok()) {
+            case TOK_EOF: {
+                Error Err = FlushDefinitions(S);
+                if (S.Stats)
+                    S.Stats->endItem();
+                return Err;
+            }
+            case ';': // ignore top-level semicolons.
+                P.getNextToken();
+                break;
+            case TOK_DEF: {
+                Error Err = HandleDefinition(S, P);
+                // Expressions compiled so far may call what was just (re)defined
+                {
+                    PhaseTimer T(S.Stats, Phase::Remove);
+                    Exprs.invalidate();
+                }
+                if (Err)
+                    return Err;
+                break;
+            }
+            case TOK_EXTERN: {
+                Error Err = HandleExtern(S, P);
+                {
+                    PhaseTimer T(S.Stats, Phase::Remove);
+                    Exprs.invalidate();
+                }
+                if (Err)
+                    return Err;
+                break;
+            }
+            case ':':
+                if (auto Err = HandleCommand(S, P))
+                    return Err;
+                break;
+            default:
+                if (auto Err = HandleTopLevelExpression(S, P, Exprs))
+                    return Err;
+                break;
+        }
     }
-  }
-}
\ No newline at end of file
+}
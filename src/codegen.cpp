@@ -1,4 +1,6 @@
 #include "../headers/codegen.h"
+#include "llvm/IR/MDBuilder.h"
+#include "llvm/Transforms/Utils/Cloning.h"
 
 /*
     'LogErrorV' Method will be used to report errors found 
@@ -9,88 +11,406 @@ Value* LogErrorV(const char* Str) {
     return nullptr;
 }
 
-Function* getFunction(std::string Name) {
+void PrototypeRegistry::add(std::shared_ptr<const PrototypeAST> Proto) {
+    std::unique_lock<std::shared_mutex> Lock(Mutex);
+    SymbolID Name = Proto->getNameID();
+    if (Name >= Protos.size())
+        Protos.resize(Name + 1);
+    Protos[Name] = std::move(Proto);
+}
+
+std::shared_ptr<const PrototypeAST> PrototypeRegistry::lookup(SymbolID Name) const {
+    std::shared_lock<std::shared_mutex> Lock(Mutex);
+    if (Name >= Protos.size())
+        return nullptr;
+    return Protos[Name];
+}
+
+void PrototypeRegistry::installOperators(Parser &P) const {
+    std::shared_lock<std::shared_mutex> Lock(Mutex);
+    for (auto &Proto : Protos)
+        if (Proto && Proto->isBinaryOp())
+            P.setBinopPrecedence(Proto->getOperatorName(), Proto->getBinaryPrecedence());
+}
+
+void HostArrayRegistry::add(SymbolID Name, ValueType Ty) {
+    assert(isArrayType(Ty) && "not an array type");
+    std::unique_lock<std::shared_mutex> Lock(Mutex);
+    if (Name >= Arrays.size())
+        Arrays.resize(Name + 1);
+    Arrays[Name] = Ty;
+}
+
+std::optional<ValueType> HostArrayRegistry::lookup(SymbolID Name) const {
+    std::shared_lock<std::shared_mutex> Lock(Mutex);
+    if (Name >= Arrays.size())
+        return std::nullopt;
+    return Arrays[Name];
+}
+
+CodegenSession::CodegenSession(KaleidoscopeJIT &JIT, OptimizationPipeline &Pipeline,
+                               PrototypeRegistry &Protos, FastMathFlags FPFlags)
+    : JIT(&JIT), DL(JIT.getDataLayout()), TargetTriple(JIT.getTargetTriple()), Pipeline(Pipeline),
+      Protos(Protos), FPFlags(FPFlags) {}
+
+CodegenSession::CodegenSession(const DataLayout &DL, const Triple &TargetTriple, OptimizationPipeline &Pipeline,
+                               PrototypeRegistry &Protos, FastMathFlags FPFlags)
+    : JIT(nullptr), DL(DL), TargetTriple(TargetTriple), Pipeline(Pipeline), Protos(Protos), FPFlags(FPFlags) {}
+
+void CodegenSession::reset() {
+    // Open a new context module
+    TheContext = std::make_unique<LLVMContext>();
+    TheModule = std::make_unique<Module>("KaleidoscopeJIT", *TheContext);
+    TheModule->setDataLayout(DL);
+    TheModule->setTargetTriple(TargetTriple.str());
+
+    // Create new builder for the module
+    Builder = std::make_unique<IRBuilder<>>(*TheContext);
+    Builder->setFastMathFlags(FPFlags);
+
+    ModuleFunctions.clear();
+}
+
+ThreadSafeModule CodegenSession::takeModule() {
+    ThreadSafeModule TSM(std::move(TheModule), std::move(TheContext));
+    reset();
+    return TSM;
+}
+
+Function* CodegenSession::getFunction(SymbolID Name) {
     // First, see if the function has already been added to the current module.
-    if (auto *F = TheModule->getFunction(Name))
+    if (auto *F = findFunction(Name))
         return F;
 
     // If not, check whether we can codegen the declaration from some existing
     // prototype.
-    auto FI = FunctionProtos.find(Name);
-    if (FI != FunctionProtos.end())
-        return FI->second->codegen();
+    if (auto Proto = Protos.lookup(Name))
+        return Proto->codegen(*this);
 
     // If no existing prototype exists, return null.
     return nullptr;
 }
 
-Value* NumberExprAST::codegen() {
+/*
+    Expression nodes have no vtable; the kind says which codegen() to call.
+*/
+Value* ExprAST::codegen(CodegenSession &S) {
+    switch (getKind()) {
+        case EK_Number: return cast<NumberExprAST>(this)->codegen(S);
+        case EK_Variable: return cast<VariableExprAST>(this)->codegen(S);
+        case EK_Index: return cast<IndexExprAST>(this)->codegen(S);
+        case EK_Binary: return cast<BinaryExprAST>(this)->codegen(S);
+        case EK_Unary: return cast<UnaryExprAST>(this)->codegen(S);
+        case EK_Call: return cast<CallExprAST>(this)->codegen(S);
+        case EK_If: return cast<IfExprAST>(this)->codegen(S);
+        case EK_For: return cast<ForExprAST>(this)->codegen(S);
+        case EK_Var: return cast<VarExprAST>(this)->codegen(S);
+    }
+    llvm_unreachable("unknown expression kind");
+}
+
+Value* NumberExprAST::codegen(CodegenSession &S) {
     /*
         In the LLVM IR, numeric constants are represented with the ConstantFP class, 
         which holds the numeric value in an APFloat internally
     */
-    return ConstantFP::get(*TheContext, APFloat(Val));
+    return ConstantFP::get(*S.TheContext, APFloat(Val));
 }
 
-Value* VariableExprAST::codegen() {
-    // Look this variable up in the symbol table
-    Value* V = NamedValues[Name];
-    if (!V) 
-        LogErrorV("Unknown variable name.");
+Type* getLLVMType(LLVMContext &Ctx, ValueType Ty) {
+    switch (Ty) {
+        case ValueType::Double: return Type::getDoubleTy(Ctx);
+        case ValueType::F32: return Type::getFloatTy(Ctx);
+        case ValueType::I64: return Type::getInt64Ty(Ctx);
+        case ValueType::Bool: return Type::getInt1Ty(Ctx);
+        case ValueType::DoubleArray:
+        case ValueType::F32Array: return PointerType::get(Ctx, 0);
+    }
+    llvm_unreachable("unknown value type");
+}
+
+/*
+    Convert V to the type To. Numbers convert to each other implicitly: a
+    number is true if it's non-zero, and true is 1. Arrays don't convert to or
+    from anything.
+*/
+static Value* convertTo(CodegenSession &S, Value* V, Type* To) {
+    Type* From = V->getType();
+    if (From == To)
+        return V;
+    if (From->isPointerTy() || To->isPointerTy())
+        return LogErrorV("arrays can't be converted to or from numbers");
+
+    IRBuilder<> &B = *S.Builder;
+    if (To->isIntegerTy(1)) {
+        if (From->isFloatingPointTy())
+            return B.CreateFCmpONE(V, ConstantFP::get(From, 0.0), "tobool");
+        return B.CreateICmpNE(V, ConstantInt::get(From, 0), "tobool");
+    }
+    if (From->isIntegerTy(1))
+        return To->isFloatingPointTy() ? B.CreateUIToFP(V, To, "booltmp") : B.CreateZExt(V, To, "booltmp");
+    if (To->isFloatingPointTy())
+        return From->isFloatingPointTy() ? B.CreateFPCast(V, To, "fpcast") : B.CreateSIToFP(V, To, "itofp");
+    return B.CreateFPToSI(V, To, "fptoi");
+}
+
+// Record that V is an array of type Ty (its pointer type doesn't say what it holds).
+static Value* setArrayType(CodegenSession &S, Value* V, ValueType Ty) {
+    if (V && isArrayType(Ty))
+        S.ArrayValues[V] = Ty;
     return V;
 }
 
+/*
+    Convert V to the type To of an argument, variable or result. An array is
+    passed as it is, but only to an array of the same type: double* and f32*
+    are the same pointer type, so their element types are compared instead.
+*/
+static Value* convertTo(CodegenSession &S, Value* V, ValueType To) {
+    if (!isArrayType(To) || !V->getType()->isPointerTy())
+        return convertTo(S, V, getLLVMType(*S.TheContext, To));
+    auto I = S.ArrayValues.find(V);
+    if (I != S.ArrayValues.end() && I->second != To)
+        return LogErrorV(("expected " + getTypeName(To) + " but got " + getTypeName(I->second)).str().c_str());
+    return V;
+}
+
+/*
+    The type two numbers are combined in: the wider of their types, where
+    bool < i64 < f32 < double (bools are added and compared as i64). A double
+    constant, such as a literal, takes the type of an f32 operand, or of an i64
+    one if it's a whole number, so that `i + 1` stays an integer add and
+    `x * 0.5` a float multiply.
+*/
+static Type* getOperationType(Value* L, Value* R) {
+    auto Rank = [](Type* Ty) { return Ty->isDoubleTy() ? 3 : Ty->isFloatTy() ? 2 : Ty->isIntegerTy(64) ? 1 : 0; };
+    auto TakesType = [](Value* V, Type* Ty) {
+        auto* C = dyn_cast<ConstantFP>(V);
+        if (!C || !C->getType()->isDoubleTy())
+            return false;
+        return Ty->isFloatTy() || (Ty->isIntegerTy(64) && C->getValueAPF().isInteger());
+    };
+
+    Type* LTy = TakesType(L, R->getType()) ? R->getType() : L->getType();
+    Type* RTy = TakesType(R, L->getType()) ? L->getType() : R->getType();
+    Type* Ty = Rank(LTy) >= Rank(RTy) ? LTy : RTy;
+    return Ty->isIntegerTy(1) ? Type::getInt64Ty(Ty->getContext()) : Ty;
+}
+
+static FunctionType* getFunctionType(CodegenSession &S, const PrototypeAST &P);
+
+/*
+    Call F, the function Callee, with Args, converting each to the type of its
+    parameter. Its prototype says what type of array a pointer parameter (or
+    result) is, as long as it still has F's types.
+*/
+static Value* emitCall(CodegenSession &S, Function* F, SymbolID Callee, MutableArrayRef<Value*> Args,
+                       const Twine &Name) {
+    auto Proto = S.Protos.lookup(Callee);
+    if (Proto && getFunctionType(S, *Proto) != F->getFunctionType())
+        Proto = nullptr;
+    for (unsigned i = 0, e = Args.size(); i != e; ++i) {
+        Args[i] = Proto ? convertTo(S, Args[i], Proto->getArgTypes()[i])
+                        : convertTo(S, Args[i], F->getArg(i)->getType());
+        if (!Args[i])
+            return nullptr;
+    }
+    Value* Call = S.Builder->CreateCall(F, Args, Name);
+    return Proto ? setArrayType(S, Call, Proto->getReturnType()) : Call;
+}
+
+/*
+    Create the stack slot of the variable VarName (of type Ty): an alloca in
+    the entry block of TheFunction. Variables live in memory so that they can
+    be assigned, and SROA (mem2reg) promotes these allocas back to registers,
+    inserting the PHI nodes for us. It only promotes the allocas in the entry
+    block.
+*/
+static LocalVariable* CreateLocal(CodegenSession &S, Function* TheFunction, SymbolID VarName, ValueType Ty) {
+    IRBuilder<> TmpB(&TheFunction->getEntryBlock(), TheFunction->getEntryBlock().begin());
+    AllocaInst* Slot = TmpB.CreateAlloca(getLLVMType(*S.TheContext, Ty), nullptr, SymbolTable::get().getName(VarName));
+    return &S.Locals.emplace_back(LocalVariable{Slot, Ty});
+}
+
+/*
+    The host array bound to Name (with its type in Ty), if there is one: a
+    declaration of its first element, which the JIT links to the host's
+    memory, so its address is the array.
+*/
+static Constant* getHostArray(CodegenSession &S, SymbolID Name, ValueType &Ty) {
+    if (!S.HostArrays)
+        return nullptr;
+    std::optional<ValueType> Bound = S.HostArrays->lookup(Name);
+    if (!Bound)
+        return nullptr;
+    Ty = *Bound;
+    return S.TheModule->getOrInsertGlobal(SymbolTable::get().getName(Name),
+                                          getLLVMType(*S.TheContext, getElementType(Ty)));
+}
+
+Value* VariableExprAST::codegen(CodegenSession &S) {
+    // Look this variable up in the symbol table
+    LocalVariable* Var = S.NamedValues.lookup(Name);
+    if (!Var) {
+        // A host array, as a whole (to pass to a function)
+        ValueType Ty;
+        if (Constant* Array = getHostArray(S, Name, Ty))
+            return setArrayType(S, Array, Ty);
+        return LogErrorV("Unknown variable name.");
+    }
+
+    // Load the value.
+    Value* V = S.Builder->CreateLoad(Var->Slot->getAllocatedType(), Var->Slot, SymbolTable::get().getName(Name));
+    return setArrayType(S, V, Var->Type);
+}
+
+// The address of the array element E, and (in ElementTy) its type.
+static Value* emitElementAddress(CodegenSession &S, const IndexExprAST &E, Type* &ElementTy) {
+    // An array variable, or else a host array
+    LocalVariable* Var = S.NamedValues.lookup(E.getName());
+    ValueType Ty;
+    Constant* HostArray = nullptr;
+    if (Var)
+        Ty = Var->Type;
+    else if (!(HostArray = getHostArray(S, E.getName(), Ty)))
+        return LogErrorV("Unknown variable name.");
+    if (!isArrayType(Ty))
+        return LogErrorV("only arrays can be indexed");
+
+    Value* Index = E.getIndex()->codegen(S);
+    if (!Index)
+        return nullptr;
+    Index = convertTo(S, Index, S.Builder->getInt64Ty());
+    if (!Index)
+        return nullptr;
+
+    ElementTy = getLLVMType(*S.TheContext, getElementType(Ty));
+    Value* Array = HostArray;
+    if (Var)
+        Array = S.Builder->CreateLoad(Var->Slot->getAllocatedType(), Var->Slot, SymbolTable::get().getName(E.getName()));
+    return S.Builder->CreateInBoundsGEP(ElementTy, Array, Index, "eltaddr");
+}
+
+Value* IndexExprAST::codegen(CodegenSession &S) {
+    Type* ElementTy;
+    Value* Addr = emitElementAddress(S, *this, ElementTy);
+    if (!Addr)
+        return nullptr;
+    return S.Builder->CreateLoad(ElementTy, Addr, "elt");
+}
+
+/*
+    The built-in binary operators, indexed by their character. A null entry
+    means the operator is user defined, i.e. a call to its "binaryC" function.
+    Both operands have been converted to the type the operator computes in.
+*/
+using BinopEmitter = Value* (*)(IRBuilder<> &Builder, Value* L, Value* R);
+
+static const std::array<BinopEmitter, 256> BuiltinBinops = [] {
+    std::array<BinopEmitter, 256> Table{};
+    // Builder's Floating point (or integer) addition.
+    // The string "addtmp" is an optional string argument that provides a name for the resulting LLVM IR
+    Table['+'] = [](IRBuilder<> &B, Value* L, Value* R) {
+        return L->getType()->isFloatingPointTy() ? B.CreateFAdd(L, R, "addtmp") : B.CreateAdd(L, R, "addtmp");
+    };
+    // Builder's Floating point (or integer) subtraction
+    Table['-'] = [](IRBuilder<> &B, Value* L, Value* R) {
+        return L->getType()->isFloatingPointTy() ? B.CreateFSub(L, R, "subtmp") : B.CreateSub(L, R, "subtmp");
+    };
+    Table['*'] = [](IRBuilder<> &B, Value* L, Value* R) {
+        return L->getType()->isFloatingPointTy() ? B.CreateFMul(L, R, "multmp") : B.CreateMul(L, R, "multmp");
+    };
+    Table['/'] = [](IRBuilder<> &B, Value* L, Value* R) {
+        return L->getType()->isFloatingPointTy() ? B.CreateFDiv(L, R, "divtmp") : B.CreateSDiv(L, R, "divtmp");
+    };
+    // Comparisons give a bool
+    Table['<'] = [](IRBuilder<> &B, Value* L, Value* R) {
+        // ULT (Unordered or Less Than)
+        return L->getType()->isFloatingPointTy() ? B.CreateFCmpULT(L, R, "cmptmp") : B.CreateICmpSLT(L, R, "cmptmp");
+    };
+    Table['>'] = [](IRBuilder<> &B, Value* L, Value* R) {
+        // OGT (Ordered and Greater Than)
+        return L->getType()->isFloatingPointTy() ? B.CreateFCmpOGT(L, R, "cmptmp") : B.CreateICmpSGT(L, R, "cmptmp");
+    };
+    return Table;
+}();
+
 /*
     -- BinaryExprAST::codegen --
 
     The basic idea here is that we recursively emit code for the left-hand side of the 
     expression then the right-hand side, then we compute the result of the binary expression
 */
-Value* BinaryExprAST::codegen() {
-    Value* L = LHS->codegen();
-    Value* R = RHS->codegen();
+Value* BinaryExprAST::codegen(CodegenSession &S) {
+    // Assignment is special: the LHS is not an expression to emit, but the
+    // variable (or array element) to store to. It evaluates to the value
+    // assigned, converted to the type of the destination.
+    if (Op == '=') {
+        if (!isa<VariableExprAST>(LHS) && !isa<IndexExprAST>(LHS))
+            return LogErrorV("destination of '=' must be a variable or an array element");
+
+        Value* Val = RHS->codegen(S);
+        if (!Val)
+            return nullptr;
+
+        Value* Addr;
+        if (auto* LHSE = dyn_cast<VariableExprAST>(LHS)) {
+            LocalVariable* Variable = S.NamedValues.lookup(LHSE->getName());
+            if (!Variable)
+                return LogErrorV("Unknown variable name");
+            Addr = Variable->Slot;
+            Val = convertTo(S, Val, Variable->Type);
+        } else {
+            Type* Ty;
+            Addr = emitElementAddress(S, *cast<IndexExprAST>(LHS), Ty);
+            if (!Addr)
+                return nullptr;
+            Val = convertTo(S, Val, Ty);
+        }
+        if (!Val)
+            return nullptr;
+        S.Builder->CreateStore(Val, Addr);
+        return Val;
+    }
+
+    Value* L = LHS->codegen(S);
+    Value* R = RHS->codegen(S);
 
     if (!R || !L) return nullptr;
 
-    switch (Op) {
-        case '+': return Builder->CreateFAdd(L, R, "addtmp"); // Builder's Floating point addition. 
-        // The string "addtmp" is an optional string argument that provides a name for the resulting LLVM IR
-        case '-': return Builder->CreateFSub(L, R, "subtmp"); // Builder's Floating point subtraction
-        case '*': return Builder->CreateFMul(L, R, "multmp");
-        case '/': return Builder->CreateFDiv(L, R, "divtmp");
-        case '<': 
-            L = Builder->CreateFCmpULT(L, R, "cmptmp"); // ULT (Unordered or Less Than)
-            return Builder->CreateUIToFP(L, Type::getDoubleTy(*TheContext), "booltmp");
-        case '>':
-            L = Builder->CreateFCmpOGT(L, R, "cmptmp"); // UGT (Unordered or Greater Than)
-            return Builder->CreateUIToFP(L, Type::getDoubleTy(*TheContext), "booltmp");
-        default: 
-            break;
+    if (BinopEmitter Emit = BuiltinBinops[(unsigned char)Op]) {
+        if (L->getType()->isPointerTy() || R->getType()->isPointerTy())
+            return LogErrorV("arrays can only be indexed, assigned and passed to functions");
+        Type* Ty = getOperationType(L, R);
+        return Emit(*S.Builder, convertTo(S, L, Ty), convertTo(S, R, Ty));
     }
 
-    // IF it wasn't a builtin binary operator, it must be a user defined one
-    Function* F = getFunction(std::string("binary") + Op);
-    assert(F && "binary operator not found!\n");
+    // IF it wasn't a builtin binary operator, it must be a user defined one.
+    // Its function has a fixed symbol ID, so this is a lookup in the module's
+    // function table.
+    Function* F = S.getFunction(SymbolTable::getOperatorID(/*IsBinary*/ true, Op));
+    if (!F)
+        return LogErrorV("Unknown binary operator");
 
     Value* Ops[] = {L, R};
-    return Builder->CreateCall(F, Ops, "binop");
+    return emitCall(S, F, SymbolTable::getOperatorID(/*IsBinary*/ true, Op), Ops, "binop");
 }
 
-Value* UnaryExprAST::codegen() {
-    Value* OperandV = Operand->codegen();
+Value* UnaryExprAST::codegen(CodegenSession &S) {
+    Value* OperandV = Operand->codegen(S);
     if (!OperandV)
         return nullptr;
 
-    Function* F = getFunction(std::string("unary") + Opcode);
+    Function* F = S.getFunction(SymbolTable::getOperatorID(/*IsBinary*/ false, Opcode));
     if (!F)
         return LogErrorV("Unknown unary operator");
 
-    return Builder->CreateCall(F, OperandV, "unop");
+    return emitCall(S, F, SymbolTable::getOperatorID(/*IsBinary*/ false, Opcode), OperandV, "unop");
 }
 
-Value* CallExprAST::codegen() {
+Value* CallExprAST::codegen(CodegenSession &S) {
     // Look up the name in the global module table.
-    Function* CalleeF = getFunction(Callee);
+    Function* CalleeF = S.getFunction(Callee);
     if (!CalleeF)
         return LogErrorV("Unknown function referenced");
 
@@ -100,62 +420,189 @@ Value* CallExprAST::codegen() {
 
     std::vector<Value*> ArgsV;
     for (unsigned i = 0, e = Args.size(); i != e; ++i) {
-        ArgsV.push_back(Args[i]->codegen());
+        ArgsV.push_back(Args[i]->codegen(S));
         if (!ArgsV.back())
             return nullptr;
     }
-    return Builder->CreateCall(CalleeF, ArgsV, "calltmp");
+    return emitCall(S, CalleeF, Callee, ArgsV, "calltmp");
+}
+
+/*
+    Profile counters (see ExecutionProfile). A branch reserves its two
+    counters before either of its sides is generated, so that they stay
+    next to each other whatever branches the sides contain. A counter is
+    bumped at the start of the block it counts, with a plain load/add/store:
+    the counts are only for optimizing, so one lost to a race between threads
+    doesn't matter.
+*/
+static unsigned reserveCounters(CodegenSession &S, unsigned N) {
+    unsigned First = S.FnProfile.NumCounters;
+    S.FnProfile.NumCounters += N;
+    return First;
+}
+
+static void emitCounterIncrement(CodegenSession &S, unsigned Counter) {
+    if (!S.FnProfile.Counters)
+        return;
+    Type* Int64Ty = S.Builder->getInt64Ty();
+    Value* Addr = S.Builder->CreateConstInBoundsGEP1_64(Int64Ty, S.FnProfile.Counters, Counter);
+    Value* Count = S.Builder->CreateLoad(Int64Ty, Addr, "count");
+    S.Builder->CreateStore(S.Builder->CreateAdd(Count, S.Builder->getInt64(1)), Addr);
+}
+
+static void addProfiledBranch(CodegenSession &S, BranchInst* Br, unsigned Counter, bool IsLoop) {
+    if (S.Profile)
+        S.FnProfile.Branches.push_back({Br, Counter, IsLoop});
+}
+
+// Start the profile of a definition of Name, whose entry block is the insert point.
+static void beginFunctionProfile(CodegenSession &S, StringRef Name) {
+    ProfiledFunction &FP = S.FnProfile;
+    FP = ProfiledFunction();
+    if (!S.Profile)
+        return;
+
+    FP.Key = S.Profile->getNextKey(Name);
+    FP.Counts = S.Profile->lookup(FP.Key);
+    // The counters live in the host's memory, so only the JIT can instrument
+    if (S.Profile->isInstrumenting() && S.JIT) {
+        std::string Symbol = "__prof." + FP.Key;
+        std::replace(Symbol.begin(), Symbol.end(), ' ', '.');
+        FP.Counters = S.TheModule->getOrInsertGlobal(Symbol, S.Builder->getInt64Ty());
+    }
+    emitCounterIncrement(S, reserveCounters(S, 1));
+}
+
+// Branch weights take 32 bits, so counts are scaled down (keeping their ratio) to fit.
+static uint32_t scaleCount(uint64_t Count, uint64_t Scale) {
+    return (uint32_t)(Count / Scale);
 }
 
-Value* IfExprAST::codegen() {
-    Value* CondV = Cond->codegen();
+// Give the counters of the definition F to the JIT, and F the counts of the profile in use.
+static void finishFunctionProfile(CodegenSession &S, Function &F) {
+    ProfiledFunction &FP = S.FnProfile;
+    if (!S.Profile)
+        return;
+
+    if (FP.Counters) {
+        uint64_t* Values = S.Profile->allocateCounters(FP.Key, FP.NumCounters);
+        if (auto Err = S.JIT->defineAbsolute(FP.Counters->getName(),
+                                             ExecutorSymbolDef(ExecutorAddr::fromPtr(Values), JITSymbolFlags::Exported)))
+            logAllUnhandledErrors(std::move(Err), errs(), "Error: ");
+    }
+
+    // Counts of a different body (the script has changed) would be misleading
+    if (!FP.Counts || FP.Counts->size() != FP.NumCounters)
+        return;
+    const std::vector<uint64_t> &Counts = *FP.Counts;
+
+    uint64_t EntryCount = Counts[0];
+    F.setEntryCount(Function::ProfileCount(EntryCount, Function::PCT_Real));
+    if (S.Profile->isHot(EntryCount))
+        F.addFnAttr(Attribute::InlineHint);
+    else if (EntryCount == 0)
+        F.addFnAttr(Attribute::Cold);
+
+    MDBuilder MDB(*S.TheContext);
+    for (auto &B : FP.Branches) {
+        uint64_t First = Counts[B.Counter], Second = Counts[B.Counter + 1];
+        // Each time the loop is entered its body runs once before the latch
+        // is reached, so the latch branches back once less than that per exit.
+        if (B.IsLoop)
+            First = First > Second ? First - Second : 0;
+        uint64_t Scale = std::max(First, Second) / UINT32_MAX + 1;
+        B.Br->setMetadata(LLVMContext::MD_prof,
+                          MDB.createBranchWeights(scaleCount(First, Scale), scaleCount(Second, Scale)));
+    }
+}
+
+Value* IfExprAST::codegen(CodegenSession &S) {
+    Value* CondV = Cond->codegen(S);
     if (!CondV) 
         return nullptr;
 
     // Convert condition to a bool
-    CondV = Builder->CreateFCmpONE(CondV, ConstantFP::get(*TheContext, APFloat(0.0)), "ifcond");
+    CondV = convertTo(S, CondV, S.Builder->getInt1Ty());
+    if (!CondV)
+        return nullptr;
 
     // This code creates the basic blocks that are related to the if/then/else statement
-    Function* TheFunction = Builder->GetInsertBlock()->getParent();
+    Function* TheFunction = S.Builder->GetInsertBlock()->getParent();
 
-    BasicBlock* ThenBB = BasicBlock::Create(*TheContext, "then", TheFunction);
-    BasicBlock* ElseBB = BasicBlock::Create(*TheContext, "else");
-    BasicBlock* MergeBB = BasicBlock::Create(*TheContext, "ifcont");
+    BasicBlock* ThenBB = BasicBlock::Create(*S.TheContext, "then", TheFunction);
+    BasicBlock* ElseBB = BasicBlock::Create(*S.TheContext, "else");
+    BasicBlock* MergeBB = BasicBlock::Create(*S.TheContext, "ifcont");
 
-    Builder->CreateCondBr(CondV, ThenBB, ElseBB); // adding conditional branch
+    BranchInst* Br = S.Builder->CreateCondBr(CondV, ThenBB, ElseBB); // adding conditional branch
+    unsigned Counter = reserveCounters(S, 2);
+    addProfiledBranch(S, Br, Counter, /*IsLoop*/ false);
 
     // Emit then value
-    Builder->SetInsertPoint(ThenBB);
+    S.Builder->SetInsertPoint(ThenBB);
+    emitCounterIncrement(S, Counter);
 
-    Value* ThenV = Then->codegen();
+    Value* ThenV = Then->codegen(S);
     if (!ThenV)
         return nullptr;
     
-    Builder->CreateBr(MergeBB);
+    S.Builder->CreateBr(MergeBB);
     
     // Codegen of 'Then' can change the current block, update ThenBB for the PHI
-    ThenBB = Builder->GetInsertBlock();
+    ThenBB = S.Builder->GetInsertBlock();
 
     // Emit else block.
     TheFunction->insert(TheFunction->end(), ElseBB);
-    Builder->SetInsertPoint(ElseBB);
+    S.Builder->SetInsertPoint(ElseBB);
+    emitCounterIncrement(S, Counter + 1);
 
-    Value* ElseV = Else->codegen();
+    Value* ElseV = Else->codegen(S);
     if (!ElseV)
         return nullptr;
 
-    Builder->CreateBr(MergeBB);
+    S.Builder->CreateBr(MergeBB);
     // codegen of 'Else' can change the current block, update ElseBB for the PHI
-    ElseBB = Builder->GetInsertBlock();
+    ElseBB = S.Builder->GetInsertBlock();
+
+    // If the branches differ in type, convert both (at their ends) to the one
+    // they combine in.
+    Type* Ty = ThenV->getType();
+    if (Ty != ElseV->getType()) {
+        Ty = getOperationType(ThenV, ElseV);
+        S.Builder->SetInsertPoint(ThenBB->getTerminator());
+        ThenV = convertTo(S, ThenV, Ty);
+        S.Builder->SetInsertPoint(ElseBB->getTerminator());
+        ElseV = convertTo(S, ElseV, Ty);
+        if (!ThenV || !ElseV)
+            return nullptr;
+    }
 
     // Emit merge block
     TheFunction->insert(TheFunction->end(), MergeBB);
-    Builder->SetInsertPoint(MergeBB);
+    S.Builder->SetInsertPoint(MergeBB);
 
-    PHINode* PN = Builder->CreatePHI(Type::getDoubleTy(*TheContext), 2, "iftmp");
+    // Both arrays: of the same type, which the result is too
+    std::optional<ValueType> ArrayTy;
+    if (auto I = S.ArrayValues.find(ThenV); I != S.ArrayValues.end()) {
+        ArrayTy = I->second;
+        if (!convertTo(S, ElseV, *ArrayTy))
+            return nullptr;
+    }
+
+    PHINode* PN = S.Builder->CreatePHI(Ty, 2, "iftmp");
     PN->addIncoming(ThenV, ThenBB);
     PN->addIncoming(ElseV, ElseBB);
-    return PN;
+    return ArrayTy ? setArrayType(S, PN, *ArrayTy) : PN;
+}
+
+/*
+    The call to FunctionType::get creates the FunctionType that should be used for a given Prototype:
+    one LLVM type for each argument's type, and the return type.
+*/
+static FunctionType* getFunctionType(CodegenSession &S, const PrototypeAST &P) {
+    std::vector<Type*> ArgTys;
+    for (ValueType Ty : P.getArgTypes())
+        ArgTys.push_back(getLLVMType(*S.TheContext, Ty));
+    return FunctionType::get(getLLVMType(*S.TheContext, P.getReturnType()), ArgTys, false);
 }
 
 /*
@@ -165,20 +612,15 @@ Value* IfExprAST::codegen() {
     returns a “Function*” instead of a “Value*”. Because a “prototype” really talks 
     about the external interface for a function (not the value computed by an expression)
 */
-Function* PrototypeAST::codegen() {
-    /*
-        The call to FunctionType::get creates the FunctionType that should be used for a given Prototype. 
-        
-        Since all function arguments in Kaleidoscope are of type double, 
-        the first line creates a vector of “N” LLVM double types. It then uses 
-        the Functiontype::get method to create a function type that takes “N” 
-        doubles as arguments.
-    */
-    std::vector<Type*> Doubles(Args.size(), Type::getDoubleTy(*TheContext));
-    FunctionType* FT = FunctionType::get(Type::getDoubleTy(*TheContext), Doubles, false);
+Function* PrototypeAST::codegen(CodegenSession &S) const {
+    // Declared already (e.g. by an earlier extern or call in the same module)
+    if (Function* F = S.findFunction(NameID))
+        return F;
 
-    Function* F = Function::Create(FT, Function::ExternalLinkage, Name, TheModule.get());
+    FunctionType* FT = getFunctionType(S, *this);
+    Function* F = Function::Create(FT, Function::ExternalLinkage, Name, S.TheModule.get());
                                                                                // corresponding to the Prototype.
+    S.setFunction(NameID, F);
 
     // ExternalLinkage in the above line means that the function may be defined 
     // and/or that its callable by functions outside the module outside the current module
@@ -196,37 +638,69 @@ Function* PrototypeAST::codegen() {
 /*
     At this point we have a function prototype with no body. 
 */
-Function* FunctionAST::codegen() {
-    // Transfer ownership of the prototype to the FunctionProtos map, but keep a
-    // reference to it for use below.
+Function* FunctionAST::codegen(CodegenSession &S) {
+    // Register the prototype (unless told not to), so that other functions
+    // (and other sessions) can call this one.
     auto &P = *Proto;
-    FunctionProtos[Proto->getName()] = std::move(Proto);
-    Function* TheFunction = getFunction(P.getName());
+
+    // The calls already generated in this module to a declaration of it have
+    // the argument types of that declaration.
+    if (Function* Decl = S.findFunction(P.getNameID()))
+        if (Decl->getFunctionType() != getFunctionType(S, P)) {
+            LogErrorV("definition doesn't match the types of the function's earlier declaration");
+            return nullptr;
+        }
+
+    if (S.RegisterDefinitions)
+        S.Protos.add(Proto);
+    Function* TheFunction = S.RegisterDefinitions ? S.getFunction(P.getNameID()) : P.codegen(S);
     if (!TheFunction)
         return nullptr;
 
-    // If this is an operator, install it.
-    if (P.isBinaryOp())
-        BinopPrecedence[P.getOperatorName()] = P.getBinaryPrecedence();
-
     // Create a new basic block to start insertion into.
-    BasicBlock* BB = BasicBlock::Create(*TheContext, "entry", TheFunction);
-    Builder->SetInsertPoint(BB);
+    BasicBlock* BB = BasicBlock::Create(*S.TheContext, "entry", TheFunction);
+    S.Builder->SetInsertPoint(BB);
+    beginFunctionProfile(S, P.getName());
+
+    // Record the function arguments in the NamedValues map, each in a stack
+    // slot of its own so that it can be assigned.
+    S.NamedValues.clear();
+    S.Locals.clear();
+    S.ArrayValues.clear();
+    for (auto [Arg, ID, Ty] : zip(TheFunction->args(), P.getArgIDs(), P.getArgTypes())) {
+        LocalVariable* Var = CreateLocal(S, TheFunction, ID, Ty);
+        S.Builder->CreateStore(&Arg, Var->Slot);
+        S.NamedValues.push(ID, Var);
+    }
+
+    // Operator bodies are usually tiny, and called like instructions
+    if (P.isUnaryOp() || P.isBinaryOp())
+        TheFunction->addFnAttr(Attribute::InlineHint);
 
-    // Record the function arguments in the NamedValues map.
-    NamedValues.clear();
-    for (auto &Arg : TheFunction->args())
-        NamedValues[std::string(Arg.getName())] = &Arg;
+    // The body's value, as the function's return type.
+    Value* RetVal = Body->codegen(S);
+    if (RetVal)
+        RetVal = convertTo(S, RetVal, P.getReturnType());
+
+    if (RetVal) {
+        // A call whose result is returned is a tail call. Nothing of the
+        // caller's stack (the allocas of its variables) is ever passed to a
+        // callee, so it can always be marked as one.
+        if (auto* CI = dyn_cast<CallInst>(RetVal))
+            CI->setTailCall();
 
-    if (Value* RetVal = Body->codegen()) {
         // Finish off the function.
-        Builder->CreateRet(RetVal);
+        S.Builder->CreateRet(RetVal);
+        finishFunctionProfile(S, *TheFunction);
 
         // Validate the generated code, checking for consistency.
         verifyFunction(*TheFunction);
 
         // Run the optimizer on the function.
-        TheFPM->run(*TheFunction, *TheFAM);
+        {
+            PhaseTimer T(S.Stats, Phase::Optimize);
+            S.Pipeline.run(*TheFunction);
+        }
 
         return TheFunction;
     }
@@ -239,67 +713,201 @@ Function* FunctionAST::codegen() {
     with a body, preventing future redefinition.
 */
 
-    // Error reading body, remove function.
-    TheFunction->eraseFromParent();
-
-    if (P.isBinaryOp())
-        BinopPrecedence.erase(P.getOperatorName());
+    // Error reading body, remove function. Unless other definitions of the
+    // module call it (after an extern, or with several definitions per
+    // module): then it goes back to being the declaration they call.
+    if (TheFunction->use_empty()) {
+        TheFunction->eraseFromParent();
+        S.setFunction(P.getNameID(), nullptr);
+    } else {
+        TheFunction->deleteBody();
+    }
     return nullptr;
 }
 
-Value* ForExprAST::codegen() {
-    Value* StartVal = Start->codegen();
+Value* ForExprAST::codegen(CodegenSession &S) {
+    Function* TheFunction = S.Builder->GetInsertBlock()->getParent();
+
+    // Create an alloca for the variable in the entry block.
+    LocalVariable* Var = CreateLocal(S, TheFunction, VarName, VarType);
+    Type* VarTy = Var->Slot->getAllocatedType();
+
+    // Emit the start code first, without 'variable' in scope.
+    Value* StartVal = Start->codegen(S);
     if (!StartVal) return nullptr;
+    StartVal = convertTo(S, StartVal, VarTy);
+    if (!StartVal) return nullptr;
+
+    // Store the value into the alloca.
+    S.Builder->CreateStore(StartVal, Var->Slot);
 
     // Make new basic block for the loop header, inserting after current block
-    Function* TheFunction = Builder->GetInsertBlock()->getParent();
-    BasicBlock* PreheaderBB = Builder->GetInsertBlock();
-    BasicBlock* LoopBB = BasicBlock::Create(*TheContext, "loop", TheFunction);
+    BasicBlock* LoopBB = BasicBlock::Create(*S.TheContext, "loop", TheFunction);
 
     // Insert an explicit fall through from the current block to LoopBB
-    Builder->CreateBr(LoopBB);
+    S.Builder->CreateBr(LoopBB);
+    S.Builder->SetInsertPoint(LoopBB);
+    unsigned Counter = reserveCounters(S, 2);
+    emitCounterIncrement(S, Counter);
 
-    Builder->SetInsertPoint(LoopBB);
-    PHINode* Variable = Builder->CreatePHI(Type::getDoubleTy(*TheContext), 2, VarName);
-    Variable->addIncoming(StartVal, PreheaderBB);
+    // Within the loop, the variable refers to the alloca. If it shadows an
+    // existing variable, that comes back once the loop is done.
+    size_t Scope = S.NamedValues.mark();
+    S.NamedValues.push(VarName, Var);
 
-    Value* OldVal = NamedValues[VarName];
-    NamedValues[VarName] = Variable;
-
-    if (!Body->codegen()) return nullptr;
+    if (!Body->codegen(S)) return nullptr;
 
     Value* StepVal = nullptr;
     if (Step) {
-        StepVal = Step->codegen();
+        StepVal = Step->codegen(S);
         if (!StepVal) return nullptr;
-    } else StepVal = ConstantFP::get(*TheContext, APFloat(1.0)); // default to 1.0
-
-    Value* NextVar = Builder->CreateFAdd(Variable, StepVal, "nextvar");
+    } else StepVal = ConstantFP::get(*S.TheContext, APFloat(1.0)); // default to 1.0
+    StepVal = convertTo(S, StepVal, VarTy);
+    if (!StepVal) return nullptr;
 
-    // Compute end condition    
-    Value* EndCond = End->codegen();
+    // Compute end condition, as a bool
+    Value* EndCond = End->codegen(S);
+    if (!EndCond) return nullptr;
+    EndCond = convertTo(S, EndCond, S.Builder->getInt1Ty());
     if (!EndCond) return nullptr;
 
-    // Convert condition to a bool by comparing non-equal to 0.0
-    EndCond = Builder->CreateFCmpONE(EndCond, ConstantFP::get(*TheContext, APFloat(0.0)), "loopcond");
+    // Reload, increment, and restore the alloca. This handles the case where
+    // the body of the loop mutates the variable.
+    Value* CurVar = S.Builder->CreateLoad(VarTy, Var->Slot, SymbolTable::get().getName(VarName));
+    Value* NextVar = VarTy->isFloatingPointTy() ? S.Builder->CreateFAdd(CurVar, StepVal, "nextvar")
+                                                : S.Builder->CreateAdd(CurVar, StepVal, "nextvar");
+    S.Builder->CreateStore(NextVar, Var->Slot);
     
     // Create the 'after loop' block and inset it
-    BasicBlock* LoopEndBB = Builder->GetInsertBlock();
-    BasicBlock* AfterBB = BasicBlock::Create(*TheContext, "afterloop", TheFunction);
+    BasicBlock* AfterBB = BasicBlock::Create(*S.TheContext, "afterloop", TheFunction);
 
-    // Insert the conditional branch into the end of LoopEndBB
-    Builder->CreateCondBr(EndCond, LoopBB, AfterBB);
+    // Insert the conditional branch into the end of the loop
+    BranchInst* Br = S.Builder->CreateCondBr(EndCond, LoopBB, AfterBB);
+    addProfiledBranch(S, Br, Counter, /*IsLoop*/ true);
     
     // Any new code will be inserted in AfterBB
-    Builder->SetInsertPoint(AfterBB);
+    S.Builder->SetInsertPoint(AfterBB);
+    emitCounterIncrement(S, Counter + 1);
 
-    // Add a new entry to the PHI node for the backedge
-    Variable->addIncoming(NextVar, LoopEndBB);
     // restore the unshadowed variable
-    if (OldVal) NamedValues[VarName] = OldVal;
-    else NamedValues.erase(VarName);
+    S.NamedValues.popTo(Scope);
 
     // for expr always returns 0.0
-    return Constant::getNullValue(Type::getDoubleTy(*TheContext));
+    return Constant::getNullValue(Type::getDoubleTy(*S.TheContext));
+}
+
+/*
+    -- VarExprAST::codegen --
+
+    Each variable gets an entry block alloca, initialized before it comes into
+    scope, so that "var a = 1, b = a in ..." refers to an outer 'a' in the
+    initializer of 'b' (like the for loop's start value). Loop-carried values
+    such as accumulators are plain variables assigned in the loop body:
+
+        def sum(n) var acc = 0 in (for i = 0, i < n in acc = acc + i) + acc
+
+    With types, over the n > 0 elements of an array the caller provides (the
+    condition is tested after the body, so the last i it runs for is n - 1):
+
+        def total(a:f32* n:i64):f32
+            var acc:f32 in (for i:i64 = 0, i < n - 1 in acc = acc + a[i]) + acc
+*/
+Value* VarExprAST::codegen(CodegenSession &S) {
+    Function* TheFunction = S.Builder->GetInsertBlock()->getParent();
+    size_t Scope = S.NamedValues.mark();
+
+    for (auto &Var : Vars) {
+        // Emit the initializer before adding the variable to scope, this
+        // prevents the initializer from referencing the variable itself.
+        Type* Ty = getLLVMType(*S.TheContext, Var.Type);
+        Value* InitVal = Var.Init ? Var.Init->codegen(S) : Constant::getNullValue(Ty);
+        if (InitVal)
+            InitVal = convertTo(S, InitVal, Var.Type);
+        if (!InitVal) {
+            S.NamedValues.popTo(Scope);
+            return nullptr;
+        }
+
+        LocalVariable* Local = CreateLocal(S, TheFunction, Var.Name, Var.Type);
+        S.Builder->CreateStore(InitVal, Local->Slot);
+        S.NamedValues.push(Var.Name, Local);
+    }
+
+    // Codegen the body, now that all vars are in scope.
+    Value* BodyVal = Body->codegen(S);
+
+    // Pop all our variables from scope.
+    S.NamedValues.popTo(Scope);
+    return BodyVal;
 }
 
+
+Function* emitBatchWrapper(CodegenSession &S, Function &F) {
+    IRBuilder<> &Builder = *S.Builder;
+    Type* PtrTy = Builder.getPtrTy();
+    Type* SizeTy = S.TheModule->getDataLayout().getIntPtrType(*S.TheContext);
+    unsigned NumInputs = F.arg_size();
+
+    // Each element is one argument (or the result), so those can't be arrays
+    auto IsArray = [](Argument &Arg) { return Arg.getType()->isPointerTy(); };
+    if (F.getReturnType()->isPointerTy() || any_of(F.args(), IsArray)) {
+        LogError("functions taking or returning arrays can't have a batch wrapper");
+        return nullptr;
+    }
+
+    SmallVector<Type*, 8> ParamTys(NumInputs + 1, PtrTy);
+    ParamTys.push_back(SizeTy);
+    FunctionType* BatchTy = FunctionType::get(Builder.getVoidTy(), ParamTys, false);
+    Function* Batch = Function::Create(BatchTy, Function::ExternalLinkage, F.getName() + "_batch", S.TheModule.get());
+
+    // The arrays don't overlap, so the vectorizer needs no runtime checks
+    for (unsigned Idx = 0; Idx != NumInputs + 1; ++Idx) {
+        Batch->addParamAttr(Idx, Attribute::NoAlias);
+        Batch->addParamAttr(Idx, Attribute::NoCapture);
+        if (Idx != NumInputs)
+            Batch->addParamAttr(Idx, Attribute::ReadOnly);
+    }
+    Argument* Out = Batch->getArg(NumInputs);
+    Argument* N = Batch->getArg(NumInputs + 1);
+    Out->setName("out");
+    N->setName("n");
+
+    BasicBlock* EntryBB = BasicBlock::Create(*S.TheContext, "entry", Batch);
+    BasicBlock* LoopBB = BasicBlock::Create(*S.TheContext, "loop", Batch);
+    BasicBlock* ExitBB = BasicBlock::Create(*S.TheContext, "exit", Batch);
+
+    Builder.SetInsertPoint(EntryBB);
+    Builder.CreateCondBr(Builder.CreateICmpEQ(N, ConstantInt::get(SizeTy, 0), "empty"), ExitBB, LoopBB);
+
+    // for (I = 0; I != N; ++I) Out[I] = F(In0[I], ...)
+    Builder.SetInsertPoint(LoopBB);
+    PHINode* I = Builder.CreatePHI(SizeTy, 2, "i");
+    I->addIncoming(ConstantInt::get(SizeTy, 0), EntryBB);
+
+    SmallVector<Value*, 8> Args;
+    for (unsigned Idx = 0; Idx != NumInputs; ++Idx) {
+        Argument* In = Batch->getArg(Idx);
+        In->setName("in" + Twine(Idx));
+        Type* InTy = F.getArg(Idx)->getType();
+        Value* Addr = Builder.CreateInBoundsGEP(InTy, In, I);
+        Args.push_back(Builder.CreateLoad(InTy, Addr));
+    }
+    CallInst* Call = Builder.CreateCall(&F, Args, "result");
+    Builder.CreateStore(Call, Builder.CreateInBoundsGEP(F.getReturnType(), Out, I));
+
+    Value* Next = Builder.CreateAdd(I, ConstantInt::get(SizeTy, 1), "i.next", /*HasNUW*/ true);
+    I->addIncoming(Next, LoopBB);
+    Builder.CreateCondBr(Builder.CreateICmpEQ(Next, N, "done"), ExitBB, LoopBB);
+
+    Builder.SetInsertPoint(ExitBB);
+    Builder.CreateRetVoid();
+
+    // Put the body in the loop; calls it makes itself are left alone
+    InlineFunctionInfo IFI;
+    InlineFunction(*Call, IFI);
+
+    verifyFunction(*Batch);
+    PhaseTimer T(S.Stats, Phase::Optimize);
+    S.Pipeline.run(*Batch);
+    return Batch;
+}
@@ -1,25 +1,278 @@
-#include "../headers/TopLevel.h"
+#include "../headers/AOT.h"
+#include "../headers/lib.h"
+#include "llvm/Support/CommandLine.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/ToolOutputFile.h"
+
+#include <algorithm>
+#include <chrono>
+#include <thread>
+
+//===----------------------------------------------------------------------===//
+// Command line options.
+//===----------------------------------------------------------------------===//
+
+static cl::list<std::string> InputFilenames(cl::Positional,
+    cl::desc("<input files> (default: read stdin)"));
+
+static cl::opt<std::string> OutputFilename("o",
+    cl::desc("Compile the input ahead of time into this object file, or static library if it ends in .a, "
+             "instead of running it"),
+    cl::value_desc("file"), cl::init(""));
+
+static cl::opt<std::string> HeaderFilename("emit-header",
+    cl::desc("With -o, also write a C header declaring the compiled functions"),
+    cl::value_desc("file"), cl::init(""));
+
+static cl::opt<unsigned> CompileJobs("j",
+    cl::desc("Number of input files compiled in parallel (default = number of cores)"),
+    cl::Prefix, cl::init(0));
+
+static cl::opt<char> OptLevel("O",
+    cl::desc("Optimization level. [-O0, -O1, -O2, or -O3] (default = '-O1')"),
+    cl::Prefix, cl::init('1'));
+
+static cl::opt<bool> HostCPU("host-cpu",
+    cl::desc("Generate code for the host CPU and its features instead of the generic target"),
+    cl::init(false));
+
+static cl::opt<bool> FastMath("ffast-math",
+    cl::desc("Put fast-math flags on all floating point operations (allows reassociation and FMA contraction)"),
+    cl::init(false));
+
+static cl::opt<bool> LazyCompile("lazy",
+    cl::desc("Compile each function body on its first call instead of when its definition is read"),
+    cl::init(false));
+
+static cl::opt<unsigned> JITThreads("jit-threads",
+    cl::desc("Number of threads compiling definitions in the background (0 = compile on the REPL thread)"),
+    cl::init(0));
+
+static cl::opt<std::string> ObjectCacheDir("object-cache-dir",
+    cl::desc("Directory in which compiled objects are cached across runs"),
+    cl::value_desc("dir"), cl::init(""));
+
+static cl::opt<unsigned> DefsPerModuleOpt("defs-per-module",
+    cl::desc("Number of definitions collected into one module before it is handed to the JIT (0 = no limit)"),
+    cl::init(1));
+
+static cl::opt<bool> LogPasses("log-passes",
+    cl::desc("Print every optimization pass execution to stderr"),
+    cl::init(false));
+
+static cl::opt<std::string> TimePassesJSON("time-passes-json",
+    cl::desc("Write per-pass wall time and run counts for the session as JSON at exit ('-' for stdout)"),
+    cl::value_desc("file"), cl::init(""));
+
+static cl::opt<bool> Tiered("tiered",
+    cl::desc("Compile definitions unoptimized first and recompile hot functions at -O3 in the background"),
+    cl::init(false));
+
+static cl::opt<unsigned> TierUpThreshold("tier-up-threshold",
+    cl::desc("Number of calls after which a function is recompiled at -O3 (with -tiered)"),
+    cl::init(1000));
+
+static cl::list<std::string> BatchFunctions("batch",
+    cl::desc("Also generate NAME_batch(const double* in..., double* out, size_t n) for these functions, "
+             "which maps NAME over arrays in a vectorizable loop (best with -O2 or -O3)"),
+    cl::value_desc("name,..."), cl::CommaSeparated);
+
+static cl::opt<bool> NoProcessSymbols("no-process-symbols",
+    cl::desc("Only let externs resolve to the library functions (putchard, printd), not to any symbol of the process"),
+    cl::init(false));
+
+static cl::opt<bool> UseJITLink("jitlink",
+    cl::desc("Link JIT'd objects with JITLink, allocating them from shared slabs, instead of RuntimeDyld"),
+    cl::init(false));
+
+static cl::opt<bool> PerfMap("perf-map",
+    cl::desc("Write the JIT'd functions to /tmp/perf-<pid>.map so that perf can name them"),
+    cl::init(false));
+
+static cl::opt<bool> ReportJITStats("jit-stats",
+    cl::desc("Print JIT compilation statistics at exit"),
+    cl::init(false));
+
+static cl::opt<bool> Quiet("quiet",
+    cl::desc("Run the input files in order without prompts or IR dumps, writing the result of each top-level "
+             "expression to stdout; exits with 1 if any had errors"),
+    cl::init(false));
+
+static cl::opt<bool> PrintIR("print-ir",
+    cl::desc("With -quiet, still print each function's IR as it's compiled"),
+    cl::init(false));
+
+static cl::opt<bool> DumpModules("dump-module",
+    cl::desc("Print each module's optimized IR as it's handed to the JIT (with -quiet, and unless "
+             "-defs-per-module is given, definitions are collected until an expression or the end of input needs them)"),
+    cl::init(false));
+
+static cl::opt<bool> Watch("watch",
+    cl::desc("Run the input file, then run it again whenever it changes, recompiling only the definitions that "
+             "changed and those that depend on them"),
+    cl::init(false));
+
+static cl::opt<std::string> ProfileGenerate("profile-generate",
+    cl::desc("Count the executions of every definition's entry and branches, and write them to this file at exit"),
+    cl::value_desc("file"), cl::init(""));
+
+static cl::opt<std::string> ProfileUse("profile-use",
+    cl::desc("Optimize the definitions (branch weights, block layout and inlining) with the counts of a profile "
+             "written by -profile-generate for the same input"),
+    cl::value_desc("file"), cl::init(""));
+
+static cl::opt<bool> ReportPhaseStats("phase-stats",
+    cl::desc("Time the parse, IR generation, optimization, JIT, lookup, execution and removal of every top-level "
+             "item, and print a summary (p50/p99 and histograms) at exit"),
+    cl::init(false));
 
 //===----------------------------------------------------------------------===//
 // Main driver code.
 //===----------------------------------------------------------------------===//
 
-int main() {
-    InitializeNativeTarget();
-    InitializeNativeTargetAsmPrinter();
-    InitializeNativeTargetAsmParser();
+// Reload Filename into E each time its modification time changes, until killed.
+static void watchFile(Engine &E, const std::string &Filename) {
+    sys::TimePoint<> LastModified;
+    while (true) {
+        sys::fs::file_status Status;
+        if (auto EC = sys::fs::status(Filename, Status)) {
+            fprintf(stderr, "Error: %s: %s\n", Filename.c_str(), EC.message().c_str());
+        } else if (Status.getLastModificationTime() != LastModified) {
+            LastModified = Status.getLastModificationTime();
+            auto Buffer = MemoryBuffer::getFile(Filename, /*IsText*/ true);
+            if (!Buffer) {
+                fprintf(stderr, "Error: %s: %s\n", Filename.c_str(), Buffer.getError().message().c_str());
+            } else {
+                auto Start = std::chrono::steady_clock::now();
+                auto Stats = E.reload((*Buffer)->getBuffer(), &outs());
+                outs().flush();
+                double MS = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - Start).count();
+                if (Stats)
+                    fprintf(stderr, "Reloaded %s in %.1f ms: recompiled %u of %u definitions\n", Filename.c_str(),
+                            MS, Stats->Recompiled, Stats->Definitions);
+                else
+                    logAllUnhandledErrors(Stats.takeError(), errs(), Filename + ": ");
+            }
+        }
+        std::this_thread::sleep_for(std::chrono::milliseconds(100));
+    }
+}
+
+int main(int argc, char **argv) {
+    cl::ParseCommandLineOptions(argc, argv, "Kaleidoscope JIT\n");
+    if (OptLevel < '0' || OptLevel > '3') {
+        fprintf(stderr, "Error: invalid optimization level -O%c\n", (char)OptLevel);
+        return 1;
+    }
+
+    EngineOptions Opts;
+    Opts.OptLevel = OptLevel - '0';
+    Opts.HostCPU = HostCPU;
+    Opts.FastMath = FastMath;
+    Opts.LazyCompile = LazyCompile;
+    Opts.JITThreads = JITThreads;
+    Opts.ObjectCacheDir = ObjectCacheDir;
+    Opts.DefsPerModule = DefsPerModuleOpt;
+    Opts.Tiered = Tiered;
+    Opts.TierUpThreshold = TierUpThreshold;
+    Opts.LogPasses = LogPasses;
+    Opts.TimePasses = !TimePassesJSON.empty();
+    Opts.BatchFunctions.assign(BatchFunctions.begin(), BatchFunctions.end());
+    Opts.SearchProcessSymbols = !NoProcessSymbols;
+    Opts.JITLink = UseJITLink;
+    Opts.PerfMap = PerfMap;
+    Opts.CollectPhaseStats = ReportPhaseStats;
+    Opts.PrintIR = PrintIR;
+    Opts.DumpModules = DumpModules;
+    Opts.ProfileInstrument = !ProfileGenerate.empty();
+    Opts.ProfileUse = ProfileUse;
+    // So that a script's definitions are dumped in one module, rather than one module per function
+    if (Quiet && DumpModules && !DefsPerModuleOpt.getNumOccurrences())
+        Opts.DefsPerModule = 0;
+
+    if (!OutputFilename.empty()) {
+        std::unique_ptr<AOTCompiler> C = ExitOnErr(AOTCompiler::create(Opts));
+        if (InputFilenames.empty())
+            ExitOnErr(C->addFile("-"));
+        for (auto &Filename : InputFilenames)
+            ExitOnErr(C->addFile(Filename));
+        ExitOnErr(C->writeObject(OutputFilename));
+        if (!HeaderFilename.empty())
+            ExitOnErr(C->writeHeader(HeaderFilename));
+        return 0;
+    }
+
+    // Several input files are compiled in parallel, each worker thread with its
+    // own optimizer (and target machine, which the passes query).
+    if (InputFilenames.size() > 1 && !Quiet) {
+        unsigned NumWorkers = CompileJobs ? CompileJobs : std::thread::hardware_concurrency();
+        Opts.NumWorkers = std::clamp<unsigned>(NumWorkers, 1, InputFilenames.size());
+    }
+
+    std::unique_ptr<Engine> E = ExitOnErr(Engine::create(Opts));
+    ExitOnErr(E->bindFunction("putchard", putchard));
+    ExitOnErr(E->bindFunction("printd", printd));
+
+    int ExitCode = 0;
+    if (Watch) {
+        if (InputFilenames.size() != 1) {
+            fprintf(stderr, "Error: -watch takes one input file\n");
+            return 1;
+        }
+        watchFile(*E, InputFilenames[0]);
+    } else if (Quiet) {
+        std::vector<std::string> Filenames(InputFilenames.begin(), InputFilenames.end());
+        if (Filenames.empty())
+            Filenames.push_back("-");
+
+        // Results go to stdout, which (unlike stderr) is buffered
+        for (auto &Filename : Filenames) {
+            std::unique_ptr<Lexer> Lex = ExitOnErr(Lexer::open(Filename));
+            if (auto Err = E->runBatch(*Lex, outs())) {
+                logAllUnhandledErrors(std::move(Err), errs(), Filename + ": ");
+                ExitCode = 1;
+            }
+        }
+        outs().flush();
+    } else if (InputFilenames.size() > 1) {
+        if (!E->runFiles(InputFilenames))
+            ExitCode = 1;
+    } else {
+        std::unique_ptr<Lexer> Lex = ExitOnErr(Lexer::open(InputFilenames.empty() ? "-" : InputFilenames[0]));
+        ExitOnErr(E->runREPL(*Lex));
+    }
+
+    if (ReportJITStats) {
+        CompileStats Stats = E->getCompileStats();
+        fprintf(stderr, "Compiled %u functions eagerly, %u lazily\n",
+                Stats.EagerFunctions, Stats.LazyFunctions);
+        if (!ObjectCacheDir.empty())
+            fprintf(stderr, "Object cache: %u hits, %u misses\n",
+                    Stats.ObjectCacheHits, Stats.ObjectCacheMisses);
+        if (Tiered)
+            fprintf(stderr, "Recompiled %u hot functions at -O3\n", E->getNumPromoted());
+        MemoryStats Memory = E->getMemoryStats();
+        fprintf(stderr, "JIT memory: %llu code bytes, %llu data bytes in %u objects, %u module trackers\n",
+                (unsigned long long)Memory.CodeBytes, (unsigned long long)Memory.DataBytes, Memory.Objects,
+                Memory.Trackers);
+    }
 
-    // Prime the first token.
-    fprintf(stderr, "ready> ");
-    getNextToken();
+    if (!ProfileGenerate.empty())
+        ExitOnErr(E->writeProfile(ProfileGenerate));
 
-    TheJIT = ExitOnErr(KaleidoscopeJIT::Create());
-    
-    // Make the module which holds all the code
-    InitializeModuleAndManagers();
+    if (ReportPhaseStats)
+        E->getPhaseStats().print(errs(), E->getMemoryStats());
 
-    // Run the main "interpreter loop" now.
-    MainLoop();
+    if (!TimePassesJSON.empty()) {
+        std::error_code EC;
+        ToolOutputFile Out(TimePassesJSON, EC, sys::fs::OF_Text);
+        if (EC) {
+            fprintf(stderr, "Error: could not open %s: %s\n", TimePassesJSON.c_str(), EC.message().c_str());
+            return 1;
+        }
+        E->getPassTimings().printJSON(Out.os());
+        Out.keep();
+    }
 
-    return 0;
-}
\ No newline at end of file
+    return ExitCode;
+}
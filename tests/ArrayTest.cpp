@@ -0,0 +1,84 @@
+#include "../headers/Engine.h"
+
+#include <cstdio>
+#include <vector>
+
+/*
+    Typed arrays through JIT'd code: reading and storing elements of buffers
+    the host passes in, and rejecting an array of one element type where the
+    other is expected (double* and f32* are the same LLVM pointer type, so
+    only the ValueTypes tell them apart).
+
+    Exits with 1 if a check fails.
+*/
+
+static unsigned NumFailures = 0;
+
+static void check(bool Cond, const char* What) {
+    if (!Cond) {
+        fprintf(stderr, "FAILED: %s\n", What);
+        ++NumFailures;
+    }
+}
+
+// Source that must fail to compile (its errors go to stderr).
+static void checkRejected(Engine &E, StringRef Source, const char* What) {
+    Error Err = E.compile(Source);
+    check((bool)Err, What);
+    consumeError(std::move(Err));
+}
+
+template <typename FnTy>
+static FnTy* lookupFn(Engine &E, StringRef Name) {
+    auto Addr = E.lookup(Name);
+    if (!Addr) {
+        logAllUnhandledErrors(Addr.takeError(), errs(), "Error: ");
+        return nullptr;
+    }
+    return Addr->toPtr<FnTy*>();
+}
+
+int main() {
+    auto E = Engine::create();
+    if (!E) {
+        logAllUnhandledErrors(E.takeError(), errs(), "Error: ");
+        return 1;
+    }
+
+    if (auto Err = (*E)->compile(R"(
+        def get(a:double* i:i64) a[i];
+        def put(a:f32* i:i64 v:f32):f32 a[i] = v;
+        def total(a:f32* n:i64):f32
+            var acc:f32 in (for i:i64 = 0, i < n - 1 in acc = acc + a[i]) + acc;
+        def first(a:double*) get(a, 0);
+    )")) {
+        logAllUnhandledErrors(std::move(Err), errs(), "Error: ");
+        return 1;
+    }
+
+    auto* Get = lookupFn<double(const double*, int64_t)>(**E, "get");
+    auto* Put = lookupFn<float(float*, int64_t, float)>(**E, "put");
+    auto* Total = lookupFn<float(const float*, int64_t)>(**E, "total");
+    auto* First = lookupFn<double(const double*)>(**E, "first");
+    if (!Get || !Put || !Total || !First)
+        return 1;
+
+    std::vector<double> Doubles = {1.5, 2.5, 3.5};
+    check(Get(Doubles.data(), 2) == 3.5, "get reads a[i]");
+    check(First(Doubles.data()) == 1.5, "an array passed on to another function");
+
+    // Guarded by elements that total must not read
+    std::vector<float> Floats = {100, 0, 0, 0, 0, 100};
+    for (int64_t I = 0; I != 4; ++I)
+        check(Put(Floats.data() + 1, I, (float)I + 1) == (float)I + 1, "put returns the value stored");
+    check(Floats[1] == 1 && Floats[4] == 4, "put stores a[i]");
+    check(Total(Floats.data() + 1, 4) == 10, "total sums exactly a[0] to a[n - 1]");
+
+    checkRejected(**E, "def f(a:f32*) a[0]; def g(b:double*) f(b);", "a double* passed for an f32*");
+    checkRejected(**E, "def h(b:double*) var c:f32* = b in c[0];", "a double* bound to an f32* variable");
+    checkRejected(**E, "def k(b:double*):f32* b;", "a double* returned as an f32*");
+    checkRejected(**E, "def m(a:double* b:f32* c:bool) first(if c then a else b);",
+                  "an if whose branches are arrays of different types");
+
+    return NumFailures ? 1 : 0;
+}
@@ -0,0 +1,51 @@
+#include "../headers/Engine.h"
+
+#include <cstdio>
+
+/*
+    A definition whose body fails to compile, in a module where another
+    definition already calls it (through an extern before it): the call must
+    keep a declaration to refer to, and a later, correct definition must be
+    what it ends up calling.
+
+    Exits with 1 if a check fails.
+*/
+
+static unsigned NumFailures = 0;
+
+static void check(bool Cond, const char* What) {
+    if (!Cond) {
+        fprintf(stderr, "FAILED: %s\n", What);
+        ++NumFailures;
+    }
+}
+
+int main() {
+    // All the definitions of a compile() in one module
+    EngineOptions Opts;
+    Opts.DefsPerModule = 0;
+    auto E = Engine::create(Opts);
+    if (!E) {
+        logAllUnhandledErrors(E.takeError(), errs(), "Error: ");
+        return 1;
+    }
+
+    // 'y' is unknown, so f's body fails after g has called f
+    Error Err = (*E)->compile("extern f(x); def g(x) f(x) + 1; def f(x) y;");
+    check((bool)Err, "a body with an unknown variable is rejected");
+    consumeError(std::move(Err));
+
+    if (auto Err = (*E)->compile("def f(x) x * 2;")) {
+        logAllUnhandledErrors(std::move(Err), errs(), "Error: ");
+        return 1;
+    }
+
+    auto Result = (*E)->call("g", {3});
+    if (!Result) {
+        logAllUnhandledErrors(Result.takeError(), errs(), "Error: ");
+        return 1;
+    }
+    check(*Result == 7, "g calls the definition of f that compiled");
+
+    return NumFailures ? 1 : 0;
+}
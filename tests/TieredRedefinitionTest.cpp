@@ -0,0 +1,61 @@
+#include "../headers/Engine.h"
+
+#include <cstdio>
+
+/*
+    Redefining a function in tiered mode, after it (and a caller) got hot
+    enough to be recompiled at tier 1: the stub must move to the new
+    definition, for old callers too, and the old definition's tier-up must
+    not point it back at old code.
+
+    Exits with 1 if a check fails.
+*/
+
+static unsigned NumFailures = 0;
+
+static void check(bool Cond, const char* What) {
+    if (!Cond) {
+        fprintf(stderr, "FAILED: %s\n", What);
+        ++NumFailures;
+    }
+}
+
+// Calls Name(X) N times, and checks every result is Expected.
+static bool callRepeatedly(Engine &E, StringRef Name, double X, double Expected, unsigned N) {
+    for (unsigned I = 0; I != N; ++I) {
+        auto Result = E.call(Name, {X});
+        if (!Result) {
+            logAllUnhandledErrors(Result.takeError(), errs(), "Error: ");
+            return false;
+        }
+        if (*Result != Expected)
+            return false;
+    }
+    return true;
+}
+
+int main() {
+    EngineOptions Opts;
+    Opts.Tiered = true;
+    Opts.TierUpThreshold = 2;
+    auto E = Engine::create(Opts);
+    if (!E) {
+        logAllUnhandledErrors(E.takeError(), errs(), "Error: ");
+        return 1;
+    }
+
+    if (auto Err = (*E)->compile("def f(x) x + 1; def g(x) f(x) * 10;")) {
+        logAllUnhandledErrors(std::move(Err), errs(), "Error: ");
+        return 1;
+    }
+    check(callRepeatedly(**E, "g", 3, 40, 100), "g calls the first f");
+
+    if (auto Err = (*E)->compile("def f(x) x * 2;")) {
+        logAllUnhandledErrors(std::move(Err), errs(), "Error: ");
+        return 1;
+    }
+    check(callRepeatedly(**E, "f", 3, 6, 100), "f is the redefinition");
+    check(callRepeatedly(**E, "g", 3, 60, 100), "g calls the redefinition");
+
+    return NumFailures ? 1 : 0;
+}